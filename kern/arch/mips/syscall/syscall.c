@@ -126,6 +126,13 @@ syscall(struct trapframe *tf)
 			(userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_spawn:
+		err = sys_spawn(
+			(userptr_t)tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			&retval);
+		break;
+
 	    case SYS__exit:
 		sys__exit(tf->tf_a0);
 		panic("Returning from exit\n");
@@ -178,6 +185,68 @@ syscall(struct trapframe *tf)
 			tf->tf_a2,
 			&retval);
 		break;
+	    case SYS_readv:
+		err = sys_readv(
+			tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			tf->tf_a2,
+			&retval);
+		break;
+	    case SYS_writev:
+		err = sys_writev(
+			tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			tf->tf_a2,
+			&retval);
+		break;
+	    case SYS_sendfile:
+		err = sys_sendfile(
+			tf->tf_a0,
+			tf->tf_a1,
+			(userptr_t)tf->tf_a2,
+			tf->tf_a3,
+			&retval);
+		break;
+	    case SYS_aio_setup:
+		err = sys_aio_setup(
+			(userptr_t)tf->tf_a0,
+			tf->tf_a1);
+		break;
+	    case SYS_aio_enter:
+		err = sys_aio_enter(
+			tf->tf_a0,
+			tf->tf_a1,
+			&retval);
+		break;
+	    case SYS_pread:
+	    case SYS_pwrite:
+		{
+			/*
+			 * The position argument is 64 bits wide and
+			 * would be in a3 and the next register, so it
+			 * gets bumped onto the stack (as with lseek's
+			 * whence).
+			 */
+			off_t pos;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &pos, sizeof(pos));
+			if (err) {
+				break;
+			}
+
+			if (callno == SYS_pread) {
+				err = sys_pread(tf->tf_a0,
+						(userptr_t)tf->tf_a1,
+						tf->tf_a2, pos, &retval);
+			}
+			else {
+				err = sys_pwrite(tf->tf_a0,
+						 (userptr_t)tf->tf_a1,
+						 tf->tf_a2, pos, &retval);
+			}
+		}
+		break;
 	    case SYS_lseek:
 		{
 			/*
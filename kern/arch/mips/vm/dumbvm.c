@@ -400,6 +400,27 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * dumbvm can't map arbitrary pages, so copy into the stack instead.
+ */
+int
+as_map_page(struct addrspace *as, vaddr_t vaddr, vaddr_t kpage)
+{
+	vaddr_t stackbase;
+
+	KASSERT(as->as_stackpbase != 0);
+
+	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	if (vaddr < stackbase || vaddr >= USERSTACK) {
+		return EFAULT;
+	}
+
+	memmove((void *)PADDR_TO_KVADDR(as->as_stackpbase + (vaddr - stackbase)),
+		(const void *)kpage, PAGE_SIZE);
+	free_kpages(kpage);
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
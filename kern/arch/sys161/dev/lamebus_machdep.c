@@ -76,6 +76,42 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Zero c0_count. (Writing c0_compare doesn't, so without this the
+ * timer might have to go all the way around before it matches.)
+ */
+static
+void
+mips_timer_restart(void)
+{
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 $0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		);
+}
+
+/*
+ * Read c0_count.
+ */
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -119,6 +155,47 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+/*
+ * Stop the on-chip timer on this cpu, for tickless idle. It can't
+ * actually be turned off, so push the next interrupt out as far as
+ * it will go (about three minutes).
+ */
+void
+mainbus_hardclock_stop(void)
+{
+	mips_timer_set(0xffffffff);
+}
+
+/*
+ * Start it again.
+ */
+void
+mainbus_hardclock_start(void)
+{
+	mips_timer_restart();
+	mips_timer_set(CPU_FREQUENCY / HZ);
+}
+
+/*
+ * Return a cycle count for the current cpu. c0_count goes back to 0
+ * every time the timer fires, so add in the hardclocks we've taken.
+ * This doesn't advance while the cpu is tickless, and different
+ * cpus' counts drift apart, so only compare values taken on the
+ * same cpu over a short interval.
+ */
+uint64_t
+mainbus_cycles(void)
+{
+	uint64_t ret;
+	int spl;
+
+	spl = splhigh();
+	ret = (uint64_t)curcpu->c_hardclocks * (CPU_FREQUENCY / HZ);
+	ret += mips_timer_get();
+	splx(spl);
+	return ret;
+}
+
 /*
  * Start all secondary CPUs.
  */
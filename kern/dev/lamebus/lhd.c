@@ -39,6 +39,7 @@
 #include <synch.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <diskq.h>
 #include <lamebus/lhd.h>
 #include "autoconf.h"
 
@@ -107,10 +108,79 @@ lhd_iodone(struct lhd_softc *lh, int err)
 	V(lh->lh_done);
 }
 
+/*
+ * Start the next sector of the request in lh_uio: if writing, copy
+ * the data into the on-card buffer, then tell the disk which sector
+ * and go.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct uio *uio = lh->lh_uio;
+	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
+	int result;
+
+	if (uio->uio_rw == UIO_WRITE) {
+		/* (can't fail; lhd_io only does this for kernel buffers) */
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		KASSERT(result == 0);
+		membar_store_store();
+	}
+	lhd_wreg(lh, LHD_REG_SECT, sector);
+	lhd_wreg(lh, LHD_REG_STAT, lh->lh_statval);
+}
+
+/*
+ * Give back to the uio the sector lhd_startsector took out of it for
+ * a write that then failed, so the caller sees (and can retry) the
+ * right amount. lhd_io makes sure each sector lies within one iovec,
+ * and uiomove leaves uio_iov on the iovec it last took from.
+ */
+static
+void
+lhd_unmove(struct uio *uio)
+{
+	struct iovec *iov = uio->uio_iov;
+
+	iov->iov_kbase = (char *)iov->iov_kbase - LHD_SECTSIZE;
+	iov->iov_len += LHD_SECTSIZE;
+	uio->uio_resid += LHD_SECTSIZE;
+	uio->uio_offset -= LHD_SECTSIZE;
+}
+
+/*
+ * A sector of the request in lh_uio finished (with error ERR). If
+ * reading, copy the data out of the on-card buffer; then, unless
+ * something went wrong or that was the last one, start the next
+ * sector right away, so the disk doesn't wait on the thread that
+ * asked for the I/O to get scheduled again.
+ */
+static
+void
+lhd_nextsector(struct lhd_softc *lh, int err)
+{
+	struct uio *uio = lh->lh_uio;
+
+	if (err == 0 && uio->uio_rw == UIO_READ) {
+		membar_load_load();
+		err = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	}
+	else if (err != 0 && uio->uio_rw == UIO_WRITE) {
+		lhd_unmove(uio);
+	}
+
+	if (err == 0 && uio->uio_resid > 0) {
+		lhd_startsector(lh);
+		return;
+	}
+	lhd_iodone(lh, err);
+}
+
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register and report completion, or go on to the next sector.
  */
 void
 lhd_irq(void *vlh)
@@ -128,7 +198,12 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		if (lh->lh_uio != NULL) {
+			lhd_nextsector(lh, lhd_code_to_errno(lh, val));
+		}
+		else {
+			lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		}
 		break;
 	}
 }
@@ -180,13 +255,43 @@ lhd_reset(struct lhd_softc *lh)
 #endif
 
 /*
- * I/O function (for both reads and writes)
+ * Check if a request can be run from the interrupt handler: the data
+ * has to be in the kernel, since there's no telling what address
+ * space is current during an interrupt, and each sector has to fall
+ * within one iovec (see lhd_unmove).
+ */
+static
+bool
+lhd_canpipeline(struct uio *uio)
+{
+	unsigned i;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return false;
+	}
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		if (uio->uio_iov[i].iov_len % LHD_SECTSIZE != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Do a transfer (either a read or a write); this is called by the
+ * request queue's worker thread.
+ *
+ * Requests into kernel buffers (which is what the file system makes)
+ * are run sector by sector from the interrupt handler, which starts
+ * each sector as soon as the previous one is done, and we wait just
+ * once for the whole thing. Otherwise we go a sector at a time,
+ * moving the data ourselves.
  */
 static
 int
-lhd_io(struct device *d, struct uio *uio)
+lhd_doio(void *vlh, struct uio *uio)
 {
-	struct lhd_softc *lh = d->d_data;
+	struct lhd_softc *lh = vlh;
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
@@ -212,6 +317,24 @@ lhd_io(struct device *d, struct uio *uio)
 		statval |= LHD_ISWRITE;
 	}
 
+	if (len > 0 && lhd_canpipeline(uio)) {
+		/* Wait until nobody else is using the device. */
+		P(lh->lh_clear);
+
+		/* Hand the request to the interrupt handler and start it */
+		lh->lh_uio = uio;
+		lh->lh_statval = statval;
+		lhd_startsector(lh);
+
+		/* Wait until it's done all the sectors, or failed. */
+		P(lh->lh_done);
+		result = lh->lh_result;
+		lh->lh_uio = NULL;
+
+		V(lh->lh_clear);
+		return result;
+	}
+
 	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
 
@@ -264,6 +387,19 @@ lhd_io(struct device *d, struct uio *uio)
 	return 0;
 }
 
+/*
+ * I/O function (for both reads and writes): queue the request so it
+ * can be done in a sensible order along with everyone else's.
+ */
+static
+int
+lhd_io(struct device *d, struct uio *uio)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	return diskq_io(lh->lh_queue, uio);
+}
+
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
@@ -284,6 +420,10 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
+	/* No request in progress. */
+	lh->lh_uio = NULL;
+	lh->lh_statval = 0;
+
 	/* Create the semaphores. */
 	lh->lh_clear = sem_create("lhd-clear", 1);
 	if (lh->lh_clear == NULL) {
@@ -296,6 +436,16 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 		return ENOMEM;
 	}
 
+	/* Create the request queue. */
+	lh->lh_queue = diskq_create(name, LHD_SECTSIZE, lhd_doio, lh);
+	if (lh->lh_queue == NULL) {
+		sem_destroy(lh->lh_done);
+		lh->lh_done = NULL;
+		sem_destroy(lh->lh_clear);
+		lh->lh_clear = NULL;
+		return ENOMEM;
+	}
+
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
@@ -32,6 +32,8 @@
 
 #include <device.h>
 
+struct diskq;	/* in diskq.h */
+
 /*
  * Our sector size
  */
@@ -55,6 +57,15 @@ struct lhd_softc {
 	struct semaphore *lh_clear;	/* Synchronization */
 	struct semaphore *lh_done;
 
+	/*
+	 * Request being run from the interrupt handler, if any (see
+	 * lhd_io), and the value to start each sector with.
+	 */
+	struct uio *lh_uio;
+	uint32_t lh_statval;
+
+	struct diskq *lh_queue;		/* Requests waiting for the disk */
+
 	struct device lh_dev;		/* VFS device structure */
 };
 
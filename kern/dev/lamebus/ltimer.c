@@ -85,16 +85,15 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 
 	/*
 	 * We do, however, use ltimer for the timer clock, since the
-	 * on-chip timer can't do that.
+	 * on-chip timer can't do that. It runs one-shot; the clock
+	 * code sets it for whenever the next timeout is due.
 	 */
 	if (!havetimerclock) {
 		havetimerclock = true;
 		lt->lt_timerclock = 1;
 
-		/* Wire it to go off once every second. */
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 1);
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT,
-				   LT_GRANULARITY);
+		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 0);
+		timerclock_attach(lt, ltimer_setalarm);
 	}
 
 	return 0;
@@ -127,6 +126,23 @@ ltimer_irq(void *vlt)
 	}
 }
 
+/*
+ * Set the countdown timer to go off (once) in USECS microseconds.
+ * This replaces any countdown already in progress. Used by the clock
+ * code for timerclock.
+ */
+void
+ltimer_setalarm(void *vlt, uint32_t usecs)
+{
+	struct ltimer_softc *lt = vlt;
+
+	if (usecs == 0) {
+		/* Round up to the shortest delay we can ask for. */
+		usecs = 1;
+	}
+	bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT, usecs);
+}
+
 /*
  * The timer device will beep if you write to the beep register. It
  * doesn't matter what value you write. This function is called if
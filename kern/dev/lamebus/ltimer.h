@@ -48,6 +48,9 @@ struct ltimer_softc {
 /* Functions called by lower-level drivers */
 void ltimer_irq(/*struct ltimer_softc*/ void *lt);  // interrupt handler
 
+/* Function called by the clock code (for timerclock) */
+void ltimer_setalarm(/*struct ltimer_softc*/ void *lt, uint32_t usecs);
+
 /* Functions called by higher-level devices */
 void ltimer_beep(/*struct ltimer_softc*/ void *devdata);   // for beep device
 void ltimer_gettime(/*struct ltimer_softc*/ void *devdata,
@@ -35,20 +35,41 @@
 #include <types.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Number of blocks (counting the one it asked for) set aside for a
+ * file when a block is allocated for it, so that a file being
+ * written sequentially ends up contiguous even if other files are
+ * being written at the same time.
+ *
+ * Reserved blocks are marked in sfs_freemap, so nobody else gets
+ * them, and also in sfs_resmap, so that sfs_freemapio can leave them
+ * out when it writes the freemap. On disk they are always free.
+ */
+#define SFS_PREALLOC	8
+
+/*
+ * Zero out a disk block. This only zeroes its buffer; there's no
+ * need to read the old contents first.
  */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct sfs_buf *buf;
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = sfs_buf_get(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(sfs_buf_data(buf), SFS_BLOCKSIZE);
+	sfs_buf_dirty(buf);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 /*
@@ -59,33 +80,150 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
 
-	/* Clear block before returning it */
+	/*
+	 * Clear block before returning it. Nobody else can see the
+	 * block yet, so this doesn't need the freemap lock.
+	 */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
+		lock_acquire(sfs->sfs_freemaplock);
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
 
+/*
+ * Allocate a block for a file (either data or an indirect block).
+ * GOAL is where it would be best to put it: right after the file's
+ * previous block, if the caller knows that; otherwise 0, meaning
+ * right after the last block we allocated for the file, or its inode.
+ *
+ * If the goal is the next of the blocks reserved for the file, use
+ * that. Otherwise, give back any reserved blocks, allocate the free
+ * block nearest after the goal, and reserve the ones after it if
+ * they're free.
+ *
+ * The caller must hold sv_lock exclusively.
+ */
+int
+sfs_balloc_file(struct sfs_vnode *sv, daddr_t goal, daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block;
+	unsigned i;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	if (goal == 0) {
+		goal = sv->sv_lastblock + 1;
+	}
+
+	if (sv->sv_npre > 0 && goal == sv->sv_prealloc) {
+		/* Already marked in use; it's no longer just reserved */
+		block = sv->sv_prealloc++;
+		sv->sv_npre--;
+
+		lock_acquire(sfs->sfs_freemaplock);
+		bitmap_unmark(sfs->sfs_resmap, block);
+		sfs->sfs_freemapdirty = true;
+		lock_release(sfs->sfs_freemaplock);
+	}
+	else {
+		sfs_bunreserve(sv);
+
+		lock_acquire(sfs->sfs_freemaplock);
+		result = bitmap_alloc_near(sfs->sfs_freemap, goal, &block);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		for (i=1; i<SFS_PREALLOC; i++) {
+			if (block + i >= sfs->sfs_sb.sb_nblocks ||
+			    bitmap_isset(sfs->sfs_freemap, block + i)) {
+				break;
+			}
+			bitmap_mark(sfs->sfs_freemap, block + i);
+			bitmap_mark(sfs->sfs_resmap, block + i);
+		}
+		sfs->sfs_freemapdirty = true;
+		lock_release(sfs->sfs_freemaplock);
+
+		sv->sv_prealloc = block + 1;
+		sv->sv_npre = i - 1;
+	}
+
+	if (block >= sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: balloc: invalid block %u\n",
+		      sfs->sfs_sb.sb_volname, block);
+	}
+
+	/* Clear it, as in sfs_balloc */
+	result = sfs_clearblock(sfs, block);
+	if (result) {
+		lock_acquire(sfs->sfs_freemaplock);
+		bitmap_unmark(sfs->sfs_freemap, block);
+		lock_release(sfs->sfs_freemaplock);
+		return result;
+	}
+
+	sv->sv_lastblock = block;
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Give back the blocks reserved for a file. The caller must hold
+ * sv_lock exclusively.
+ */
+void
+sfs_bunreserve(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	if (sv->sv_npre == 0) {
+		return;
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	while (sv->sv_npre > 0) {
+		sv->sv_npre--;
+		bitmap_unmark(sfs->sfs_freemap, sv->sv_prealloc + sv->sv_npre);
+		bitmap_unmark(sfs->sfs_resmap, sv->sv_prealloc + sv->sv_npre);
+	}
+	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+}
+
 /*
  * Free a block.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	/* drop any cached copy before someone else can allocate it */
+	sfs_buf_forget(sfs, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +232,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
@@ -36,38 +36,288 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * Number of file blocks mapped by one entry of an indirect block at
+ * each level of indirection: a (single) indirect block points to data
+ * blocks, a double indirect block to indirect blocks, and so on.
+ */
+#define SFS_SPAN1	1
+#define SFS_SPAN2	(SFS_SPAN1 * SFS_DBPERIDB)
+#define SFS_SPAN3	(SFS_SPAN2 * SFS_DBPERIDB)
+
+static const uint32_t sfs_span[4] = { 0, SFS_SPAN1, SFS_SPAN2, SFS_SPAN3 };
+
+////////////////////////////////////////////////////////////
+//
+// Extent cache
+
+/*
+ * Set up and tear down a vnode's extent cache (and the read-ahead
+ * state, which shares its lock).
+ */
+void
+sfs_extent_init(struct sfs_vnode *sv)
+{
+	unsigned i;
+
+	spinlock_init(&sv->sv_extlock);
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		sv->sv_extents[i].se_len = 0;
+	}
+	sv->sv_nextext = 0;
+	sv->sv_ranext = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
+}
+
+void
+sfs_extent_cleanup(struct sfs_vnode *sv)
+{
+	spinlock_cleanup(&sv->sv_extlock);
+}
+
+/*
+ * Look for FILEBLOCK in the extent cache. If found, hand back its
+ * disk block and how many blocks (at most MAXBLOCKS) follow it
+ * contiguously, and return true.
+ */
+static
+bool
+sfs_extent_lookup(struct sfs_vnode *sv, uint32_t fileblock,
+		  uint32_t maxblocks, daddr_t *diskblock, uint32_t *nblocks)
+{
+	struct sfs_extent *se;
+	uint32_t skip;
+	unsigned i;
+	bool found = false;
+
+	spinlock_acquire(&sv->sv_extlock);
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		se = &sv->sv_extents[i];
+		if (fileblock < se->se_fileblock ||
+		    fileblock - se->se_fileblock >= se->se_len) {
+			continue;
+		}
+		skip = fileblock - se->se_fileblock;
+		*diskblock = se->se_diskblock + skip;
+		*nblocks = se->se_len - skip;
+		if (*nblocks > maxblocks) {
+			*nblocks = maxblocks;
+		}
+		found = true;
+		break;
+	}
+	spinlock_release(&sv->sv_extlock);
+	return found;
+}
+
+/*
+ * Add a run of mapped blocks to the extent cache. If it continues an
+ * extent we already have (as it will when a file is written or read
+ * sequentially), grow that extent; otherwise replace one round-robin.
+ */
+static
+void
+sfs_extent_add(struct sfs_vnode *sv, uint32_t fileblock, daddr_t diskblock,
+	       uint32_t nblocks)
+{
+	struct sfs_extent *se;
+	unsigned i;
+
+	KASSERT(diskblock != 0);
+	KASSERT(nblocks > 0);
+
+	spinlock_acquire(&sv->sv_extlock);
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		se = &sv->sv_extents[i];
+		if (se->se_len == 0) {
+			continue;
+		}
+		if (se->se_fileblock + se->se_len == fileblock &&
+		    se->se_diskblock + se->se_len == diskblock) {
+			/* Appends to this one */
+			se->se_len += nblocks;
+			spinlock_release(&sv->sv_extlock);
+			return;
+		}
+		if (se->se_fileblock == fileblock) {
+			/* Same start; keep whichever is longer */
+			KASSERT(se->se_diskblock == diskblock);
+			if (se->se_len < nblocks) {
+				se->se_len = nblocks;
+			}
+			spinlock_release(&sv->sv_extlock);
+			return;
+		}
+	}
+
+	se = &sv->sv_extents[sv->sv_nextext];
+	se->se_fileblock = fileblock;
+	se->se_diskblock = diskblock;
+	se->se_len = nblocks;
+	sv->sv_nextext = (sv->sv_nextext + 1) % SFS_NEXTENTS;
+	spinlock_release(&sv->sv_extlock);
+}
+
+/*
+ * Forget everything in the extent cache. Called when blocks are
+ * removed from the file; the caller holds sv_lock exclusively, so
+ * nobody is looking anything up meanwhile.
+ */
+static
+void
+sfs_extent_invalidate(struct sfs_vnode *sv)
+{
+	unsigned i;
+
+	spinlock_acquire(&sv->sv_extlock);
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		sv->sv_extents[i].se_len = 0;
+	}
+	sv->sv_nextext = 0;
+	spinlock_release(&sv->sv_extlock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Block mapping
+
+/*
+ * Look up a block in the tree of indirect blocks (LEVELS deep) whose
+ * top block number is in *IDBLOCKP, which is a field of the inode.
+ * OFFSET is the file block number relative to the first block the
+ * tree maps. Allocates blocks (including indirect blocks) on the way
+ * if DOALLOC is set; otherwise a missing block anywhere on the way
+ * means a hole, and we hand back 0.
+ *
+ * Also hands back in *RUN how many blocks from OFFSET on (at least
+ * one, at most MAXRUN) are contiguous on disk, or for a hole, how
+ * many are unmapped. Only the last indirect block we look at is
+ * examined, so a run never crosses into the next one.
  */
+static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+sfs_bmap_indirect(struct sfs_vnode *sv, uint32_t *idblockp, unsigned levels,
+		  uint32_t offset, bool doalloc, uint32_t maxrun,
+		  daddr_t *diskblock, uint32_t *run)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	/* Buffer (from the buffer cache) holding an indirect block */
+	struct sfs_buf *buf;
+	uint32_t *idbuf;
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	daddr_t block, next, goal;
+	uint32_t idoff, j, n;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(levels > 0);
+	KASSERT(maxrun > 0);
+
+	block = *idblockp;
+	if (block == 0) {
+		if (!doalloc) {
+			/*
+			 * There's no indirect block allocated. We
+			 * weren't asked to allocate anything, so
+			 * pretend it was filled with all zeros.
+			 */
+			n = sfs_span[levels] * SFS_DBPERIDB - offset;
+			*diskblock = 0;
+			*run = n < maxrun ? n : maxrun;
+			return 0;
+		}
+
+		/* Allocate it. (sfs_balloc_file zeroes it for us.) */
+		result = sfs_balloc_file(sv, 0, &block);
+		if (result) {
+			return result;
+		}
+
+		/* Remember the block we just allocated; mark inode dirty */
+		*idblockp = block;
+		sv->sv_dirty = true;
+	}
+
+	/* Walk down the tree, one indirect block per level */
+	for (;; levels--) {
+		idoff = offset / sfs_span[levels];
+		offset %= sfs_span[levels];
+		KASSERT(idoff < SFS_DBPERIDB);
+
+		result = sfs_buf_get(sfs, block, true, &buf);
+		if (result) {
+			return result;
+		}
+		idbuf = sfs_buf_data(buf);
+
+		/* Get the next block out of the indirect block */
+		next = idbuf[idoff];
+
+		/*
+		 * If there's no block there, allocate one; if it's a data
+		 * block, try to put it right after the one before it.
+		 */
+		if (next == 0 && doalloc) {
+			goal = 0;
+			if (levels == 1 && idoff > 0 && idbuf[idoff-1] != 0) {
+				goal = idbuf[idoff-1] + 1;
+			}
+			result = sfs_balloc_file(sv, goal, &next);
+			if (result) {
+				sfs_buf_release(buf);
+				return result;
+			}
+
+			/* Remember it; the indirect block is now dirty */
+			idbuf[idoff] = next;
+			sfs_buf_dirty(buf);
+		}
+
+		if (next == 0 || levels == 1) {
+			/*
+			 * Either a hole, which covers at least the rest
+			 * of the subtree we were about to descend into,
+			 * or the data block itself. See how much further
+			 * the run goes in this indirect block.
+			 */
+			n = sfs_span[levels] - offset;
+			for (j = idoff+1; j < SFS_DBPERIDB && n < maxrun; j++) {
+				if (next == 0 ? idbuf[j] != 0 :
+				    idbuf[j] != next + (j - idoff)) {
+					break;
+				}
+				n += sfs_span[levels];
+			}
+			sfs_buf_release(buf);
+
+			*diskblock = next;
+			*run = n < maxrun ? n : maxrun;
+			return 0;
+		}
+		sfs_buf_release(buf);
+		block = next;
+	}
+}
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+/*
+ * Map FILEBLOCK through the direct and indirect blocks. The run of
+ * direct blocks is found the same way as in sfs_bmap_indirect, by
+ * scanning the rest of the array.
+ */
+static
+int
+sfs_bmap_tree(struct sfs_vnode *sv, uint32_t fileblock, uint32_t maxrun,
+	      bool doalloc, daddr_t *diskblock, uint32_t *run)
+{
+	uint32_t *idblockp;
+	unsigned levels;
+	daddr_t block, goal;
+	uint32_t j, n;
+	int result;
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +332,12 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			goal = 0;
+			if (fileblock > 0 &&
+			    sv->sv_i.sfi_direct[fileblock-1] != 0) {
+				goal = sv->sv_i.sfi_direct[fileblock-1] + 1;
+			}
+			result = sfs_balloc_file(sv, goal, &block);
 			if (result) {
 				return result;
 			}
@@ -92,140 +347,471 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 			sv->sv_dirty = true;
 		}
 
-		/*
-		 * Hand back the block
-		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: %s: Data block %u (block %u of file %u) "
-			      "marked free\n", sfs->sfs_sb.sb_volname,
-			      block, fileblock, sv->sv_ino);
+		n = 1;
+		for (j = fileblock+1; j < SFS_NDIRECT && n < maxrun; j++) {
+			if (block == 0 ? sv->sv_i.sfi_direct[j] != 0 :
+			    sv->sv_i.sfi_direct[j] != block + n) {
+				break;
+			}
+			n++;
 		}
 		*diskblock = block;
+		*run = n;
 		return 0;
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block. Subtract off the number of direct
+	 * blocks, and then the number mapped by each level of
+	 * indirection in turn, until we find the one it's in.
 	 */
-
 	fileblock -= SFS_NDIRECT;
+	if (fileblock < SFS_SPAN2) {
+		idblockp = &sv->sv_i.sfi_indirect;
+		levels = 1;
+	}
+	else {
+		fileblock -= SFS_SPAN2;
+		if (fileblock < SFS_SPAN3) {
+			idblockp = &sv->sv_i.sfi_dindirect;
+			levels = 2;
+		}
+		else {
+			fileblock -= SFS_SPAN3;
+			if (fileblock >= SFS_SPAN3 * SFS_DBPERIDB) {
+				/* Too large; we can't handle it. */
+				return EFBIG;
+			}
+			idblockp = &sv->sv_i.sfi_tindirect;
+			levels = 3;
+		}
+	}
+
+	return sfs_bmap_indirect(sv, idblockp, levels, fileblock, doalloc,
+				 maxrun, diskblock, run);
+}
 
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+////////////////////////////////////////////////////////////
+//
+// On-disk extents
 
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
-	}
+/*
+ * Check if the volume keeps extent tables in its inodes.
+ */
+static
+bool
+sfs_hasextents(struct sfs_fs *sfs)
+{
+	return (sfs->sfs_sb.sb_features & SFS_FEATURE_EXTENTS) != 0;
+}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+/*
+ * Count the extents in use in an inode.
+ */
+static
+unsigned
+sfs_dext_count(const struct sfs_dinode *sfi)
+{
+	unsigned i;
 
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
+	for (i=0; i<SFS_NDEXTENTS; i++) {
+		if (sfi->sfi_extents[i].sfe_len == 0) {
+			break;
+		}
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
+	return i;
+}
+
+/*
+ * Find the first extent in use that ends after FILEBLOCK. It is
+ * either the one that maps FILEBLOCK or the next one after it.
+ * Returns the number of extents in use if there isn't one.
+ */
+static
+unsigned
+sfs_dext_find(const struct sfs_dinode *sfi, uint32_t fileblock)
+{
+	const struct sfs_dextent *sfe;
+	unsigned i;
+
+	for (i=0; i<SFS_NDEXTENTS; i++) {
+		sfe = &sfi->sfi_extents[i];
+		if (sfe->sfe_len == 0 ||
+		    sfe->sfe_fileblock + sfe->sfe_len > fileblock) {
+			break;
 		}
+	}
+	return i;
+}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+/*
+ * Remove extent I from an inode, moving the ones after it down.
+ */
+static
+void
+sfs_dext_remove(struct sfs_dinode *sfi, unsigned i)
+{
+	struct sfs_dextent *ext = sfi->sfi_extents;
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+	KASSERT(i < SFS_NDEXTENTS);
+	memmove(&ext[i], &ext[i+1], (SFS_NDEXTENTS - i - 1) * sizeof(ext[0]));
+	bzero(&ext[SFS_NDEXTENTS - 1], sizeof(ext[0]));
+}
+
+/*
+ * Allocate a block for FILEBLOCK, which nothing maps yet, and record
+ * it in the extent table. I is what sfs_dext_find returned for it.
+ *
+ * We ask for the block after the end of the extent before it, and if
+ * we get it that extent just grows; likewise an extent that starts at
+ * the next file block can grow downwards. Otherwise the block gets
+ * an extent of its own. If the table is full, the block goes in the
+ * direct/indirect blocks instead.
+ */
+static
+int
+sfs_dext_alloc(struct sfs_vnode *sv, uint32_t fileblock, unsigned i,
+	       daddr_t *diskblock, uint32_t *run)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dextent *ext = sv->sv_i.sfi_extents;
+	struct sfs_dextent *prev, *next;
+	unsigned nused;
+	daddr_t block, goal;
+	int result;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+	nused = sfs_dext_count(&sv->sv_i);
+	KASSERT(i <= nused);
+
+	prev = NULL;
+	next = NULL;
+	goal = 0;
+	if (i > 0) {
+		goal = ext[i-1].sfe_diskblock + ext[i-1].sfe_len;
+		if (ext[i-1].sfe_fileblock + ext[i-1].sfe_len == fileblock) {
+			prev = &ext[i-1];
+		}
+	}
+	if (i < nused && ext[i].sfe_fileblock == fileblock + 1) {
+		next = &ext[i];
+	}
+
+	if (prev == NULL && next == NULL && nused == SFS_NDEXTENTS) {
+		/* Nothing to grow and no room for a new extent */
+		return sfs_bmap_tree(sv, fileblock, 1, true, diskblock, run);
+	}
+
+	result = sfs_balloc_file(sv, goal, &block);
+	if (result) {
+		return result;
+	}
+
+	if (prev != NULL && block == goal) {
+		prev->sfe_len++;
+		if (next != NULL && next->sfe_diskblock == block + 1) {
+			/* It closes the gap to the next one; merge them */
+			prev->sfe_len += next->sfe_len;
+			sfs_dext_remove(&sv->sv_i, i);
+		}
+	}
+	else if (next != NULL && next->sfe_diskblock == block + 1) {
+		next->sfe_fileblock--;
+		next->sfe_diskblock--;
+		next->sfe_len++;
+	}
+	else if (nused < SFS_NDEXTENTS) {
+		memmove(&ext[i+1], &ext[i], (nused - i) * sizeof(ext[0]));
+		ext[i].sfe_fileblock = fileblock;
+		ext[i].sfe_diskblock = block;
+		ext[i].sfe_len = 1;
 	}
 	else {
 		/*
-		 * We already have an indirect block allocated; load it.
+		 * We didn't get the block we wanted, so it doesn't
+		 * extend anything, and there's no room for it. Give it
+		 * back and use the indirect blocks.
 		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+		sfs_bfree(sfs, block);
+		return sfs_bmap_tree(sv, fileblock, 1, true, diskblock, run);
 	}
+	sv->sv_dirty = true;
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	*diskblock = block;
+	*run = 1;
+	return 0;
+}
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
+/*
+ * Discard the parts of the extents at or past file block BLOCKLEN.
+ */
+static
+void
+sfs_dext_trunc(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dextent *sfe;
+	uint32_t keep, j;
+	unsigned i;
+
+	i = 0;
+	while (i < SFS_NDEXTENTS && sv->sv_i.sfi_extents[i].sfe_len > 0) {
+		sfe = &sv->sv_i.sfi_extents[i];
+		if (sfe->sfe_fileblock >= blocklen) {
+			keep = 0;
+		}
+		else if (blocklen - sfe->sfe_fileblock < sfe->sfe_len) {
+			keep = blocklen - sfe->sfe_fileblock;
+		}
+		else {
+			/* All of it is before the new EOF */
+			i++;
+			continue;
 		}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		for (j = keep; j < sfe->sfe_len; j++) {
+			sfs_bfree(sfs, sfe->sfe_diskblock + j);
+		}
+		sv->sv_dirty = true;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+		if (keep > 0) {
+			sfe->sfe_len = keep;
+			i++;
+		}
+		else {
+			/* The next one slides down into slot I */
+			sfs_dext_remove(&sv->sv_i, i);
+		}
+	}
+}
+
+/*
+ * Map FILEBLOCK without consulting the extent cache; this does the
+ * work for sfs_bmap_range. On volumes with extent tables, look there
+ * first, and put newly allocated blocks there if possible.
+ */
+static
+int
+sfs_bmap_lookup(struct sfs_vnode *sv, uint32_t fileblock, uint32_t maxrun,
+		bool doalloc, daddr_t *diskblock, uint32_t *run)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dextent *sfe;
+	uint32_t skip;
+	unsigned i;
+	int result;
+
+	if (!sfs_hasextents(sfs)) {
+		return sfs_bmap_tree(sv, fileblock, maxrun, doalloc,
+				     diskblock, run);
+	}
+
+	i = sfs_dext_find(&sv->sv_i, fileblock);
+	if (i < SFS_NDEXTENTS && sv->sv_i.sfi_extents[i].sfe_len > 0) {
+		sfe = &sv->sv_i.sfi_extents[i];
+		if (fileblock >= sfe->sfe_fileblock) {
+			/* It's in this extent */
+			skip = fileblock - sfe->sfe_fileblock;
+			*diskblock = sfe->sfe_diskblock + skip;
+			*run = sfe->sfe_len - skip;
+			if (*run > maxrun) {
+				*run = maxrun;
+			}
+			return 0;
+		}
+		/* Don't let a run from the tree go into this extent */
+		if (maxrun > sfe->sfe_fileblock - fileblock) {
+			maxrun = sfe->sfe_fileblock - fileblock;
 		}
 	}
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: %s: Data block %u (block %u of file %u) "
-		      "marked free\n", sfs->sfs_sb.sb_volname,
-		      block, fileblock, sv->sv_ino);
+	result = sfs_bmap_tree(sv, fileblock, maxrun, false, diskblock, run);
+	if (result || *diskblock != 0 || !doalloc) {
+		return result;
 	}
-	*diskblock = block;
-	return 0;
+	return sfs_dext_alloc(sv, fileblock, i, diskblock, run);
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file, and find out how many of the following file blocks (up to
+ * MAXBLOCKS in all) come right after it on disk. The count is handed
+ * back in *NBLOCKS; it is always at least 1. If DOALLOC is set, and
+ * FILEBLOCK has no block, one will be allocated. (Only FILEBLOCK;
+ * the run is then usually just that one block.) Otherwise *DISKBLOCK
+ * is 0 for a hole, and *NBLOCKS is the size of the hole.
+ *
+ * The file's first SFS_NDIRECT blocks are listed in the inode. The
+ * next SFS_DBPERIDB are in the indirect block; after those come the
+ * blocks mapped by the double indirect block, and then by the triple
+ * indirect block. On volumes with SFS_FEATURE_EXTENTS, the inode's
+ * extent table comes before all that. Recently used runs are kept in
+ * the vnode's extent cache, so sequential I/O mostly doesn't need to
+ * look at any of it.
+ *
+ * The caller must hold sv_lock, exclusively if DOALLOC is set.
  */
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_bmap_range(struct sfs_vnode *sv, uint32_t fileblock, uint32_t maxblocks,
+	       bool doalloc, daddr_t *diskblock, uint32_t *nblocks)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block;
+	uint32_t run;
+	int result;
+
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+	KASSERT(!doalloc || rwlock_do_i_hold_write(sv->sv_lock));
+	KASSERT(maxblocks > 0);
+
+	if (sfs_extent_lookup(sv, fileblock, maxblocks, diskblock, nblocks)) {
+		return 0;
+	}
+
+	result = sfs_bmap_lookup(sv, fileblock, maxblocks, doalloc,
+				 &block, &run);
+	if (result) {
+		return result;
+	}
+	KASSERT(run > 0 && run <= maxblocks);
+
 	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
+	 * Hand back the block
 	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	if (block != 0) {
+		if (!sfs_bused(sfs, block)) {
+			panic("sfs: %s: Data block %u (block %u of file %u) "
+			      "marked free\n", sfs->sfs_sb.sb_volname,
+			      block, fileblock, sv->sv_ino);
+		}
+		sfs_extent_add(sv, fileblock, block, run);
+	}
+	*diskblock = block;
+	*nblocks = run;
+	return 0;
+}
+
+/*
+ * Look up just one block; see sfs_bmap_range.
+ */
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	 daddr_t *diskblock)
+{
+	uint32_t nblocks;
+
+	return sfs_bmap_range(sv, fileblock, 1, doalloc, diskblock, &nblocks);
+}
+
+/*
+ * Truncate the tree of indirect blocks (LEVELS deep) whose top block
+ * number is in *IDBLOCKP: discard everything it maps at or past file
+ * block BLOCKLEN. BASEBLOCK is the first file block the tree maps.
+ * If the tree ends up empty, its top block is freed and *IDBLOCKP
+ * cleared, and *CHANGED is set.
+ */
+static
+int
+sfs_itrunc_indirect(struct sfs_vnode *sv, uint32_t *idblockp, unsigned levels,
+		    uint32_t baseblock, uint32_t blocklen, bool *changed)
+{
+	/* Buffer holding the indirect block; see sfs_bmap_indirect. */
+	struct sfs_buf *buf;
+	uint32_t *idbuf;
 
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t span = sfs_span[levels];
+	uint32_t j, childbase;
+	bool hasnonzero, iddirty;
+	int result;
+
+	if (*idblockp == 0) {
+		return 0;
+	}
+	if (blocklen >= baseblock + span * SFS_DBPERIDB) {
+		/* The whole tree is before the proposed EOF */
+		return 0;
+	}
+
+	/* Read the indirect block */
+	result = sfs_buf_get(sfs, *idblockp, true, &buf);
+	if (result) {
+		return result;
+	}
+	idbuf = sfs_buf_data(buf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		childbase = baseblock + j * span;
+		if (idbuf[j] == 0) {
+			continue;
+		}
+		if (levels > 1) {
+			/* Discard the part of the subtree past the new EOF */
+			result = sfs_itrunc_indirect(sv, &idbuf[j], levels-1,
+						     childbase, blocklen,
+						     &iddirty);
+			if (result) {
+				if (iddirty) {
+					sfs_buf_dirty(buf);
+				}
+				sfs_buf_release(buf);
+				return result;
+			}
+		}
+		else if (childbase >= blocklen) {
+			/* Discard a block past the new EOF */
+			sfs_bfree(sfs, idbuf[j]);
+			idbuf[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (iddirty) {
+		sfs_buf_dirty(buf);
+	}
+	sfs_buf_release(buf);
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *idblockp);
+		*idblockp = 0;
+		*changed = true;
+	}
+	return 0;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim. The caller must hold
+ * sv_lock exclusively.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t i;
+	daddr_t block;
+	uint32_t baseblock;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	/* Blocks are about to go away; drop any cached mappings of them */
+	sfs_extent_invalidate(sv);
+	sfs_bunreserve(sv);
+
+	if (sfs_hasextents(sfs)) {
+		sfs_dext_trunc(sv, blocklen);
+	}
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -240,55 +826,24 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/* Then the indirect, double indirect, and triple indirect trees */
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+	result = sfs_itrunc_indirect(sv, &sv->sv_i.sfi_indirect, 1,
+				     baseblock, blocklen, &sv->sv_dirty);
+	if (result) {
+		return result;
+	}
+	baseblock += SFS_SPAN2;
+	result = sfs_itrunc_indirect(sv, &sv->sv_i.sfi_dindirect, 2,
+				     baseblock, blocklen, &sv->sv_dirty);
+	if (result) {
+		return result;
+	}
+	baseblock += SFS_SPAN3;
+	result = sfs_itrunc_indirect(sv, &sv->sv_i.sfi_tindirect, 3,
+				     baseblock, blocklen, &sv->sv_dirty);
+	if (result) {
+		return result;
 	}
 
 	/* Set the file size */
@@ -297,7 +852,5 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
-
@@ -0,0 +1,979 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ *
+ * All block I/O on all mounted SFS volumes goes through one pool of
+ * SFS_NBUFS block buffers, looked up by (volume, block) in a hash
+ * table. Buffers are reused in least-recently-used order.
+ *
+ * Writes are delayed: modifying a buffer just marks it dirty, and it
+ * goes to disk when it's evicted, when the volume is synced, or when
+ * the syncer thread gets to it, whichever comes first. Syncing writes
+ * the dirty buffers in block order, so the disk sweeps across once
+ * instead of seeking back and forth, and runs of adjacent dirty
+ * blocks go out in one device transfer (a cluster) rather than one
+ * at a time. sfs_buf_fill likewise reads a run of blocks the file
+ * system is about to want in as few transfers as it can, and
+ * sfs_buf_readahead asks the read-ahead thread to do that in the
+ * background for blocks it will probably want soon.
+ *
+ * To use a buffer, get it with sfs_buf_get, which hands back a
+ * reference; look at or change the data (from sfs_buf_data), call
+ * sfs_buf_dirty if it was changed, then sfs_buf_release. If the
+ * change failed partway (say, copying from a bad user address), call
+ * sfs_buf_abort instead of sfs_buf_dirty. A buffer gotten without
+ * reading the block in holds junk until it's been overwritten, so
+ * nobody else can get it until it's been marked dirty, and if it's
+ * released without that it's thrown away. Several
+ * threads can hold the same buffer at once; they're expected to be
+ * serialized by the file system's own locks (sv_lock and so on) if
+ * they're changing it. Buffers are only written out while nobody
+ * holds them, so a half-made change never goes to disk.
+ *
+ * sfs_buflock covers the whole cache. It is a leaf lock: it comes
+ * after all the SFS locks, and it isn't held across disk I/O.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Number of buffers (total cache size is this times SFS_BLOCKSIZE) */
+#define SFS_NBUFS	256
+
+/* Number of hash buckets */
+#define SFS_BUFHASHSIZE	64
+
+/* Seconds between runs of the syncer */
+#define SFS_SYNCINTERVAL	5
+
+/* Number of read-ahead requests that can be waiting */
+#define SFS_RAQUEUE	16
+
+/*
+ * Most blocks done in one device transfer. The iovecs go on the
+ * stack, so this can't be very big.
+ */
+#define SFS_MAXCLUSTER	16
+
+struct sfs_buf {
+	struct sfs_fs *b_sfs;		/* volume, or NULL if not in use */
+	daddr_t b_block;		/* block number on the volume */
+	struct sfs_buf *b_hashnext;	/* hash chain */
+	struct sfs_buf *b_lruprev;	/* LRU list, oldest first */
+	struct sfs_buf *b_lrunext;
+	unsigned b_refcount;		/* number of holders */
+	bool b_busy;			/* I/O in progress */
+	bool b_dirty;			/* needs writing */
+	bool b_unfilled;		/* not read in, not yet overwritten */
+	void *b_data;			/* the block */
+};
+
+static struct lock *sfs_buflock;
+static struct cv *sfs_bufcv;		/* buffer became unbusy/unheld */
+static struct sfs_buf *sfs_bufhash[SFS_BUFHASHSIZE];
+static struct sfs_buf *sfs_lruhead, *sfs_lrutail;
+static unsigned sfs_nbufs;
+
+/* Statistics */
+static unsigned sfs_bufhits, sfs_bufmisses;
+static unsigned sfs_bufwrites, sfs_bufevictions;
+static unsigned sfs_bufclusters, sfs_bufclustered;
+static unsigned sfs_rarequests, sfs_radropped;
+
+/*
+ * Read-ahead requests waiting for the read-ahead thread, as a ring;
+ * and the volume it's working on right now, if any. Protected by
+ * sfs_buflock.
+ */
+struct sfs_rareq {
+	struct sfs_fs *ra_sfs;
+	daddr_t ra_block;
+	unsigned ra_nblocks;
+};
+static struct sfs_rareq sfs_raqueue[SFS_RAQUEUE];
+static unsigned sfs_rahead, sfs_racount;
+static struct sfs_fs *sfs_rabusy;
+static struct cv *sfs_racv;		/* read-ahead request queued */
+
+////////////////////////////////////////////////////////////
+// hash and LRU lists
+
+static
+unsigned
+sfs_buf_hashfunc(struct sfs_fs *sfs, daddr_t block)
+{
+	return (((uintptr_t)sfs >> 6) + block) % SFS_BUFHASHSIZE;
+}
+
+static
+struct sfs_buf *
+sfs_buf_lookup(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	for (b = sfs_bufhash[sfs_buf_hashfunc(sfs, block)];
+	     b != NULL; b = b->b_hashnext) {
+		if (b->b_sfs == sfs && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_buf_hashinsert(struct sfs_buf *b)
+{
+	unsigned ix = sfs_buf_hashfunc(b->b_sfs, b->b_block);
+
+	b->b_hashnext = sfs_bufhash[ix];
+	sfs_bufhash[ix] = b;
+}
+
+static
+void
+sfs_buf_hashremove(struct sfs_buf *b)
+{
+	struct sfs_buf **bp;
+
+	bp = &sfs_bufhash[sfs_buf_hashfunc(b->b_sfs, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+sfs_buf_lruremove(struct sfs_buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		sfs_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		sfs_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Put a buffer at the most-recently-used end. */
+static
+void
+sfs_buf_lrutail(struct sfs_buf *b)
+{
+	b->b_lruprev = sfs_lrutail;
+	b->b_lrunext = NULL;
+	if (sfs_lrutail != NULL) {
+		sfs_lrutail->b_lrunext = b;
+	}
+	else {
+		sfs_lruhead = b;
+	}
+	sfs_lrutail = b;
+}
+
+/* Put a buffer at the least-recently-used end, to be reused first. */
+static
+void
+sfs_buf_lruhead(struct sfs_buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = sfs_lruhead;
+	if (sfs_lruhead != NULL) {
+		sfs_lruhead->b_lruprev = b;
+	}
+	else {
+		sfs_lrutail = b;
+	}
+	sfs_lruhead = b;
+}
+
+/*
+ * Take a buffer out of use. It goes to the front of the LRU list.
+ */
+static
+void
+sfs_buf_drop(struct sfs_buf *b)
+{
+	KASSERT(b->b_refcount == 0);
+	KASSERT(!b->b_busy);
+
+	if (b->b_sfs != NULL) {
+		sfs_buf_hashremove(b);
+		b->b_sfs = NULL;
+	}
+	b->b_dirty = false;
+	b->b_unfilled = false;
+	sfs_buf_lruremove(b);
+	sfs_buf_lruhead(b);
+}
+
+////////////////////////////////////////////////////////////
+// I/O
+
+/*
+ * Read or write the N buffers in BUFS, which are for consecutive
+ * blocks of the same volume, in one transfer. The caller has marked
+ * them busy. Call with sfs_buflock held; it's released during the
+ * I/O. The buffers are unbusied again afterwards.
+ */
+static
+int
+sfs_buf_clusterio(struct sfs_buf **bufs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SFS_MAXCLUSTER];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+	KASSERT(n > 0 && n <= SFS_MAXCLUSTER);
+
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_sfs == bufs[0]->b_sfs);
+		KASSERT(bufs[i]->b_block == bufs[0]->b_block + i);
+		iov[i].iov_kbase = bufs[i]->b_data;
+		iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	if (n > 1) {
+		sfs_bufclusters++;
+		sfs_bufclustered += n;
+	}
+	lock_release(sfs_buflock);
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = ((off_t)bufs[0]->b_block) * SFS_BLOCKSIZE;
+	ku.uio_resid = n * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+	result = sfs_rwblock(bufs[0]->b_sfs, &ku);
+
+	lock_acquire(sfs_buflock);
+	for (i=0; i<n; i++) {
+		bufs[i]->b_busy = false;
+	}
+	cv_broadcast(sfs_bufcv, sfs_buflock);
+	return result;
+}
+
+/*
+ * Read or write a single buffer. Call with sfs_buflock held; it's
+ * released during the I/O. The buffer is marked busy meanwhile.
+ */
+static
+int
+sfs_buf_io(struct sfs_buf *b, enum uio_rw rw)
+{
+	KASSERT(lock_do_i_hold(sfs_buflock));
+	KASSERT(!b->b_busy);
+
+	b->b_busy = true;
+	return sfs_buf_clusterio(&b, 1, rw);
+}
+
+/*
+ * Write out N dirty buffers for consecutive blocks that nobody's
+ * holding. Call with sfs_buflock held; it's released during the I/O.
+ */
+static
+int
+sfs_buf_writecluster(struct sfs_buf **bufs, unsigned n)
+{
+	unsigned i;
+	int result;
+
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_dirty);
+		KASSERT(bufs[i]->b_refcount == 0);
+		KASSERT(!bufs[i]->b_busy);
+		bufs[i]->b_busy = true;
+	}
+
+	/* (nobody can get the buffers to change them while they're busy) */
+	result = sfs_buf_clusterio(bufs, n, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	for (i=0; i<n; i++) {
+		bufs[i]->b_dirty = false;
+	}
+	sfs_bufwrites += n;
+	return 0;
+}
+
+/*
+ * Write out a dirty buffer that nobody's holding. Call with
+ * sfs_buflock held; it's released during the I/O.
+ */
+static
+int
+sfs_buf_writeout(struct sfs_buf *b)
+{
+	return sfs_buf_writecluster(&b, 1);
+}
+
+/*
+ * Find a buffer to load a new block into: a new one if we haven't
+ * made all SFS_NBUFS yet, otherwise the least recently used one that
+ * nobody's holding. If that's dirty it has to be written first, which
+ * releases sfs_buflock; so the caller must check again afterwards
+ * that the block it wants hasn't been loaded meanwhile.
+ *
+ * If CANWAIT is false, skip dirty buffers and fail with EAGAIN
+ * rather than wait for one; then sfs_buflock is never released.
+ * sfs_buf_fill uses this while it has other buffers marked busy.
+ */
+static
+int
+sfs_buf_reclaim(bool canwait, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+
+	while (1) {
+		if (sfs_nbufs < SFS_NBUFS) {
+			b = kmalloc(sizeof(*b));
+			if (b != NULL) {
+				b->b_data = kmalloc(SFS_BLOCKSIZE);
+				if (b->b_data == NULL) {
+					kfree(b);
+					b = NULL;
+				}
+			}
+			if (b != NULL) {
+				b->b_sfs = NULL;
+				b->b_block = 0;
+				b->b_hashnext = NULL;
+				b->b_refcount = 0;
+				b->b_busy = false;
+				b->b_dirty = false;
+				b->b_unfilled = false;
+				sfs_buf_lruhead(b);
+				sfs_nbufs++;
+				*ret = b;
+				return 0;
+			}
+			/* out of memory; make do with what we have */
+		}
+
+		for (b = sfs_lruhead; b != NULL; b = b->b_lrunext) {
+			if (b->b_refcount == 0 && !b->b_busy &&
+			    (canwait || !b->b_dirty)) {
+				break;
+			}
+		}
+		if (b == NULL) {
+			if (!canwait) {
+				return EAGAIN;
+			}
+			if (sfs_nbufs == 0) {
+				return ENOMEM;
+			}
+			/* everything's in use; wait for something */
+			cv_wait(sfs_bufcv, sfs_buflock);
+			continue;
+		}
+
+		if (b->b_dirty) {
+			result = sfs_buf_writeout(b);
+			if (result) {
+				return result;
+			}
+			/* we slept, so look again */
+			continue;
+		}
+
+		if (b->b_sfs != NULL) {
+			sfs_bufevictions++;
+		}
+		sfs_buf_drop(b);
+		*ret = b;
+		return 0;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// interface
+
+/*
+ * Get a buffer for BLOCK of SFS, holding it. If FILL is false, the
+ * caller is going to overwrite the whole block, so if it isn't cached
+ * already we don't bother reading it; the buffer is then kept from
+ * everyone else until the caller marks it dirty.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, daddr_t block, bool fill,
+	    struct sfs_buf **ret)
+{
+	struct sfs_buf *b, *newb;
+	int result;
+
+	lock_acquire(sfs_buflock);
+	while (1) {
+		b = sfs_buf_lookup(sfs, block);
+		if (b != NULL) {
+			if (b->b_busy || b->b_unfilled) {
+				/* being read, written, or filled in */
+				cv_wait(sfs_bufcv, sfs_buflock);
+				continue;
+			}
+			sfs_bufhits++;
+			break;
+		}
+
+		result = sfs_buf_reclaim(true, &newb);
+		if (result) {
+			lock_release(sfs_buflock);
+			return result;
+		}
+		if (sfs_buf_lookup(sfs, block) != NULL) {
+			/* someone else loaded it while we slept */
+			continue;
+		}
+
+		b = newb;
+		sfs_bufmisses++;
+		b->b_sfs = sfs;
+		b->b_block = block;
+		sfs_buf_hashinsert(b);
+		if (fill) {
+			result = sfs_buf_io(b, UIO_READ);
+			if (result) {
+				sfs_buf_drop(b);
+				lock_release(sfs_buflock);
+				return result;
+			}
+		}
+		else {
+			b->b_unfilled = true;
+		}
+		break;
+	}
+
+	b->b_refcount++;
+	sfs_buf_lruremove(b);
+	sfs_buf_lrutail(b);
+	lock_release(sfs_buflock);
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Make sure NBLOCKS blocks of SFS starting at BLOCK are in the cache,
+ * reading the ones that aren't in clusters of adjacent blocks. This
+ * is for when the file system knows it's about to want a run of
+ * blocks; it doesn't hold any of them, so they may not all still be
+ * there by the time it gets to them, but usually they will be.
+ */
+int
+sfs_buf_fill(struct sfs_fs *sfs, daddr_t block, unsigned nblocks)
+{
+	struct sfs_buf *bufs[SFS_MAXCLUSTER];
+	struct sfs_buf *b;
+	unsigned i, n;
+	int result;
+
+	lock_acquire(sfs_buflock);
+	i = 0;
+	n = 0;
+	while (i < nblocks || n > 0) {
+		if (i < nblocks && n < SFS_MAXCLUSTER) {
+			if (sfs_buf_lookup(sfs, block+i) != NULL) {
+				if (n == 0) {
+					/* already there */
+					i++;
+					continue;
+				}
+				/* end of a cluster; go read it */
+			}
+			else {
+				/*
+				 * Only the first buffer of a cluster can
+				 * be waited for (see sfs_buf_reclaim).
+				 */
+				result = sfs_buf_reclaim(n == 0, &b);
+				if (result == 0) {
+					if (n == 0 &&
+					    sfs_buf_lookup(sfs, block+i)
+					    != NULL) {
+						/* loaded while we slept */
+						continue;
+					}
+					sfs_bufmisses++;
+					b->b_sfs = sfs;
+					b->b_block = block+i;
+					b->b_busy = true;
+					sfs_buf_hashinsert(b);
+					sfs_buf_lruremove(b);
+					sfs_buf_lrutail(b);
+					bufs[n++] = b;
+					i++;
+					continue;
+				}
+				if (n == 0) {
+					lock_release(sfs_buflock);
+					return result;
+				}
+				/* none free right now; read what we have */
+			}
+		}
+
+		/* Read the cluster we've got */
+		result = sfs_buf_clusterio(bufs, n, UIO_READ);
+		if (result) {
+			while (n > 0) {
+				sfs_buf_drop(bufs[--n]);
+			}
+			lock_release(sfs_buflock);
+			return result;
+		}
+		n = 0;
+	}
+	lock_release(sfs_buflock);
+	return 0;
+}
+
+/*
+ * Ask for NBLOCKS blocks of SFS starting at BLOCK to be read into the
+ * cache in the background, as by sfs_buf_fill. This is only a hint;
+ * if there are too many requests waiting already, it's dropped.
+ */
+void
+sfs_buf_readahead(struct sfs_fs *sfs, daddr_t block, unsigned nblocks)
+{
+	struct sfs_rareq *ra;
+
+	lock_acquire(sfs_buflock);
+	sfs_rarequests++;
+	if (sfs_racount == SFS_RAQUEUE) {
+		sfs_radropped++;
+		lock_release(sfs_buflock);
+		return;
+	}
+	ra = &sfs_raqueue[(sfs_rahead + sfs_racount) % SFS_RAQUEUE];
+	ra->ra_sfs = sfs;
+	ra->ra_block = block;
+	ra->ra_nblocks = nblocks;
+	sfs_racount++;
+	cv_signal(sfs_racv, sfs_buflock);
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Get the data in a held buffer.
+ */
+void *
+sfs_buf_data(struct sfs_buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	return b->b_data;
+}
+
+/*
+ * Mark a held buffer as changed.
+ */
+void
+sfs_buf_dirty(struct sfs_buf *b)
+{
+	lock_acquire(sfs_buflock);
+	KASSERT(b->b_refcount > 0);
+	b->b_dirty = true;
+	if (b->b_unfilled) {
+		b->b_unfilled = false;
+		cv_broadcast(sfs_bufcv, sfs_buflock);
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * A change to a held buffer failed partway through. If the buffer
+ * was never read in, what's in it is junk, and it'll be thrown away
+ * when released. Otherwise, what did get changed stays, as with a
+ * short write, so it needs writing out.
+ */
+void
+sfs_buf_abort(struct sfs_buf *b)
+{
+	lock_acquire(sfs_buflock);
+	KASSERT(b->b_refcount > 0);
+	if (!b->b_unfilled) {
+		b->b_dirty = true;
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Let go of a buffer. If it was never filled in, drop it.
+ */
+void
+sfs_buf_release(struct sfs_buf *b)
+{
+	lock_acquire(sfs_buflock);
+	KASSERT(b->b_refcount > 0);
+	b->b_refcount--;
+	if (b->b_refcount == 0) {
+		if (b->b_unfilled) {
+			sfs_buf_drop(b);
+		}
+		cv_broadcast(sfs_bufcv, sfs_buflock);
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * A block has been freed; throw away any cached copy of it, so we
+ * don't waste time writing it out. Must be called before the block
+ * is marked free, as once it is it might be reallocated. If someone
+ * (read-ahead, say) still has the buffer, wait for them to let go.
+ */
+void
+sfs_buf_forget(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	lock_acquire(sfs_buflock);
+	while ((b = sfs_buf_lookup(sfs, block)) != NULL &&
+	       (b->b_busy || b->b_unfilled || b->b_refcount > 0)) {
+		cv_wait(sfs_bufcv, sfs_buflock);
+	}
+	if (b != NULL) {
+		sfs_buf_drop(b);
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * A buffer that's waiting to be written, and where; see sfs_buf_flush.
+ */
+struct sfs_bufref {
+	struct sfs_buf *br_buf;
+	struct sfs_fs *br_sfs;
+	daddr_t br_block;
+};
+
+/*
+ * Compare sfs_bufrefs for sorting by volume and block number.
+ */
+static
+bool
+sfs_bufref_less(const struct sfs_bufref *a, const struct sfs_bufref *b)
+{
+	if (a->br_sfs != b->br_sfs) {
+		return (uintptr_t)a->br_sfs < (uintptr_t)b->br_sfs;
+	}
+	return a->br_block < b->br_block;
+}
+
+/*
+ * Check if the buffer a sfs_bufref points to is still for the same
+ * block, and ready to be written out right now.
+ */
+static
+bool
+sfs_bufref_writable(const struct sfs_bufref *br)
+{
+	struct sfs_buf *b = br->br_buf;
+
+	return b->b_sfs == br->br_sfs && b->b_block == br->br_block &&
+		b->b_dirty && !b->b_busy && b->b_refcount == 0;
+}
+
+/*
+ * Write out all dirty buffers belonging to SFS, or to every volume
+ * if SFS is NULL, in block order, clustering adjacent ones.
+ */
+int
+sfs_buf_flush(struct sfs_fs *sfs)
+{
+	struct sfs_bufref *refs, tmp;
+	struct sfs_buf *bufs[SFS_MAXCLUSTER];
+	struct sfs_buf *b;
+	unsigned i, j, n, num;
+	int result, ret;
+
+	lock_acquire(sfs_buflock);
+	if (sfs_nbufs == 0) {
+		lock_release(sfs_buflock);
+		return 0;
+	}
+
+	/* the array can't need to be bigger than it is now */
+	refs = kmalloc(sfs_nbufs * sizeof(*refs));
+	if (refs == NULL) {
+		lock_release(sfs_buflock);
+		return ENOMEM;
+	}
+
+	num = 0;
+	for (b = sfs_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_sfs == NULL || !b->b_dirty) {
+			continue;
+		}
+		if (sfs != NULL && b->b_sfs != sfs) {
+			continue;
+		}
+		KASSERT(num < sfs_nbufs);
+		refs[num].br_buf = b;
+		refs[num].br_sfs = b->b_sfs;
+		refs[num].br_block = b->b_block;
+		num++;
+	}
+
+	/* insertion sort; there are at most SFS_NBUFS of them */
+	for (i=1; i<num; i++) {
+		tmp = refs[i];
+		for (j=i; j>0 && sfs_bufref_less(&tmp, &refs[j-1]); j--) {
+			refs[j] = refs[j-1];
+		}
+		refs[j] = tmp;
+	}
+
+	ret = 0;
+	for (i=0; i<num; i=j) {
+		b = refs[i].br_buf;
+		j = i+1;
+		/* wait for it to be free; it might get reused meanwhile */
+		while (b->b_sfs == refs[i].br_sfs &&
+		       b->b_block == refs[i].br_block &&
+		       (b->b_busy || b->b_refcount > 0)) {
+			cv_wait(sfs_bufcv, sfs_buflock);
+		}
+		if (!sfs_bufref_writable(&refs[i])) {
+			continue;
+		}
+
+		/* Take along any following blocks that can go too */
+		bufs[0] = b;
+		n = 1;
+		while (j < num && n < SFS_MAXCLUSTER &&
+		       refs[j].br_sfs == refs[i].br_sfs &&
+		       refs[j].br_block == refs[i].br_block + n &&
+		       sfs_bufref_writable(&refs[j])) {
+			bufs[n++] = refs[j++].br_buf;
+		}
+
+		result = sfs_buf_writecluster(bufs, n);
+		if (result && ret == 0) {
+			ret = result;
+		}
+	}
+
+	lock_release(sfs_buflock);
+	kfree(refs);
+	return ret;
+}
+
+/*
+ * Throw away all buffers belonging to SFS. For unmount (or a mount
+ * that didn't work out); anything dirty should have been flushed by
+ * now.
+ */
+void
+sfs_buf_purge(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b, *next;
+	struct sfs_rareq *ra;
+	unsigned i, j;
+
+	lock_acquire(sfs_buflock);
+
+	/* Cancel read-ahead for the volume, and wait out any in progress */
+	for (i=j=0; i<sfs_racount; i++) {
+		ra = &sfs_raqueue[(sfs_rahead + i) % SFS_RAQUEUE];
+		if (ra->ra_sfs != sfs) {
+			sfs_raqueue[(sfs_rahead + j++) % SFS_RAQUEUE] = *ra;
+		}
+	}
+	sfs_racount = j;
+	while (sfs_rabusy == sfs) {
+		cv_wait(sfs_bufcv, sfs_buflock);
+	}
+
+ again:
+	for (b = sfs_lruhead; b != NULL; b = next) {
+		next = b->b_lrunext;
+		if (b->b_sfs != sfs) {
+			continue;
+		}
+		if (b->b_busy || b->b_refcount > 0) {
+			/* in use, or being written; wait and start over */
+			cv_wait(sfs_bufcv, sfs_buflock);
+			goto again;
+		}
+		if (b->b_dirty) {
+			kprintf("sfs: %s: discarding dirty block %u\n",
+				sfs->sfs_sb.sb_volname, b->b_block);
+		}
+		sfs_buf_drop(b);
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Print the hit rate and such.
+ */
+void
+sfs_buf_printstats(void)
+{
+	unsigned lookups;
+
+	lock_acquire(sfs_buflock);
+	lookups = sfs_bufhits + sfs_bufmisses;
+	kprintf("sfs buffer cache: %u of %u buffers in use\n",
+		sfs_nbufs, SFS_NBUFS);
+	kprintf("    %u lookups, %u hits (%u%%), %u misses\n",
+		lookups, sfs_bufhits,
+		lookups ? sfs_bufhits * 100 / lookups : 0, sfs_bufmisses);
+	kprintf("    %u writebacks, %u evictions\n",
+		sfs_bufwrites, sfs_bufevictions);
+	kprintf("    %u clustered transfers, %u blocks\n",
+		sfs_bufclusters, sfs_bufclustered);
+	kprintf("    %u read-ahead requests, %u dropped\n",
+		sfs_rarequests, sfs_radropped);
+	lock_release(sfs_buflock);
+}
+
+////////////////////////////////////////////////////////////
+// syncer
+
+/*
+ * The syncer thread: write back dirty buffers every so often, so
+ * they don't sit in memory indefinitely.
+ */
+static
+void
+sfs_syncer(void *unused1, unsigned long unused2)
+{
+	int result;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(SFS_SYNCINTERVAL);
+		result = sfs_buf_flush(NULL);
+		if (result) {
+			kprintf("sfs: syncer: %s\n", strerror(result));
+		}
+	}
+}
+
+/*
+ * The read-ahead thread: do read-ahead requests as they come in.
+ */
+static
+void
+sfs_readahead_thread(void *unused1, unsigned long unused2)
+{
+	struct sfs_rareq ra;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(sfs_buflock);
+	while (1) {
+		while (sfs_racount == 0) {
+			cv_wait(sfs_racv, sfs_buflock);
+		}
+		ra = sfs_raqueue[sfs_rahead];
+		sfs_rahead = (sfs_rahead + 1) % SFS_RAQUEUE;
+		sfs_racount--;
+
+		/* (sfs_buf_purge waits for this to go back to NULL) */
+		sfs_rabusy = ra.ra_sfs;
+		lock_release(sfs_buflock);
+
+		/* Errors don't matter; whoever wants the blocks will retry */
+		(void)sfs_buf_fill(ra.ra_sfs, ra.ra_block, ra.ra_nblocks);
+
+		lock_acquire(sfs_buflock);
+		sfs_rabusy = NULL;
+		cv_broadcast(sfs_bufcv, sfs_buflock);
+	}
+}
+
+/*
+ * Set up the buffer cache and start the syncer and read-ahead
+ * threads.
+ */
+void
+sfs_bootstrap(void)
+{
+	int result;
+
+	sfs_buflock = lock_create("sfs_buflock");
+	if (sfs_buflock == NULL) {
+		panic("sfs: Could not create buffer cache lock\n");
+	}
+	sfs_bufcv = cv_create("sfs_bufcv");
+	if (sfs_bufcv == NULL) {
+		panic("sfs: Could not create buffer cache cv\n");
+	}
+	sfs_racv = cv_create("sfs_racv");
+	if (sfs_racv == NULL) {
+		panic("sfs: Could not create read-ahead cv\n");
+	}
+
+	result = thread_fork("sfs syncer", NULL, sfs_syncer, NULL, 0);
+	if (result) {
+		panic("sfs: Could not start syncer: %s\n", strerror(result));
+	}
+
+	result = thread_fork("sfs readahead", NULL, sfs_readahead_thread,
+			     NULL, 0);
+	if (result) {
+		panic("sfs: Could not start read-ahead thread: %s\n",
+		      strerror(result));
+	}
+}
@@ -35,10 +35,56 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Directory index.
+ *
+ * The first time a directory is searched, all its entries are read
+ * in one pass and the names are put in a hash table hung off the
+ * vnode, along with a list of the empty slots. After that, finding
+ * a name or a place to put a new one doesn't have to touch the
+ * directory at all. The on-disk format is unchanged; the index is
+ * just a cache, and is thrown away when the vnode is reclaimed (or
+ * if we run out of memory keeping it up to date) and rebuilt when
+ * next needed.
+ *
+ * The index is only changed by sfs_dir_link and sfs_dir_unlink,
+ * which run with the directory's sv_lock held exclusively. See
+ * sfs.h for how it gets installed.
+ *
+ * On volumes with SFS_FEATURE_DIRHASH, directories with more than a
+ * few entries also get a hash index on disk (see kern/sfs.h), and
+ * that is used instead, so a large directory doesn't have to be read
+ * in full even once. Building it is left to sfs_dir_link, as it's
+ * the one that runs with sv_lock held exclusively.
+ */
+
+/* Initial number of hash chains; doubled as the directory grows */
+#define SFS_DIRHASH_MIN	16
+
+/* Size (in slots) at which a directory gets an on-disk index */
+#define SFS_DIRHASH_THRESHOLD	16
+
+struct sfs_dirhent {
+	struct sfs_dirhent *dh_next;	/* hash chain */
+	uint32_t dh_ino;		/* inode number */
+	int dh_slot;			/* slot in the directory */
+	char dh_name[SFS_NAMELEN];	/* filename */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirhent **di_table;	/* hash chains */
+	unsigned di_tablesize;		/* number of chains; power of 2 */
+	unsigned di_count;		/* number of names */
+	int *di_free;			/* empty slots */
+	unsigned di_nfree;		/* number of empty slots */
+	unsigned di_maxfree;		/* allocated size of di_free */
+};
+
 /*
  * Read the directory entry out of slot SLOT of a directory vnode.
  * The "slot" is the index of the directory entry, starting at 0.
@@ -95,14 +141,736 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+// Directory index
+
+static
+unsigned
+sfs_dirhash(const char *name)
+{
+	unsigned hash = 0;
+
+	while (*name) {
+		hash = hash*31 + (unsigned char)*name++;
+	}
+	return hash;
+}
+
+static
+void
+sfs_dirindex_destroy(struct sfs_dirindex *di)
+{
+	struct sfs_dirhent *dh;
+	unsigned i;
+
+	for (i=0; i<di->di_tablesize; i++) {
+		while ((dh = di->di_table[i]) != NULL) {
+			di->di_table[i] = dh->dh_next;
+			kfree(dh);
+		}
+	}
+	kfree(di->di_table);
+	kfree(di->di_free);
+	kfree(di);
+}
+
+static
+struct sfs_dirindex *
+sfs_dirindex_create(void)
+{
+	struct sfs_dirindex *di;
+	unsigned i;
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return NULL;
+	}
+	di->di_table = kmalloc(SFS_DIRHASH_MIN * sizeof(di->di_table[0]));
+	if (di->di_table == NULL) {
+		kfree(di);
+		return NULL;
+	}
+	for (i=0; i<SFS_DIRHASH_MIN; i++) {
+		di->di_table[i] = NULL;
+	}
+	di->di_tablesize = SFS_DIRHASH_MIN;
+	di->di_count = 0;
+	di->di_free = NULL;
+	di->di_nfree = 0;
+	di->di_maxfree = 0;
+	return di;
+}
+
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Double the number of hash chains. If there isn't memory for that,
+ * carry on with the chains we have; they just get longer.
  */
+static
+void
+sfs_dirindex_grow(struct sfs_dirindex *di)
+{
+	struct sfs_dirhent **newtable, *dh;
+	unsigned newsize, i, h;
+
+	newsize = di->di_tablesize * 2;
+	newtable = kmalloc(newsize * sizeof(newtable[0]));
+	if (newtable == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newtable[i] = NULL;
+	}
+	for (i=0; i<di->di_tablesize; i++) {
+		while ((dh = di->di_table[i]) != NULL) {
+			di->di_table[i] = dh->dh_next;
+			h = sfs_dirhash(dh->dh_name) & (newsize - 1);
+			dh->dh_next = newtable[h];
+			newtable[h] = dh;
+		}
+	}
+	kfree(di->di_table);
+	di->di_table = newtable;
+	di->di_tablesize = newsize;
+}
+
+static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		uint32_t *ino, int *slot, int *emptyslot)
+sfs_dirindex_addname(struct sfs_dirindex *di, const char *name,
+		     uint32_t ino, int slot)
+{
+	struct sfs_dirhent *dh;
+	unsigned h;
+
+	dh = kmalloc(sizeof(*dh));
+	if (dh == NULL) {
+		return ENOMEM;
+	}
+	strcpy(dh->dh_name, name);
+	dh->dh_ino = ino;
+	dh->dh_slot = slot;
+
+	if (di->di_count >= 2 * di->di_tablesize) {
+		sfs_dirindex_grow(di);
+	}
+	h = sfs_dirhash(name) & (di->di_tablesize - 1);
+	dh->dh_next = di->di_table[h];
+	di->di_table[h] = dh;
+	di->di_count++;
+	return 0;
+}
+
+static
+struct sfs_dirhent *
+sfs_dirindex_find(struct sfs_dirindex *di, const char *name)
+{
+	struct sfs_dirhent *dh;
+	unsigned h;
+
+	h = sfs_dirhash(name) & (di->di_tablesize - 1);
+	for (dh = di->di_table[h]; dh != NULL; dh = dh->dh_next) {
+		if (!strcmp(dh->dh_name, name)) {
+			return dh;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Remove the entry for NAME, which must be in slot SLOT.
+ */
+static
+void
+sfs_dirindex_removename(struct sfs_dirindex *di, const char *name, int slot)
+{
+	struct sfs_dirhent **dhp, *dh;
+	unsigned h;
+
+	h = sfs_dirhash(name) & (di->di_tablesize - 1);
+	for (dhp = &di->di_table[h]; *dhp != NULL; dhp = &(*dhp)->dh_next) {
+		dh = *dhp;
+		if (dh->dh_slot == slot) {
+			KASSERT(!strcmp(dh->dh_name, name));
+			*dhp = dh->dh_next;
+			kfree(dh);
+			di->di_count--;
+			return;
+		}
+	}
+	panic("sfs: directory index: %s (slot %d) missing\n", name, slot);
+}
+
+static
+int
+sfs_dirindex_addfree(struct sfs_dirindex *di, int slot)
+{
+	int *newfree;
+	unsigned newmax, i;
+
+	if (di->di_nfree == di->di_maxfree) {
+		newmax = di->di_maxfree == 0 ? 8 : di->di_maxfree * 2;
+		newfree = kmalloc(newmax * sizeof(newfree[0]));
+		if (newfree == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<di->di_nfree; i++) {
+			newfree[i] = di->di_free[i];
+		}
+		kfree(di->di_free);
+		di->di_free = newfree;
+		di->di_maxfree = newmax;
+	}
+	di->di_free[di->di_nfree++] = slot;
+	return 0;
+}
+
+/*
+ * Read the whole directory and build an index for it.
+ */
+static
+int
+sfs_dirindex_build(struct sfs_vnode *sv, struct sfs_dirindex **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	const unsigned perblock = SFS_BLOCKSIZE / sizeof(struct sfs_direntry);
+	struct sfs_dirindex *di;
+	struct sfs_direntry *sd, tsd;
+	struct sfs_buf *buf;
+	daddr_t diskblock;
+	uint32_t fileblock, run, i;
+	unsigned nentries, slot, end;
+	int result;
+
+	di = sfs_dirindex_create();
+	if (di == NULL) {
+		return ENOMEM;
+	}
+
+	nentries = sfs_dir_nentries(sv);
+	slot = 0;
+	while (slot < nentries) {
+		fileblock = slot / perblock;
+		result = sfs_bmap_range(sv, fileblock,
+					DIVROUNDUP(nentries, perblock)
+					- fileblock,
+					false, &diskblock, &run);
+		if (result) {
+			goto fail;
+		}
+		if (run > 1 && diskblock != 0) {
+			/* Read the run in as few transfers as possible */
+			result = sfs_buf_fill(sfs, diskblock, run);
+			if (result) {
+				goto fail;
+			}
+		}
+
+		for (i=0; i<run; i++) {
+			end = (fileblock + i + 1) * perblock;
+			if (end > nentries) {
+				end = nentries;
+			}
+
+			if (diskblock == 0) {
+				/* Hole; reads as empty entries */
+				for (; slot < end; slot++) {
+					result = sfs_dirindex_addfree(di, slot);
+					if (result) {
+						goto fail;
+					}
+				}
+				continue;
+			}
+
+			result = sfs_buf_get(sfs, diskblock + i, true, &buf);
+			if (result) {
+				goto fail;
+			}
+			sd = sfs_buf_data(buf);
+			for (; slot < end; slot++, sd++) {
+				if (sd->sfd_ino == SFS_NOINO) {
+					result = sfs_dirindex_addfree(di, slot);
+				}
+				else {
+					/* Ensure null termination, just in case */
+					memcpy(&tsd, sd, sizeof(tsd));
+					tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+					result = sfs_dirindex_addname(di,
+						tsd.sfd_name, tsd.sfd_ino, slot);
+				}
+				if (result) {
+					sfs_buf_release(buf);
+					goto fail;
+				}
+			}
+			sfs_buf_release(buf);
+		}
+	}
+
+	*ret = di;
+	return 0;
+
+ fail:
+	sfs_dirindex_destroy(di);
+	return result;
+}
+
+/*
+ * Get the index for directory SV, building it if need be.
+ */
+static
+int
+sfs_dirindex_get(struct sfs_vnode *sv, struct sfs_dirindex **ret)
+{
+	struct sfs_dirindex *di;
+	int result;
+
+	spinlock_acquire(&sv->sv_extlock);
+	di = sv->sv_dirindex;
+	spinlock_release(&sv->sv_extlock);
+
+	if (di == NULL) {
+		result = sfs_dirindex_build(sv, &di);
+		if (result) {
+			return result;
+		}
+
+		/*
+		 * Another reader may have built one meanwhile; if so,
+		 * use that and throw ours away.
+		 */
+		spinlock_acquire(&sv->sv_extlock);
+		if (sv->sv_dirindex == NULL) {
+			sv->sv_dirindex = di;
+			spinlock_release(&sv->sv_extlock);
+		}
+		else {
+			spinlock_release(&sv->sv_extlock);
+			sfs_dirindex_destroy(di);
+			di = sv->sv_dirindex;
+		}
+	}
+
+	*ret = di;
+	return 0;
+}
+
+/*
+ * Throw away the index for directory SV, if it has one. Called with
+ * sv_lock held exclusively, or when the vnode is being reclaimed.
+ */
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di;
+
+	di = sv->sv_dirindex;
+	sv->sv_dirindex = NULL;
+	if (di != NULL) {
+		sfs_dirindex_destroy(di);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// On-disk directory index
+
+/*
+ * Check if directories on this volume have on-disk indexes.
+ */
+static
+bool
+sfs_dir_hashed(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	return (sfs->sfs_sb.sb_features & SFS_FEATURE_DIRHASH) != 0;
+}
+
+/*
+ * The hash function for the on-disk index. This is 32-bit FNV-1a;
+ * sfsck has to compute the same thing.
+ */
+static
+uint32_t
+sfs_dirhash_name(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Read or write the index header, an entry in the list of empty
+ * slots, or bucket B.
+ */
+static
+int
+sfs_dirhdr_io(struct sfs_vnode *sv, struct sfs_dirhdr *hdr, enum uio_rw rw)
+{
+	off_t pos;
+
+	pos = (off_t)SFS_DIRINDEX_BLOCK * SFS_BLOCKSIZE;
+	return sfs_indexio(sv, pos, hdr, sizeof(*hdr), rw);
+}
+
+static
+int
+sfs_dirfree_io(struct sfs_vnode *sv, unsigned i, uint32_t *slot,
+	       enum uio_rw rw)
+{
+	off_t pos;
+
+	KASSERT(i < SFS_DIRINDEX_NFREE);
+	pos = (off_t)SFS_DIRINDEX_BLOCK * SFS_BLOCKSIZE +
+		sizeof(struct sfs_dirhdr) + i * sizeof(uint32_t);
+	return sfs_indexio(sv, pos, slot, sizeof(*slot), rw);
+}
+
+static
+int
+sfs_dirbucket_io(struct sfs_vnode *sv, uint32_t b, struct sfs_dirbucket *sdb,
+		 enum uio_rw rw)
+{
+	off_t pos;
+
+	pos = (off_t)(SFS_DIRINDEX_BLOCK + 1) * SFS_BLOCKSIZE +
+		(off_t)b * sizeof(*sdb);
+	return sfs_indexio(sv, pos, sdb, sizeof(*sdb), rw);
+}
+
+/*
+ * Pick a table size for N names: the load, counting deleted buckets,
+ * is kept at or under half, so start out at a quarter.
+ */
+static
+uint32_t
+sfs_dirhash_tablesize(uint32_t n)
+{
+	uint32_t nbuckets = SFS_DIRB_PERBLOCK;
+
+	while (nbuckets < 4 * n) {
+		nbuckets *= 2;
+	}
+	return nbuckets;
+}
+
+/*
+ * Find NAME through the index whose header is HDR. Hands back its
+ * inode number and slot.
+ */
+static
+int
+sfs_dirhash_find(struct sfs_vnode *sv, const struct sfs_dirhdr *hdr,
+		 const char *name, uint32_t *ino, int *slot)
+{
+	struct sfs_dirbucket sdb;
+	struct sfs_direntry tsd;
+	uint32_t hash, mask, b, n;
+	int result;
+
+	hash = sfs_dirhash_name(name);
+	mask = hdr->sdh_nbuckets - 1;
+	for (n = 0, b = hash & mask; n < hdr->sdh_nbuckets;
+	     n++, b = (b + 1) & mask) {
+		result = sfs_dirbucket_io(sv, b, &sdb, UIO_READ);
+		if (result) {
+			return result;
+		}
+		if (sdb.sdb_slot == SFS_DIRB_EMPTY) {
+			break;
+		}
+		if (sdb.sdb_slot == SFS_DIRB_DELETED ||
+		    sdb.sdb_hash != hash) {
+			continue;
+		}
+
+		/* Same hash; check the name */
+		result = sfs_readdir(sv, sdb.sdb_slot - 1, &tsd);
+		if (result) {
+			return result;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		if (tsd.sfd_ino == SFS_NOINO || strcmp(tsd.sfd_name, name)) {
+			continue;
+		}
+
+		if (ino != NULL) {
+			*ino = tsd.sfd_ino;
+		}
+		if (slot != NULL) {
+			*slot = sdb.sdb_slot - 1;
+		}
+		return 0;
+	}
+	return ENOENT;
+}
+
+/*
+ * Put NAME, which is in slot SLOT, into the table. The caller writes
+ * out the header.
+ */
+static
+int
+sfs_dirhash_insert(struct sfs_vnode *sv, struct sfs_dirhdr *hdr,
+		   const char *name, int slot)
+{
+	struct sfs_dirbucket sdb;
+	uint32_t hash, mask, b, n;
+	int result;
+
+	hash = sfs_dirhash_name(name);
+	mask = hdr->sdh_nbuckets - 1;
+	for (n = 0, b = hash & mask; n < hdr->sdh_nbuckets;
+	     n++, b = (b + 1) & mask) {
+		result = sfs_dirbucket_io(sv, b, &sdb, UIO_READ);
+		if (result) {
+			return result;
+		}
+		if (sdb.sdb_slot != SFS_DIRB_EMPTY &&
+		    sdb.sdb_slot != SFS_DIRB_DELETED) {
+			continue;
+		}
+		if (sdb.sdb_slot == SFS_DIRB_DELETED) {
+			hdr->sdh_ndeleted--;
+		}
+		sdb.sdb_hash = hash;
+		sdb.sdb_slot = slot + 1;
+		result = sfs_dirbucket_io(sv, b, &sdb, UIO_WRITE);
+		if (result) {
+			return result;
+		}
+		hdr->sdh_count++;
+		return 0;
+	}
+	/* The table is never allowed to get more than half full */
+	panic("sfs: directory %u: hash index full\n", sv->sv_ino);
+}
+
+/*
+ * Build the index from scratch, with NBUCKETS buckets, by reading
+ * every entry. Blocks left over from an earlier index are reused.
+ * The header is marked invalid first, so if we crash or fail part
+ * way through, the directory is just left without an index.
+ */
+static
+int
+sfs_dirhash_build(struct sfs_vnode *sv, struct sfs_dirhdr *hdr,
+		  uint32_t nbuckets)
+{
+	struct sfs_direntry tsd;
+	void *zeros;
+	uint32_t nfree, i;
+	int nentries, slot, result;
+
+	hdr->sdh_magic = 0;
+	result = sfs_dirhdr_io(sv, hdr, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+
+	zeros = kmalloc(SFS_BLOCKSIZE);
+	if (zeros == NULL) {
+		return ENOMEM;
+	}
+	bzero(zeros, SFS_BLOCKSIZE);
+	for (i=0; i < nbuckets / SFS_DIRB_PERBLOCK; i++) {
+		result = sfs_indexio(sv, (off_t)(SFS_DIRINDEX_BLOCK + 1 + i) *
+				     SFS_BLOCKSIZE, zeros, SFS_BLOCKSIZE,
+				     UIO_WRITE);
+		if (result) {
+			kfree(zeros);
+			return result;
+		}
+	}
+	kfree(zeros);
+
+	hdr->sdh_nbuckets = nbuckets;
+	hdr->sdh_count = 0;
+	hdr->sdh_ndeleted = 0;
+	nfree = 0;
+
+	nentries = sfs_dir_nentries(sv);
+	for (slot=0; slot<nentries; slot++) {
+		result = sfs_readdir(sv, slot, &tsd);
+		if (result) {
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			if (nfree < SFS_DIRINDEX_NFREE) {
+				i = slot;
+				result = sfs_dirfree_io(sv, nfree, &i,
+							UIO_WRITE);
+				if (result) {
+					return result;
+				}
+				nfree++;
+			}
+			continue;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		result = sfs_dirhash_insert(sv, hdr, tsd.sfd_name, slot);
+		if (result) {
+			return result;
+		}
+	}
+
+	hdr->sdh_nfree = nfree;
+	hdr->sdh_magic = SFS_DIRINDEX_MAGIC;
+	result = sfs_dirhdr_io(sv, hdr, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+
+	/* Don't need the in-memory one any more */
+	sfs_dir_dropindex(sv);
+	return 0;
+}
+
+/*
+ * If updating the index fails, the directory and the index no longer
+ * agree; mark the index invalid so it isn't used. It gets rebuilt by
+ * the next sfs_dir_link.
+ */
+static
+int
+sfs_dirhash_invalidate(struct sfs_vnode *sv)
+{
+	struct sfs_dirhdr hdr;
+
+	bzero(&hdr, sizeof(hdr));
+	return sfs_dirhdr_io(sv, &hdr, UIO_WRITE);
+}
+
+/*
+ * NAME has just been put in slot SLOT. Add it to the index, building
+ * or growing the index if it's time.
+ */
+static
+int
+sfs_dirhash_added(struct sfs_vnode *sv, const char *name, int slot)
+{
+	struct sfs_dirhdr hdr;
+	uint32_t freeslot;
+	int nentries, result;
+
+	result = sfs_dirhdr_io(sv, &hdr, UIO_READ);
+	if (result) {
+		return result;
+	}
+
+	if (hdr.sdh_magic != SFS_DIRINDEX_MAGIC) {
+		nentries = sfs_dir_nentries(sv);
+		if (nentries < SFS_DIRHASH_THRESHOLD) {
+			return 0;
+		}
+		return sfs_dirhash_build(sv, &hdr,
+					 sfs_dirhash_tablesize(nentries));
+	}
+
+	/* If the slot came off the list of empty ones, take it off */
+	if (hdr.sdh_nfree > 0) {
+		result = sfs_dirfree_io(sv, hdr.sdh_nfree - 1, &freeslot,
+					UIO_READ);
+		if (result) {
+			return result;
+		}
+		if (freeslot == (uint32_t)slot) {
+			hdr.sdh_nfree--;
+		}
+	}
+
+	if ((hdr.sdh_count + hdr.sdh_ndeleted + 1) * 2 > hdr.sdh_nbuckets) {
+		/* Too full; rebuild, bigger if need be */
+		return sfs_dirhash_build(sv, &hdr,
+				sfs_dirhash_tablesize(hdr.sdh_count + 1));
+	}
+
+	result = sfs_dirhash_insert(sv, &hdr, name, slot);
+	if (result) {
+		return result;
+	}
+	return sfs_dirhdr_io(sv, &hdr, UIO_WRITE);
+}
+
+/*
+ * NAME has just been removed from slot SLOT. Take it out of the
+ * index, if there is one, and list the slot as empty.
+ */
+static
+int
+sfs_dirhash_removed(struct sfs_vnode *sv, const char *name, int slot)
+{
+	struct sfs_dirhdr hdr;
+	struct sfs_dirbucket sdb;
+	uint32_t hash, mask, b, n, freeslot;
+	int result;
+
+	result = sfs_dirhdr_io(sv, &hdr, UIO_READ);
+	if (result) {
+		return result;
+	}
+	if (hdr.sdh_magic != SFS_DIRINDEX_MAGIC) {
+		return 0;
+	}
+
+	/*
+	 * The entry is gone already, so we can't use sfs_dirhash_find;
+	 * look for the bucket with the slot number instead.
+	 */
+	hash = sfs_dirhash_name(name);
+	mask = hdr.sdh_nbuckets - 1;
+	for (n = 0, b = hash & mask; n < hdr.sdh_nbuckets;
+	     n++, b = (b + 1) & mask) {
+		result = sfs_dirbucket_io(sv, b, &sdb, UIO_READ);
+		if (result) {
+			return result;
+		}
+		if (sdb.sdb_slot == SFS_DIRB_EMPTY) {
+			break;
+		}
+		if (sdb.sdb_slot != (uint32_t)slot + 1) {
+			continue;
+		}
+
+		sdb.sdb_slot = SFS_DIRB_DELETED;
+		result = sfs_dirbucket_io(sv, b, &sdb, UIO_WRITE);
+		if (result) {
+			return result;
+		}
+		hdr.sdh_count--;
+		hdr.sdh_ndeleted++;
+
+		if (hdr.sdh_nfree < SFS_DIRINDEX_NFREE) {
+			freeslot = slot;
+			result = sfs_dirfree_io(sv, hdr.sdh_nfree, &freeslot,
+						UIO_WRITE);
+			if (result) {
+				return result;
+			}
+			hdr.sdh_nfree++;
+		}
+		return sfs_dirhdr_io(sv, &hdr, UIO_WRITE);
+	}
+
+	/* Not there; the index is out of date */
+	return EIO;
+}
+
+////////////////////////////////////////////////////////////
+// Directory operations
+
+/*
+ * Search a directory for a particular filename in a directory the
+ * slow way, by reading every slot. Used if there isn't memory for
+ * an index.
+ */
+static
+int
+sfs_dir_scan(struct sfs_vnode *sv, const char *name,
+	     uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
@@ -146,6 +914,64 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ */
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dirhent *dh;
+	struct sfs_dirhdr hdr;
+	uint32_t freeslot;
+	int result;
+
+	if (sfs_dir_hashed(sv)) {
+		result = sfs_dirhdr_io(sv, &hdr, UIO_READ);
+		if (result) {
+			return result;
+		}
+		if (hdr.sdh_magic == SFS_DIRINDEX_MAGIC) {
+			if (emptyslot != NULL && hdr.sdh_nfree > 0) {
+				result = sfs_dirfree_io(sv, hdr.sdh_nfree - 1,
+							&freeslot, UIO_READ);
+				if (result) {
+					return result;
+				}
+				*emptyslot = freeslot;
+			}
+			return sfs_dirhash_find(sv, &hdr, name, ino, slot);
+		}
+	}
+
+	result = sfs_dirindex_get(sv, &di);
+	if (result == ENOMEM) {
+		return sfs_dir_scan(sv, name, ino, slot, emptyslot);
+	}
+	if (result) {
+		return result;
+	}
+
+	if (emptyslot != NULL && di->di_nfree > 0) {
+		*emptyslot = di->di_free[di->di_nfree - 1];
+	}
+
+	dh = sfs_dirindex_find(di, name);
+	if (dh == NULL) {
+		return ENOENT;
+	}
+	if (slot != NULL) {
+		*slot = dh->dh_slot;
+	}
+	if (ino != NULL) {
+		*ino = dh->dh_ino;
+	}
+	return 0;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -153,7 +979,9 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
+	struct sfs_dirindex *di;
 	int emptyslot = -1;
+	unsigned i;
 	int result;
 	struct sfs_direntry sd;
 
@@ -173,6 +1001,11 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	/* If we didn't get an empty slot, add the entry at the end. */
 	if (emptyslot < 0) {
 		emptyslot = sfs_dir_nentries(sv);
+		if (sfs_dir_hashed(sv) &&
+		    emptyslot >= (int)SFS_DIRINDEX_MAXSLOTS) {
+			/* It would run into the index */
+			return ENOSPC;
+		}
 	}
 
 	/* Set up the entry. */
@@ -186,7 +1019,33 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Record it in the index, if there is one. */
+	di = sv->sv_dirindex;
+	if (di != NULL) {
+		for (i = di->di_nfree; i-- > 0; ) {
+			if (di->di_free[i] == emptyslot) {
+				di->di_free[i] = di->di_free[--di->di_nfree];
+				break;
+			}
+		}
+		if (sfs_dirindex_addname(di, name, ino, emptyslot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+
+	/* And in the on-disk index */
+	if (sfs_dir_hashed(sv)) {
+		result = sfs_dirhash_added(sv, name, emptyslot);
+		if (result) {
+			return sfs_dirhash_invalidate(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -195,14 +1054,44 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
-	struct sfs_direntry sd;
+	struct sfs_dirindex *di;
+	struct sfs_direntry sd, oldsd;
+	int result;
+
+	/* If there's an index, we need the old name to update it. */
+	di = sv->sv_dirindex;
+	if (di != NULL || sfs_dir_hashed(sv)) {
+		result = sfs_readdir(sv, slot, &oldsd);
+		if (result) {
+			return result;
+		}
+		oldsd.sfd_name[sizeof(oldsd.sfd_name)-1] = 0;
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	if (di != NULL) {
+		sfs_dirindex_removename(di, oldsd.sfd_name, slot);
+		if (sfs_dirindex_addfree(di, slot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+
+	if (sfs_dir_hashed(sv)) {
+		result = sfs_dirhash_removed(sv, oldsd.sfd_name, slot);
+		if (result) {
+			return sfs_dirhash_invalidate(sv);
+		}
+	}
+	return 0;
 }
 
 /*
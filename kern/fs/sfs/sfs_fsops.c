@@ -41,6 +41,7 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -66,13 +67,17 @@
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
+ *
+ * Blocks reserved for files but not yet used (those marked in
+ * sfs_resmap) are written out as free. The caller must hold
+ * sfs_freemaplock, or be mounting.
  */
 static
 int
 sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
-	uint32_t j, freemapblocks;
-	char *freemapdata;
+	uint32_t j, k, freemapblocks;
+	char *freemapdata, *resdata, *outdata;
 	int result;
 
 	/* Number of blocks in the free block bitmap. */
@@ -80,6 +85,16 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 
 	/* Pointer to our freemap data in memory. */
 	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+	resdata = bitmap_getdata(sfs->sfs_resmap);
+
+	/* Space to take the reserved blocks out of what we write. */
+	outdata = NULL;
+	if (rw == UIO_WRITE) {
+		outdata = kmalloc(SFS_BLOCKSIZE);
+		if (outdata == NULL) {
+			return ENOMEM;
+		}
+	}
 
 	/* For each block in the free block bitmap... */
 	for (j=0; j<freemapblocks; j++) {
@@ -93,33 +108,81 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 					       SFS_BLOCKSIZE);
 		}
 		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
+			for (k=0; k<SFS_BLOCKSIZE; k++) {
+				outdata[k] = freemapdata[j*SFS_BLOCKSIZE + k]
+					& ~resdata[j*SFS_BLOCKSIZE + k];
+			}
+			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j,
+						outdata, SFS_BLOCKSIZE);
 		}
 
 		/* If we failed, stop. */
 		if (result) {
+			kfree(outdata);
 			return result;
 		}
 	}
+	kfree(outdata);
 	return 0;
 }
 
 /*
  * Sync routine for the vnode table.
+ *
+ * This only writes the inodes back into the buffer cache; sfs_sync
+ * flushes the cache once afterwards. (Calling VOP_FSYNC here would
+ * flush the whole cache once per vnode.)
+ *
+ * A vnode's sv_lock comes before sfs_vnlock, so we can't take it
+ * while looking at the table. Instead take a reference to each vnode
+ * in use, drop sfs_vnlock, sync them, and then let them go. Inactive
+ * vnodes were synced when they went on the inactive list and haven't
+ * been touched since.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct sfs_vnode *sv;
+	struct vnode **vs;
+	unsigned h, i, num;
+
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes - sfs->sfs_ninactive;
+	if (num == 0) {
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+	vs = kmalloc(num * sizeof(*vs));
+	if (vs == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	i = 0;
+	for (h=0; h<SFS_VNHASHSIZE; h++) {
+		for (sv = sfs->sfs_vnhash[h]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			if (sv->sv_inactive) {
+				continue;
+			}
+			KASSERT(i < num);
+			vs[i] = &sv->sv_absvn;
+			VOP_INCREF(vs[i]);
+			i++;
+		}
+	}
+	KASSERT(i == num);
+	lock_release(sfs->sfs_vnlock);
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/* Go over the loaded vnodes, syncing as we go. */
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		sv = vs[i]->vn_data;
+		rwlock_acquire_write(sv->sv_lock);
+		sfs_sync_inode(sv);
+		rwlock_release_write(sv->sv_lock);
+		VOP_DECREF(vs[i]);
 	}
+	kfree(vs);
 	return 0;
 }
 
@@ -132,13 +195,16 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
@@ -152,14 +218,17 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_superlock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_superlock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_superlock);
 	return 0;
 }
 
@@ -174,8 +243,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -211,25 +278,27 @@ sfs_sync(struct fs *fs)
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
+	/* All of the above just went into the buffer cache; flush it. */
+	result = sfs_buf_flush(sfs);
+	if (result) {
+		return result;
+	}
+
 	return 0;
 }
 
@@ -243,13 +312,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* This never changes after mount, so it doesn't need a lock. */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -259,10 +324,17 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	sfs_buf_purge(sfs);
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	if (sfs->sfs_resmap != NULL) {
+		bitmap_destroy(sfs->sfs_resmap);
+	}
+	lock_destroy(sfs->sfs_superlock);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
+	KASSERT(sfs->sfs_nvnodes == 0);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -278,14 +350,22 @@ sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (The VFS
+	 * layer holds vfs_biglock across this, so nobody can look up
+	 * anything new on this volume while we're tearing it down.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > sfs->sfs_ninactive) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 
+	/* Throw away the vnodes kept around in case they were reused */
+	sfs_inactive_flush(sfs);
+	KASSERT(sfs->sfs_nvnodes == 0);
+	lock_release(sfs->sfs_vnlock);
+
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
@@ -297,7 +377,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -321,6 +400,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -351,17 +431,39 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		goto cleanup_object;
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
 	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_vngen = 0;
+	sfs->sfs_inacthead = sfs->sfs_inacttail = NULL;
+	sfs->sfs_ninactive = 0;
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
+	sfs->sfs_resmap = NULL;
 	sfs->sfs_freemapdirty = false;
 
+	/* locks */
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_object;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vnlock;
+	}
+	sfs->sfs_superlock = lock_create("sfs_superlock");
+	if (sfs->sfs_superlock == NULL) {
+		goto cleanup_freemaplock;
+	}
+
 	return sfs;
 
+cleanup_freemaplock:
+	lock_destroy(sfs->sfs_freemaplock);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,8 +490,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -402,7 +502,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +509,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -423,7 +521,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -436,7 +533,14 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
+		return EINVAL;
+	}
+
+	if (sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN) {
+		kprintf("sfs: Unsupported features in superblock (0x%x)\n",
+			sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
 		return EINVAL;
 	}
 
@@ -450,24 +554,22 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
-	if (sfs->sfs_freemap == NULL) {
+	sfs->sfs_resmap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
+	if (sfs->sfs_freemap == NULL || sfs->sfs_resmap == NULL) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -36,12 +36,14 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Write an on-disk inode structure back out to disk. The caller must
+ * hold sv_lock exclusively.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -49,6 +51,8 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
 					sizeof(sv->sv_i));
@@ -60,6 +64,153 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Vnode table
+//
+// Loaded vnodes are kept in a hash table keyed by inode number.
+// When the last reference to a vnode whose file still exists goes
+// away, the vnode isn't freed; it goes on the volume's inactive list,
+// still in the table, and the inactive list keeps that last
+// reference. sfs_loadvnode takes it back off the list if the inode
+// is wanted again. The oldest inactive vnode is freed when there are
+// more than SFS_NINACTIVE of them. All of this is under sfs_vnlock.
+// sfs_vngen counts vnodes leaving the table, for sfs_loadvnode.
+
+#define SFS_VNHASH(ino)	((ino) % SFS_VNHASHSIZE)
+
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[SFS_VNHASH(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	h = SFS_VNHASH(sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (svp = &sfs->sfs_vnhash[SFS_VNHASH(sv->sv_ino)]; *svp != NULL;
+	     svp = &(*svp)->sv_hashnext) {
+		if (*svp == sv) {
+			*svp = sv->sv_hashnext;
+			sv->sv_hashnext = NULL;
+			KASSERT(sfs->sfs_nvnodes > 0);
+			sfs->sfs_nvnodes--;
+			sfs->sfs_vngen++;
+			return;
+		}
+	}
+	panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+	      sfs->sfs_sb.sb_volname, sv->sv_ino);
+}
+
+static
+void
+sfs_inactive_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!sv->sv_inactive);
+
+	sv->sv_inactive = true;
+	sv->sv_inactnext = NULL;
+	sv->sv_inactprev = sfs->sfs_inacttail;
+	if (sfs->sfs_inacttail != NULL) {
+		sfs->sfs_inacttail->sv_inactnext = sv;
+	}
+	else {
+		sfs->sfs_inacthead = sv;
+	}
+	sfs->sfs_inacttail = sv;
+	sfs->sfs_ninactive++;
+}
+
+static
+void
+sfs_inactive_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_inactive);
+
+	if (sv->sv_inactprev != NULL) {
+		sv->sv_inactprev->sv_inactnext = sv->sv_inactnext;
+	}
+	else {
+		sfs->sfs_inacthead = sv->sv_inactnext;
+	}
+	if (sv->sv_inactnext != NULL) {
+		sv->sv_inactnext->sv_inactprev = sv->sv_inactprev;
+	}
+	else {
+		sfs->sfs_inacttail = sv->sv_inactprev;
+	}
+	sv->sv_inactprev = sv->sv_inactnext = NULL;
+	sv->sv_inactive = false;
+	KASSERT(sfs->sfs_ninactive > 0);
+	sfs->sfs_ninactive--;
+}
+
+/*
+ * Free a vnode that is no longer in the table.
+ */
+static
+void
+sfs_vnode_destroy(struct sfs_vnode *sv)
+{
+	sfs_dir_dropindex(sv);
+	sfs_extent_cleanup(sv);
+	rwlock_destroy(sv->sv_lock);
+	vnode_cleanup(&sv->sv_absvn);
+	kfree(sv);
+}
+
+/*
+ * Free all the inactive vnodes. Used at unmount time.
+ */
+void
+sfs_inactive_flush(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	while ((sv = sfs->sfs_inacthead) != NULL) {
+		sfs_inactive_remove(sfs, sv);
+		sfs_vnhash_remove(sfs, sv);
+		sfs_vnode_destroy(sv);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Vnode lifecycle
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,15 +221,22 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode *victim;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Lock the vnode, then the vnode table. Holding sfs_vnlock
+	 * keeps sfs_loadvnode from handing out new references while
+	 * we decide; we keep it until the vnode is out of the table
+	 * so nobody can load a second copy of the inode while we're
+	 * still writing this one back.
+	 */
+	rwlock_acquire_write(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,100 +246,142 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(sv->sv_lock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
-	if (sv->sv_i.sfi_linkcount == 0) {
-		result = sfs_itrunc(sv, 0);
+	if (sv->sv_i.sfi_linkcount > 0) {
+		/*
+		 * The file still exists, so it may well be opened
+		 * again soon. Write the inode back and keep the vnode
+		 * on the inactive list, which takes over the reference
+		 * VOP_DECREF gave us. If that makes too many, free the
+		 * oldest. Nobody is writing it now, so give back the
+		 * blocks reserved for it.
+		 */
+		sfs_bunreserve(sv);
+		result = sfs_sync_inode(sv);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
+			rwlock_release_write(sv->sv_lock);
 			return result;
 		}
+		sfs_inactive_add(sfs, sv);
+
+		victim = NULL;
+		if (sfs->sfs_ninactive > SFS_NINACTIVE) {
+			victim = sfs->sfs_inacthead;
+			sfs_inactive_remove(sfs, victim);
+			sfs_vnhash_remove(sfs, victim);
+		}
+
+		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(sv->sv_lock);
+
+		if (victim != NULL) {
+			sfs_vnode_destroy(victim);
+		}
+		return 0;
+	}
+
+	/* There are no on-disk references to the file either; erase it. */
+	result = sfs_itrunc(sv, 0);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(sv->sv_lock);
+		return result;
 	}
 
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
-	}
+	/* Discard the inode */
+	sfs_bfree(sfs, sv->sv_ino);
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
-
-	vnode_cleanup(&sv->sv_absvn);
+	sfs_vnhash_remove(sfs, sv);
 
-	vfs_biglock_release();
+	/* Nobody can find it now. */
+	lock_release(sfs->sfs_vnlock);
+	rwlock_release_write(sv->sv_lock);
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	sfs_vnode_destroy(sv);
 
 	/* Done */
 	return 0;
 }
 
+/*
+ * Take a reference to a vnode found in the table. The caller must
+ * hold sfs_vnlock.
+ */
+static
+void
+sfs_vnode_reuse(struct sfs_fs *sfs, struct sfs_vnode *sv, int forcetype)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	/* Every inode in memory must be in an allocated block */
+	if (!sfs_bused(sfs, sv->sv_ino)) {
+		panic("sfs: %s: Found inode %u in unallocated block\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	}
+
+	/* forcetype is only allowed when creating objects */
+	KASSERT(forcetype==SFS_TYPE_INVAL);
+
+	if (sv->sv_inactive) {
+		/* Take over the inactive list's reference */
+		sfs_inactive_remove(sfs, sv);
+	}
+	else {
+		VOP_INCREF(&sv->sv_absvn);
+	}
+}
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * So that one disk read doesn't hold up every other lookup on the
+ * volume, the inode is read without sfs_vnlock held. Afterwards we
+ * retake it and look again: if someone else loaded the inode in the
+ * meantime, we use theirs. If any vnode left the table in the
+ * meantime, it may have been this inode, written back after we read
+ * it; what we have may then be stale, so start over.
  */
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
-	struct sfs_vnode *sv;
+	struct sfs_vnode *sv, *other;
 	const struct vnode_ops *ops;
-	unsigned i, num;
+	unsigned gen;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
-		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
+ again:
+	lock_acquire(sfs->sfs_vnlock);
 
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
+		sfs_vnode_reuse(sfs, sv, forcetype);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
+	gen = sfs->sfs_vngen;
+	lock_release(sfs->sfs_vnlock);
+
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
@@ -202,6 +402,16 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		return result;
 	}
 
+	/*
+	 * Reads are the common case, and several threads may well be
+	 * reading the same file, so let them share.
+	 */
+	sv->sv_lock = rwlock_create("sfs_vnode", RWLOCK_WRITERPREF);
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		return ENOMEM;
+	}
+
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
@@ -235,20 +445,44 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_lastblock = ino;
+	sv->sv_prealloc = 0;
+	sv->sv_npre = 0;
+	sv->sv_dirindex = NULL;
+	sv->sv_hashnext = NULL;
+	sv->sv_inactive = false;
+	sv->sv_inactprev = sv->sv_inactnext = NULL;
+	sfs_extent_init(sv);
+
+	lock_acquire(sfs->sfs_vnlock);
+
+	other = sfs_vnhash_find(sfs, ino);
+	if (other != NULL) {
+		/* Someone else loaded it while we were reading */
+		sfs_vnode_reuse(sfs, other, forcetype);
+		lock_release(sfs->sfs_vnlock);
+		sfs_vnode_destroy(sv);
+		*ret = other;
+		return 0;
+	}
+	if (gen != sfs->sfs_vngen) {
+		/* What we read may be out of date */
+		lock_release(sfs->sfs_vnlock);
+		sfs_vnode_destroy(sv);
+		goto again;
+	}
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	sfs_vnhash_add(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -296,25 +530,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
@@ -38,6 +38,7 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -46,24 +47,16 @@
 // Basic block-level I/O routines
 
 /*
- * Note: sfs_readblock is used to read the superblock
- * early in mount, before sfs is fully (or even mostly)
- * initialized, and so may not use anything from sfs
- * except sfs_device.
+ * Read or write a block, or several consecutive blocks, retrying I/O
+ * errors. This goes straight to the device; everything else goes
+ * through the buffer cache, which uses this.
  */
-
-/*
- * Read or write a block, retrying I/O errors.
- */
-static
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 {
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -102,44 +95,66 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Note: sfs_readblock is used to read the superblock
+ * early in mount, before sfs is fully (or even mostly)
+ * initialized, and so may not use anything from sfs
+ * except sfs_device.
+ */
+
+/*
+ * Read a block (through the buffer cache).
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, true, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, sfs_buf_data(buf), len);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block (through the buffer cache; it goes to disk later).
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(sfs_buf_data(buf), data, len);
+	sfs_buf_dirty(buf);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
+/* Read-ahead window sizes, in blocks */
+#define SFS_RAMIN	4
+#define SFS_RAMAX	64
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
+ * need the original contents of the block, even if we're writing, so
  * we don't clobber the portion of the block we're not intending to
- * write over.
+ * write over; get it from the buffer cache.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,16 +165,9 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	char *iobuf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,9 +177,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -184,119 +189,168 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		return uiomovezeros(len, uio);
 	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+
+	result = sfs_buf_get(sfs, diskblock, true, &buf);
+	if (result) {
+		return result;
 	}
+	iobuf = sfs_buf_data(buf);
 
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
 	result = uiomove(iobuf+skipstart, len, uio);
-	if (result) {
-		return result;
-	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the buffer needs writing back, even if
+	 * only part of it got changed.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
+		if (result == 0) {
+			sfs_buf_dirty(buf);
+		}
+		else {
+			sfs_buf_abort(buf);
 		}
 	}
 
-	return 0;
+	sfs_buf_release(buf);
+	return result;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O (either read or write) of a single whole block, which the
+ * caller has already mapped to DISKBLOCK (0 for a hole). Since a
+ * write replaces the whole block, it doesn't need to read the old
+ * contents.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, daddr_t diskblock)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t diskblock;
-	uint32_t fileblock;
+	struct sfs_buf *buf;
 	int result;
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
-
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
-
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
-	}
 
 	if (diskblock == 0) {
 		/*
 		 * No block - fill with zeros.
 		 *
-		 * We must be reading, or sfs_bmap would have
+		 * We must be reading, or sfs_bmap_range would have
 		 * allocated a block for us.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	result = sfs_buf_get(sfs, diskblock, uio->uio_rw == UIO_READ, &buf);
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	result = uiomove(sfs_buf_data(buf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		if (result == 0) {
+			sfs_buf_dirty(buf);
+		}
+		else {
+			sfs_buf_abort(buf);
+		}
+	}
 
-	result = sfs_rwblock(sfs, uio);
+	sfs_buf_release(buf);
+	return result;
+}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+/*
+ * Called after reading from START up to END in a file. If that
+ * picked up where the last read left off, the file is probably being
+ * read sequentially, so grow the read-ahead window and, once the
+ * reader gets within half a window of the end of what's been read
+ * ahead so far, queue the next window's worth of blocks to be read
+ * into the buffer cache in the background. Otherwise, shrink the
+ * window.
+ *
+ * The caller holds sv_lock (at least shared).
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t first = start / SFS_BLOCKSIZE;
+	uint32_t next = end / SFS_BLOCKSIZE;
+	uint32_t eof = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	uint32_t from, to, fileblock, run;
+	daddr_t diskblock;
 
-	return result;
+	from = to = 0;
+	spinlock_acquire(&sv->sv_extlock);
+	if (first == sv->sv_ranext) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+		if (sv->sv_raend < next + sv->sv_rawindow / 2) {
+			from = sv->sv_raend > next ? sv->sv_raend : next;
+			to = next + sv->sv_rawindow;
+			if (to > eof) {
+				to = eof;
+			}
+			if (from < to) {
+				sv->sv_raend = to;
+			}
+		}
+	}
+	else {
+		sv->sv_rawindow /= 2;
+		sv->sv_raend = 0;
+	}
+	sv->sv_ranext = next;
+	spinlock_release(&sv->sv_extlock);
+
+	for (fileblock = from; fileblock < to; fileblock += run) {
+		if (sfs_bmap_range(sv, fileblock, to - fileblock, false,
+				   &diskblock, &run)) {
+			/* never mind */
+			break;
+		}
+		if (diskblock != 0) {
+			sfs_buf_readahead(sfs, diskblock, run);
+		}
+	}
 }
 
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
+ *
+ * The caller must hold sv_lock: shared for reads, exclusive for writes.
  */
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks, run, i;
+	daddr_t diskblock;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t origoffset;
+	bool doalloc = (uio->uio_rw==UIO_WRITE);
+
+	KASSERT(uio->uio_rw == UIO_READ ||
+		rwlock_do_i_hold_write(sv->sv_lock));
 
 	origresid = uio->uio_resid;
+	origoffset = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -348,15 +402,32 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Now we should be block-aligned. Do the remaining whole blocks.
+	 * Now we should be block-aligned. Do the remaining whole
+	 * blocks, mapping as many at a time as lie together on disk.
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	while (nblocks > 0) {
+		result = sfs_bmap_range(sv, uio->uio_offset / SFS_BLOCKSIZE,
+					nblocks, doalloc, &diskblock, &run);
 		if (result) {
 			goto out;
 		}
+		if (run > 1 && diskblock != 0 && uio->uio_rw == UIO_READ) {
+			/* Get the blocks in with as few transfers as we can */
+			result = sfs_buf_fill(sfs, diskblock, run);
+			if (result) {
+				goto out;
+			}
+		}
+		for (i=0; i<run; i++) {
+			result = sfs_blockio(sv, uio,
+					     diskblock == 0 ? 0 : diskblock + i);
+			if (result) {
+				goto out;
+			}
+		}
+		nblocks -= run;
 	}
 
 	/*
@@ -381,6 +452,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/* If reading and it worked, see about reading ahead */
+	if (result == 0 && uio->uio_rw == UIO_READ) {
+		sfs_readahead(sv, origoffset, uio->uio_offset);
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -401,12 +477,19 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
  * such code in this version of SFS, it is often desirable when doing
  * more advanced things to handle metadata and user data I/O
  * differently.
+ *
+ * If SETSIZE is true, writing past EOF extends the file. Otherwise
+ * the size is left alone; this is for the directory hash index,
+ * which lives past the end of the directory's entries.
  */
+static
 int
-sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
-	   enum uio_rw rw)
+sfs_metaio_common(struct sfs_vnode *sv, off_t actualpos, void *data,
+		  size_t len, enum uio_rw rw, bool setsize)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	char *metaiobuf;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,17 +497,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rw == UIO_READ || rwlock_do_i_hold_write(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -446,11 +519,12 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = sfs_buf_get(sfs, diskblock, true, &buf);
 	if (result) {
 		return result;
 	}
+	metaiobuf = sfs_buf_data(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
@@ -459,22 +533,35 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	else {
 		/* Update the selected region */
 		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		sfs_buf_dirty(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
-		if (endpos > (off_t)sv->sv_i.sfi_size) {
+		if (setsize && endpos > (off_t)sv->sv_i.sfi_size) {
 			sv->sv_i.sfi_size = endpos;
 			sv->sv_dirty = true;
 		}
 	}
 
+	sfs_buf_release(buf);
+
 	/* Done */
 	return 0;
 }
+
+int
+sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
+	   enum uio_rw rw)
+{
+	return sfs_metaio_common(sv, actualpos, data, len, rw, true);
+}
+
+/*
+ * Metadata I/O that leaves the file size alone; see above.
+ */
+int
+sfs_indexio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
+	    enum uio_rw rw)
+{
+	return sfs_metaio_common(sv, actualpos, data, len, rw, false);
+}
@@ -44,12 +44,33 @@ extern const struct vnode_ops sfs_dirops;
 
 /* Functions in sfs_balloc.c */
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc_file(struct sfs_vnode *sv, daddr_t goal, daddr_t *diskblock);
+void sfs_bunreserve(struct sfs_vnode *sv);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
+/* Functions in sfs_cache.c */
+struct sfs_buf;
+int sfs_buf_get(struct sfs_fs *sfs, daddr_t block, bool fill,
+		struct sfs_buf **ret);
+int sfs_buf_fill(struct sfs_fs *sfs, daddr_t block, unsigned nblocks);
+void sfs_buf_readahead(struct sfs_fs *sfs, daddr_t block, unsigned nblocks);
+void *sfs_buf_data(struct sfs_buf *buf);
+void sfs_buf_dirty(struct sfs_buf *buf);
+void sfs_buf_abort(struct sfs_buf *buf);
+void sfs_buf_release(struct sfs_buf *buf);
+void sfs_buf_forget(struct sfs_fs *sfs, daddr_t block);
+int sfs_buf_flush(struct sfs_fs *sfs);
+void sfs_buf_purge(struct sfs_fs *sfs);
+
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
+int sfs_bmap_range(struct sfs_vnode *sv, uint32_t fileblock,
+		uint32_t maxblocks, bool doalloc,
+		daddr_t *diskblock, uint32_t *nblocks);
+void sfs_extent_init(struct sfs_vnode *sv);
+void sfs_extent_cleanup(struct sfs_vnode *sv);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
@@ -58,6 +79,7 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+void sfs_dir_dropindex(struct sfs_vnode *sv);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
@@ -69,13 +91,17 @@ int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
 int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
+void sfs_inactive_flush(struct sfs_fs *sfs);
 
 /* Functions in sfs_io.c */
+int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
+int sfs_indexio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
+		enum uio_rw rw);
 
 
 #endif /* _SFSPRIVATE_H_ */
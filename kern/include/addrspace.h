@@ -73,6 +73,14 @@ struct addrspace {
         /* Linked list of as_region structs */
         region *as_regions;
 
+        /*
+         * Protects as_regions. Faults only look regions up, so they
+         * share it; defining and reflagging regions takes it
+         * exclusively. Regions are only freed in as_destroy, so a
+         * region returned by lookup_region stays valid.
+         */
+        struct rwlock *as_regionlock;
+
 #endif
 };
 
@@ -113,6 +121,12 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_map_page - give a page of kernel memory (from alloc_kpages) to
+ *                the address space, to appear at user address VADDR.
+ *                Used by exec to hand over the argv strings without
+ *                copying them. The address space owns the page after
+ *                this succeeds.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -131,6 +145,8 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_map_page(struct addrspace *as, vaddr_t vaddr,
+                              vaddr_t kpage);
 
 /* check if region in an addrspace. return region if found and NULL if not found */
 region *lookup_region(struct addrspace *as, vaddr_t faultaddress);
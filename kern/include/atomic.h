@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+/*
+ * Atomic operations on machine words, for lock-free code such as
+ * reference counts.
+ *
+ * atomic_cas(p, old, new) compares *p with OLD and, if they're equal,
+ * sets *p to NEW. Either way it returns the value found in *p, so it
+ * succeeded if and only if that equals OLD.
+ *
+ * atomic_add(p, delta) adds DELTA to *p and returns the new value.
+ *
+ * atomic_inc_nonzero(p) increments *p unless it is zero, and returns
+ * true if it did. This is for taking a new reference to an object
+ * found without a lock, whose last reference might be going away.
+ *
+ * None of these are memory barriers. Use membar.h as needed.
+ */
+
+#include <cdefs.h>
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef ATOMIC_INLINE
+#define ATOMIC_INLINE INLINE
+#endif
+
+ATOMIC_INLINE unsigned atomic_cas(volatile unsigned *p,
+				  unsigned oldval, unsigned newval);
+ATOMIC_INLINE unsigned atomic_add(volatile unsigned *p, int delta);
+ATOMIC_INLINE bool atomic_inc_nonzero(volatile unsigned *p);
+
+/* Get the machine-dependent compare-and-swap. */
+#include <machine/atomic.h>
+
+/*
+ * The rest are built on atomic_cas.
+ */
+
+ATOMIC_INLINE
+unsigned
+atomic_add(volatile unsigned *p, int delta)
+{
+	unsigned val;
+
+	do {
+		val = *p;
+	} while (atomic_cas(p, val, val + delta) != val);
+	return val + delta;
+}
+
+ATOMIC_INLINE
+bool
+atomic_inc_nonzero(volatile unsigned *p)
+{
+	unsigned val;
+
+	do {
+		val = *p;
+		if (val == 0) {
+			return false;
+		}
+	} while (atomic_cas(p, val, val + 1) != val);
+	return true;
+}
+
+#endif /* _ATOMIC_H_ */
@@ -38,8 +38,9 @@
 
 
 /*
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, only when the
+ * CPU is not idle, for scheduling. When hardclock finds the CPU idle
+ * it stops the tick; hardclock_resume() restarts it.
  */
 
 /* hardclocks per second */
@@ -47,12 +48,44 @@
 
 void hardclock_bootstrap(void);
 void hardclock(void);
+void hardclock_resume(void);
 
 /*
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU by a one-shot timer device when
+ * the next timeout is due. The device driver hands timerclock_attach
+ * a function for setting it to go off in a given number of
+ * microseconds.
  */
 void timerclock(void);
+void timerclock_attach(void *devdata, void (*setalarm)(void *, uint32_t));
+
+/*
+ * Timeouts. A timeout calls FUNC(DATA), once, at (or very shortly
+ * after) a given time. FUNC is called from the timer interrupt, so
+ * it must not sleep.
+ *
+ * timeout_init  Set up a timeout. Call this once before using it.
+ * timeout_add   Arrange for the timeout to go off USECS microseconds
+ *               from now. If it is already pending it is rescheduled.
+ * timeout_del   Cancel a timeout. Returns true if it was pending; if
+ *               false, FUNC has already run or may be running now.
+ *
+ * The structure is public so timeouts need not be malloc'd, but its
+ * contents belong to clock.c.
+ */
+struct timeout {
+	struct timeout *to_next;	/* Links for timing wheel slot */
+	struct timeout **to_prevp;
+	uint64_t to_when;		/* Expiry time, in usecs */
+	unsigned to_level;		/* Wheel level we're on */
+	bool to_pending;		/* True if on the wheel */
+	void (*to_func)(void *);	/* Function to call */
+	void *to_data;			/* Argument for it */
+};
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *data);
+void timeout_add(struct timeout *to, uint64_t usecs);
+bool timeout_del(struct timeout *to);
 
 /*
  * gettime() may be used to fetch the current time of day.
@@ -76,8 +109,10 @@ void timespec_sub(const struct timespec *t1,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * clockusleep() is the same but takes microseconds, like usleep(3).
  */
 void clocksleep(int seconds);
+void clockusleep(uint64_t usecs);
 
 
 #endif /* _CLOCK_H_ */
@@ -35,6 +35,12 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/*
+ * Number of scheduler priority levels. Each cpu has one run queue per
+ * level; level 0 is the highest priority. See schedule() in thread.c.
+ */
+#define SCHED_NLEVELS	4
+
 
 /*
  * Per-cpu structure
@@ -61,13 +67,16 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	bool c_tickless;		/* True if hardclock is stopped */
+	unsigned c_steals;		/* Threads stolen from other cpus */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues by level */
+	unsigned c_runcount;		/* Total threads in c_runqueue[] */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -112,6 +121,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Look up cpus by number, for statistics and test code. cpu_get
+ * returns NULL if there is no cpu NUM.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned num);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _DISKQ_H_
+#define _DISKQ_H_
+
+/*
+ * Disk request queue.
+ *
+ * A block device driver can put a diskq in front of its I/O routine.
+ * Requests then wait in the queue, and a worker thread for the device
+ * hands them to the driver one at a time in C-LOOK (one-way elevator)
+ * order, so the disk sweeps across instead of seeking back and forth
+ * between whoever asked first. A request that has waited longer than
+ * a deadline goes next regardless, so nothing starves. Requests for
+ * adjacent sectors going the same direction are merged into a single
+ * transfer.
+ *
+ * Only requests into kernel buffers can be queued, since the worker
+ * thread can't get at anyone's user memory; diskq_io passes others
+ * straight through to the driver.
+ */
+
+struct uio;
+struct diskq;	/* Opaque. */
+
+/*
+ * Create a queue for device NAME, with sectors of SECTSIZE bytes.
+ * DOIO does a transfer synchronously; it's called with DATA, from the
+ * queue's worker thread (or directly, for requests that bypass the
+ * queue).
+ */
+struct diskq *diskq_create(const char *name, unsigned sectsize,
+			   int (*doio)(void *data, struct uio *uio),
+			   void *data);
+
+/* Queue an I/O request and wait for it to finish. */
+int diskq_io(struct diskq *dq, struct uio *uio);
+
+/* Print the queue depth and latency statistics for every queue. */
+void diskq_printstats(void);
+
+#endif /* _DISKQ_H_ */
@@ -40,23 +40,35 @@
 /*
  * The file table is an array of open files.
  *
- * There is no particular reason to use a fixed size array (of size
- * OPEN_MAX) instead of a dynamically sized array (using array.h) --
- * the code was just written this way years ago and there's no
- * compelling reason to change it that outweighs this benefit: you can
- * look through the code to see what it would take to make it dynamic,
- * or even to make it dynamic with the limit being user-settable. (See
- * setrlimit(2) on a Unix machine.)
+ * The array starts small and grows (by doubling) as higher file
+ * handles are used, up to OPEN_MAX. When it grows the old array isn't
+ * freed, as a lookup might still be reading it; the old arrays are
+ * kept on a list and freed with the table. Since each is half the
+ * size of the next, this costs at most as much again as the current
+ * array.
  *
- * Because we only have single-threaded processes, the file table is
- * never shared and so it doesn't require synchronization. On fork,
- * the table is copied. Another exercise: what would you need to do to
- * make this code safe for multithreaded processes? What happens if
- * one thread calls close() while another one is in the middle of e.g.
- * read() using the same file handle?
+ * On fork, the table is copied. So that it can be shared by the
+ * threads of a multithreaded process, changes to the table (open,
+ * close, dup2) are made holding ft_lock. Looking up a file handle,
+ * which is what nearly every file syscall does, takes no lock at all:
+ * it reads the slot and takes a reference to the openfile with
+ * openfile_tryincref, then checks the slot still holds that file.
+ *
+ * The lock is not held while the file is in use. Instead,
+ * filetable_get hands back its own reference to the openfile, which
+ * filetable_put drops; so if one thread calls close() while another
+ * is in the middle of read() on the same handle, the read finishes
+ * and the file goes away afterwards.
  */
+struct fdarray {
+	unsigned fa_num;			/* number of slots */
+	struct openfile *volatile *fa_files;	/* the slots */
+	struct fdarray *fa_old;			/* retired smaller arrays */
+};
+
 struct filetable {
-	struct openfile *ft_openfiles[OPEN_MAX];
+	struct lock *ft_lock;			/* for changes */
+	struct fdarray *volatile ft_files;	/* current array */
 };
 
 /*
@@ -68,10 +80,12 @@ struct filetable {
  * okfd -    Check if a file handle is in range.
  * get/put - Retrieve a fd for use and put it back when done. (Checks
  *           okfd and also fails on files not open; returned openfile
- *           is not NULL.) Call put with the file returned from get.
+ *           is not NULL, and is referenced until put.) Call put with
+ *           the file returned from get.
  * place -   Insert a file and return the fd.
  * placeat - Insert a file at a specific slot and return the file
- *           previously there.
+ *           previously there. Fails only if the table needs to grow
+ *           and can't.
  */
 
 struct filetable *filetable_create(void);
@@ -83,8 +97,8 @@ int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
 void filetable_put(struct filetable *ft, int fd, struct openfile *file);
 
 int filetable_place(struct filetable *ft, struct openfile *file, int *fd);
-void filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
-		       struct openfile **oldfile_ret);
+int filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
+		      struct openfile **oldfile_ret);
 
 
 #endif /* _FILETABLE_H_ */
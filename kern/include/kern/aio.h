@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_AIO_H_
+#define _KERN_AIO_H_
+
+/*
+ * Asynchronous I/O rings, for aio_setup() and aio_enter().
+ *
+ * The process allocates a ring in its own memory and registers it
+ * with aio_setup. The ring is a struct aio_ring header followed by
+ * NENTRIES submission entries and then NENTRIES completion entries;
+ * use AIO_RINGSIZE to get the total size, and AIO_RING_SQ and
+ * AIO_RING_CQ to find the entries.
+ *
+ * To start I/O, fill in submission entries at ar_sqtail (modulo
+ * NENTRIES), advance ar_sqtail, and call aio_enter. The kernel
+ * consumes entries from ar_sqhead. When an operation finishes, the
+ * kernel fills in a completion entry at ar_cqtail and advances it;
+ * the process reads entries from ar_cqhead and advances ar_cqhead to
+ * give the slots back. The heads and tails are free-running counters.
+ *
+ * Only seekable objects (files) can be used; operations on anything
+ * else, such as the console, fail with ESPIPE.
+ *
+ * Completions are only posted during aio_enter, which can also wait
+ * for them. At most NENTRIES operations can be outstanding (submitted
+ * and not yet consumed from the completion queue) at once.
+ */
+
+/* Operations */
+#define AIO_OP_READ	0	/* like pread */
+#define AIO_OP_WRITE	1	/* like pwrite */
+#define AIO_OP_FSYNC	2	/* like fsync; buffer ignored */
+
+/* Largest ring, and largest transfer for one operation */
+#define AIO_MAXENTRIES	256
+#define AIO_MAXIO	65536
+
+struct aio_sqe {
+	off_t sqe_offset;	/* file position */
+#ifdef _KERNEL
+	userptr_t sqe_buf;	/* user buffer */
+#else
+	void *sqe_buf;		/* buffer */
+#endif
+	size_t sqe_len;		/* transfer size */
+	int sqe_fd;		/* file handle */
+	int sqe_op;		/* AIO_OP_* */
+	__u32 sqe_tag;		/* handed back in the completion */
+	__u32 sqe_reserved;	/* set to 0 */
+};
+
+struct aio_cqe {
+	__u32 cqe_tag;		/* sqe_tag of the operation */
+	int cqe_result;		/* byte count, or -errno on failure */
+};
+
+struct aio_ring {
+	volatile unsigned ar_sqhead;	/* advanced by kernel */
+	volatile unsigned ar_sqtail;	/* advanced by process */
+	volatile unsigned ar_cqhead;	/* advanced by process */
+	volatile unsigned ar_cqtail;	/* advanced by kernel */
+};
+
+#define AIO_RINGSIZE(n) \
+	(sizeof(struct aio_ring) + \
+	 (n) * (sizeof(struct aio_sqe) + sizeof(struct aio_cqe)))
+#define AIO_RING_SQ(r) ((struct aio_sqe *)((struct aio_ring *)(r) + 1))
+#define AIO_RING_CQ(r, n) ((struct aio_cqe *)(AIO_RING_SQ(r) + (n)))
+
+#endif /* _KERN_AIO_H_ */
@@ -88,9 +88,6 @@
 /* Max bytes for atomic pipe I/O -- see description in the pipe() man page */
 #define __PIPE_BUF      512
 
-/* Max number of processes at once. */
-#define __PROCS_MAX       128
-
 
 /*
  * Not so important parts of the API. (Especially in OS/161 where we
@@ -41,9 +41,10 @@
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_NDEXTENTS     35            /* # of extents in inode */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
@@ -62,6 +63,15 @@
 /* Size of free block bitmap (in blocks) */
 #define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
 
+/*
+ * Feature flags for sb_features. A volume made without any of these
+ * has the original layout. A kernel or tool that finds a flag it
+ * doesn't know about must not touch the volume.
+ */
+#define SFS_FEATURE_EXTENTS  0x00000001   /* inodes have extent tables */
+#define SFS_FEATURE_DIRHASH  0x00000002   /* directories have hash indexes */
+#define SFS_FEATURES_KNOWN   (SFS_FEATURE_EXTENTS | SFS_FEATURE_DIRHASH)
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
@@ -74,11 +84,29 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_features;			/* SFS_FEATURE_* flags */
+	uint32_t reserved[117];			/* unused, set to 0 */
+};
+
+/*
+ * On-disk extent: a run of file blocks that sit one after another on
+ * disk. A slot with sfe_len 0 is unused.
+ */
+struct sfs_dextent {
+	uint32_t sfe_fileblock;			/* First file block of run */
+	uint32_t sfe_diskblock;			/* Disk block it's in */
+	uint32_t sfe_len;			/* Length of run in blocks */
 };
 
 /*
  * On-disk inode
+ *
+ * On volumes with SFS_FEATURE_EXTENTS, a file block may be mapped
+ * either by one of the extents or by the direct/indirect blocks, but
+ * never both. The extents in use come first in sfi_extents, sorted by
+ * sfe_fileblock, and don't overlap. The direct and indirect blocks
+ * hold whatever doesn't fit in the table. On other volumes the
+ * extent table is unused and set to 0.
  */
 struct sfs_dinode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
@@ -86,7 +114,11 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	struct sfs_dextent sfi_extents[SFS_NDEXTENTS];	/* Extents */
+	uint32_t sfi_waste[128-5-SFS_NDIRECT-3*SFS_NDEXTENTS];
+						/* unused space, set to 0 */
 };
 
 /*
@@ -97,5 +129,53 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * On-disk directory hash index (SFS_FEATURE_DIRHASH only)
+ *
+ * A directory's index is kept in the directory itself, starting at
+ * file block SFS_DIRINDEX_BLOCK, far past the end of the entries; so
+ * a directory can have at most SFS_DIRINDEX_MAXSLOTS entries. The
+ * first block holds a struct sfs_dirhdr, then as many empty slot
+ * numbers as fit (sdh_nfree of them are valid). The table of buckets
+ * starts in the next block. It is open-addressed with linear probing,
+ * and its size is a power of 2, at least one block's worth.
+ *
+ * A bucket holds the hash of a name and the name's slot plus one, or
+ * SFS_DIRB_EMPTY if it has never been used, or SFS_DIRB_DELETED if
+ * its name has been removed. The hash is 32-bit FNV-1a over the bytes
+ * of the name.
+ *
+ * A directory whose header doesn't have SFS_DIRINDEX_MAGIC in it has
+ * no index, and is searched by reading all its entries.
+ */
+#define SFS_DIRINDEX_BLOCK    16384       /* file block of index header */
+#define SFS_DIRINDEX_MAGIC    0x5ed1ec75  /* magic number for header */
+#define SFS_DIRB_EMPTY        0           /* bucket not used yet */
+#define SFS_DIRB_DELETED      0xffffffff  /* bucket's name removed */
+
+struct sfs_dirhdr {
+	uint32_t sdh_magic;			/* SFS_DIRINDEX_MAGIC */
+	uint32_t sdh_nbuckets;			/* Size of table */
+	uint32_t sdh_count;			/* # of names in table */
+	uint32_t sdh_ndeleted;			/* # of deleted buckets */
+	uint32_t sdh_nfree;			/* # of empty slots listed */
+};
+
+struct sfs_dirbucket {
+	uint32_t sdb_hash;			/* Hash of name */
+	uint32_t sdb_slot;			/* Slot + 1, or SFS_DIRB_* */
+};
+
+/* Max # of entries in a directory with an index */
+#define SFS_DIRINDEX_MAXSLOTS \
+	(SFS_DIRINDEX_BLOCK * (SFS_BLOCKSIZE / sizeof(struct sfs_direntry)))
+
+/* # of empty slots listed after the header */
+#define SFS_DIRINDEX_NFREE \
+	((SFS_BLOCKSIZE - sizeof(struct sfs_dirhdr)) / sizeof(uint32_t))
+
+/* # of buckets per block */
+#define SFS_DIRB_PERBLOCK (SFS_BLOCKSIZE / sizeof(struct sfs_dirbucket))
+
 
 #endif /* _KERN_SFS_H_ */
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiler. Enable with "options lockprof" in the
+ * kernel config.
+ *
+ * Each profiled lock carries a struct lockprof next to its hangman
+ * hook, counting acquisitions, acquisitions that had to wait, total
+ * and maximum wait, and maximum hold time, in cycles. The fields are
+ * protected by the lock itself (or, for sleep locks, by the lock's
+ * spinlock). Sleep locks, and spinlocks that ask for it with
+ * spinlock_profile, are kept on a registry list that the "lockprof"
+ * menu command dumps, sorted by total wait. Other spinlocks aren't
+ * listed: lots of them live in structures that are freed, or cleared
+ * and initialized again, without spinlock_cleanup, which would leave
+ * stale entries on the list.
+ *
+ * Times come from mainbus_cycles, which is per-cpu; waits and holds
+ * that begin on one cpu and end on another are counted but not timed.
+ */
+
+#include "opt-lockprof.h"
+
+#if OPT_LOCKPROF
+
+struct cpu;
+
+struct lockprof {
+	const char *lp_name;		/* name, or NULL for a spinlock */
+	const void *lp_lock;		/* the lock, for anonymous ones */
+	struct lockprof *lp_next;	/* registry list */
+	struct lockprof **lp_prevp;
+	unsigned lp_acquires;		/* number of acquisitions */
+	unsigned lp_contended;		/* ...that had to wait */
+	uint64_t lp_waittotal;		/* cycles spent waiting */
+	uint64_t lp_waitmax;		/* longest wait */
+	uint64_t lp_holdmax;		/* longest hold */
+	uint64_t lp_holdstart;		/* when the current hold began */
+	const struct cpu *lp_holdcpu;	/* and where */
+};
+
+/* State for one acquire, kept on the acquirer's stack. */
+struct lockprof_wait {
+	uint64_t lw_start;
+	const struct cpu *lw_cpu;
+	bool lw_contended;
+};
+
+void lockprof_init(struct lockprof *lp, const void *lock);
+void lockprof_register(struct lockprof *lp, const char *name);
+void lockprof_cleanup(struct lockprof *lp);
+void lockprof_waitstart(struct lockprof_wait *lw);
+void lockprof_acquired(struct lockprof *lp, struct lockprof_wait *lw);
+void lockprof_released(struct lockprof *lp);
+
+/* Print the COUNT most waited-for locks; optionally zero the counters. */
+void lockprof_dump(unsigned count, bool reset);
+
+#define LOCKPROF(sym)			struct lockprof sym
+#define LOCKPROF_WAIT(sym)		struct lockprof_wait sym
+
+#define LOCKPROF_INIT(lp, lk)		lockprof_init(lp, lk)
+#define LOCKPROF_REGISTER(lp, name)	lockprof_register(lp, name)
+#define LOCKPROF_CLEANUP(lp)		lockprof_cleanup(lp)
+#define LOCKPROF_WAITSTART(lw)		lockprof_waitstart(lw)
+#define LOCKPROF_CONTENDED(lw)		((lw)->lw_contended = true)
+#define LOCKPROF_ACQUIRED(lp, lw)	lockprof_acquired(lp, lw)
+#define LOCKPROF_RELEASED(lp)		lockprof_released(lp)
+
+/* Not on the registry; note the trailing comma (see SPINLOCK_INITIALIZER) */
+#define LOCKPROF_INITIALIZER	{ NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, NULL },
+
+#else
+
+#define LOCKPROF(sym)
+#define LOCKPROF_WAIT(sym)
+
+#define LOCKPROF_INIT(lp, lk)
+#define LOCKPROF_REGISTER(lp, name)
+#define LOCKPROF_CLEANUP(lp)
+#define LOCKPROF_WAITSTART(lw)
+#define LOCKPROF_CONTENDED(lw)
+#define LOCKPROF_ACQUIRED(lp, lw)
+#define LOCKPROF_RELEASED(lp)
+
+#define LOCKPROF_INITIALIZER
+
+#endif
+
+#endif /* _LOCKPROF_H_ */
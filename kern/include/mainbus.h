@@ -48,6 +48,13 @@ void mainbus_start_cpus(void);
 /* Bus-level interrupt handler, called from cpu-level trap/interrupt code */
 void mainbus_interrupt(struct trapframe *);
 
+/* Stop and restart hardclock on the current CPU, for idling. */
+void mainbus_hardclock_stop(void);
+void mainbus_hardclock_start(void);
+
+/* Cycle counter for the current CPU. */
+uint64_t mainbus_cycles(void);
+
 /* Find the size of main memory. */
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
@@ -34,7 +34,6 @@
 #ifndef _OPENFILE_H_
 #define _OPENFILE_H_
 
-#include <spinlock.h>
 
 
 /*
@@ -47,6 +46,14 @@
  * Open files are reference-counted because they get shared via fork
  * and dup2 calls. And they need locking because that sharing can be
  * among multiple concurrent processes.
+ *
+ * The reference count is updated atomically, without a lock, so that
+ * the file table can hand out references without locking anything
+ * (see filetable.c). For the same reason openfile structures are
+ * never freed: when the last reference goes away the file is closed
+ * and the structure goes on a free list for reuse by a later open.
+ * Code that finds an openfile without holding a reference must use
+ * openfile_tryincref, and then check it still has the file it wanted.
  */
 struct openfile {
 	struct vnode *of_vnode;
@@ -55,8 +62,8 @@ struct openfile {
 	struct lock *of_offsetlock;	/* lock for of_offset */
 	off_t of_offset;
 
-	struct spinlock of_reflock;	/* lock for of_refcount */
-	int of_refcount;
+	volatile unsigned of_refcount;	/* atomic; 0 when free */
+	struct openfile *of_nextfree;	/* free list */
 };
 
 /* open a file (args must be kernel pointers; destroys filename) */
@@ -67,5 +74,8 @@ int openfile_open(char *filename, int openflags, mode_t mode,
 void openfile_incref(struct openfile *);
 void openfile_decref(struct openfile *);
 
+/* incref an openfile found without a reference; fails if it's free */
+bool openfile_tryincref(struct openfile *);
+
 
 #endif /* _OPENFILE_H_ */
@@ -41,6 +41,7 @@
 
 struct addrspace;
 struct vnode;
+struct aioctx;
 
 /*
  * Process structure.
@@ -64,6 +65,7 @@ struct proc {
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
 	struct filetable *p_filetable;	/* table of open files */
+	struct aioctx *p_aio;		/* async I/O state, if any */
 
 	/* add more material here as needed */
 };
@@ -80,7 +82,10 @@ int proc_create_runprogram(const char *name, struct proc **ret);
 /* Create a fresh process for use by fork() */
 int proc_fork(struct proc **ret);
 
-/* Undo proc_fork if nothing's run in the new process yet. */
+/* Create a fresh process with no address space for use by spawn() */
+int proc_spawn(struct proc **ret);
+
+/* Undo proc_fork or proc_spawn if nothing's run in the new process yet. */
 void proc_unfork(struct proc *proc);
 
 /* Destroy a process. */
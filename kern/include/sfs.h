@@ -39,6 +39,7 @@
 /*
  * Get abstract structure definitions
  */
+#include <spinlock.h>
 #include <fs.h>
 #include <vnode.h>
 
@@ -48,6 +49,68 @@
  */
 #include <kern/sfs.h>
 
+struct lock;	/* in synch.h */
+struct rwlock;	/* in synch.h */
+
+/*
+ * Locking.
+ *
+ * Each vnode has a reader-writer lock, sv_lock, covering the inode
+ * (sv_i and sv_dirty), the file's contents, and the blocks reserved
+ * for it (sv_lastblock, sv_prealloc, sv_npre). Reads, lookups, and
+ * stat share it; anything that changes the inode or the contents
+ * holds it exclusively. The volume has three more: sfs_vnlock for
+ * the table of loaded vnodes (sfs_vnhash, sfs_vngen, the inactive
+ * list, and the sv_hashnext, sv_inactive, and sv_inact* fields that
+ * link vnodes into them), sfs_freemaplock for the free block bitmap
+ * and the map of reserved blocks, and sfs_superlock for the superblock.
+ *
+ * The order is:
+ *
+ *	directory sv_lock
+ *	file sv_lock
+ *	sfs_vnlock
+ *	sfs_freemaplock
+ *	sfs_superlock
+ *
+ * (There is only one directory, so no two directories' locks are ever
+ * held at once.) Nothing takes a vnode's sv_lock while holding
+ * sfs_vnlock; in particular sync takes references to the loaded
+ * vnodes and drops sfs_vnlock before syncing them. Nor is sfs_vnlock
+ * held across disk reads: sfs_loadvnode drops it while reading an
+ * inode and checks the table again afterwards.
+ *
+ * sfs_sb.sb_volname, sfs_sb.sb_nblocks, sfs_sb.sb_features, sv_ino
+ * and sv_i.sfi_type don't change once set up, and can be read without locking.
+ *
+ * sv_extents caches part of the block map in sv_i. Readers fill it
+ * in while holding sv_lock only shared, so it has its own spinlock,
+ * sv_extlock, which is taken last and never held across anything
+ * that can sleep. The read-ahead state (sv_ranext and friends) is
+ * updated by readers too, and is also covered by sv_extlock.
+ *
+ * A directory's sv_dirindex is built by whoever first searches it,
+ * possibly with sv_lock held only shared, so installing it is done
+ * under sv_extlock. After that it is only changed with sv_lock held
+ * exclusively.
+ */
+
+struct sfs_dirindex;	/* Private to sfs_dir.c */
+
+/*
+ * A run of file blocks that lie contiguously on disk: file blocks
+ * se_fileblock through se_fileblock + se_len - 1 are disk blocks
+ * se_diskblock onward. A length of 0 means the slot is unused.
+ */
+struct sfs_extent {
+	uint32_t se_fileblock;
+	uint32_t se_diskblock;
+	uint32_t se_len;
+};
+
+/* Number of extents cached per vnode */
+#define SFS_NEXTENTS	8
+
 /*
  * In-memory inode
  */
@@ -56,8 +119,32 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct rwlock *sv_lock;		/* protects sv_i, sv_dirty, data */
+	struct spinlock sv_extlock;	/* protects sv_extents, sv_nextext */
+	struct sfs_extent sv_extents[SFS_NEXTENTS]; /* block map cache */
+	unsigned sv_nextext;		/* next extent slot to replace */
+	uint32_t sv_ranext;		/* block a sequential read is at */
+	uint32_t sv_raend;		/* block read-ahead has gone up to */
+	unsigned sv_rawindow;		/* read-ahead size, in blocks */
+	daddr_t sv_lastblock;		/* block most recently allocated */
+	daddr_t sv_prealloc;		/* first block reserved for file */
+	unsigned sv_npre;		/* number of blocks reserved */
+	struct sfs_dirindex *sv_dirindex; /* directory name index, or NULL */
+	struct sfs_vnode *sv_hashnext;	/* vnode table hash chain */
+	bool sv_inactive;		/* unreferenced, on inactive list */
+	struct sfs_vnode *sv_inactprev;	/* inactive list, oldest first */
+	struct sfs_vnode *sv_inactnext;
 };
 
+/* Number of hash chains in the vnode table */
+#define SFS_VNHASHSIZE	32
+
+/*
+ * Number of unreferenced vnodes kept loaded, so files that are
+ * opened over and over don't have their inodes read in every time.
+ */
+#define SFS_NINACTIVE	32
+
 /*
  * In-memory info for a whole fs volume
  */
@@ -66,9 +153,18 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASHSIZE]; /* loaded vnodes */
+	unsigned sfs_nvnodes;		/* number of loaded vnodes */
+	unsigned sfs_vngen;		/* bumped when a vnode is removed */
+	struct sfs_vnode *sfs_inacthead; /* inactive vnodes, oldest first */
+	struct sfs_vnode *sfs_inacttail;
+	unsigned sfs_ninactive;		/* number of inactive vnodes */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
+	struct bitmap *sfs_resmap;	/* reserved blocks are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct lock *sfs_vnlock;	/* protects the vnode table */
+	struct lock *sfs_freemaplock;	/* protects sfs_{free,res}map(dirty) */
+	struct lock *sfs_superlock;	/* protects sfs_sb, sfs_superdirty */
 };
 
 /*
@@ -76,5 +172,12 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Set up the buffer cache (shared by all sfs volumes), and print
+ * its statistics.
+ */
+void sfs_bootstrap(void);
+void sfs_buf_printstats(void);
+
 
 #endif /* _SFS_H_ */
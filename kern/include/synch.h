@@ -71,13 +71,22 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks are adaptive: if the holder is running on another CPU, a
+ * thread that wants the lock spins for a little while in the hope
+ * that it'll be released soon, and only goes to sleep if it isn't.
+ * lk_spinwins counts acquires that waited only by spinning;
+ * lk_blocks counts ones that had to sleep.
  */
 struct lock {
         char *lk_name;
         HANGMAN_LOCKABLE(lk_hangman);   /* Deadlock detector hook. */
+        LOCKPROF(lk_prof);              /* Contention profiler hook. */
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
         struct thread *volatile lk_holder;
+        unsigned lk_spinwins;           /* Protected by lk_lock. */
+        unsigned lk_blocks;             /* Protected by lk_lock. */
 };
 
 struct lock *lock_create(const char *name);
@@ -140,4 +149,69 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * What happens when readers and writers are both waiting is chosen
+ * when the lock is created:
+ *
+ *    RWLOCK_READERPREF - readers wait only for a writer that actually
+ *                        holds the lock. Writers can starve.
+ *    RWLOCK_WRITERPREF - once a writer is waiting, new readers wait
+ *                        too. Readers can starve.
+ *    RWLOCK_FAIR       - like WRITERPREF, except that when a writer
+ *                        releases the lock, every reader waiting at
+ *                        that point gets in before the next writer.
+ *
+ * For the deadlock detector, the lock looks like an ordinary lock
+ * held by the writer, if any. Threads waiting to read or write are
+ * checked against the writer; readers holding the lock are not
+ * tracked, so a writer waiting on a reader can't be diagnosed.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+
+#define RWLOCK_READERPREF	0
+#define RWLOCK_WRITERPREF	1
+#define RWLOCK_FAIR		2
+
+struct rwlock {
+        char *rwlk_name;
+        HANGMAN_LOCKABLE(rwlk_hangman); /* Deadlock detector hook. */
+        struct wchan *rwlk_rwchan;      /* Readers wait here. */
+        struct wchan *rwlk_wwchan;      /* Writers wait here. */
+        struct spinlock rwlk_lock;      /* Protects the rest. */
+        int rwlk_policy;                /* RWLOCK_* */
+        unsigned rwlk_readers;          /* Readers holding the lock. */
+        struct thread *rwlk_writer;     /* Writer holding it, or NULL. */
+        unsigned rwlk_rwaiting;         /* Readers waiting. */
+        unsigned rwlk_wwaiting;         /* Writers waiting. */
+        unsigned rwlk_readpass;         /* Readers to let in (FAIR). */
+};
+
+struct rwlock *rwlock_create(const char *name, int policy);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading, shared with other
+ *                           readers.
+ *    rwlock_release_read  - Free a read hold.
+ *    rwlock_acquire_write - Get the lock for writing, exclusively.
+ *    rwlock_release_write - Free the write hold. Only the thread
+ *                           holding it may do this.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ *
+ * A thread must not acquire a rwlock it already holds in either mode.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -58,6 +58,11 @@ int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
 
+/* scheduler tests */
+int schedpong(int, char **);
+int stealtest(int, char **);
+int clocktest(int, char **);
+
 /* semaphore unit tests */
 int semu1(int, char **);
 int semu2(int, char **);
@@ -85,6 +85,18 @@ struct thread {
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduler state. Protected by the runqueue lock of t_cpu.
+	 *
+	 * t_priority is the thread's run queue level (0 is highest);
+	 * t_ticks is the number of hardclocks it has used since it
+	 * last changed level. t_lastran is a cache-affinity hint for
+	 * the work stealing code.
+	 */
+	unsigned t_priority;		/* Scheduler priority level */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_lastran;		/* t_cpu's c_hardclocks when last run */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -158,16 +170,22 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for one hardclock. Returns true if it
+ * should yield the processor. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * If threads are waiting on the current cpu, wake idle cpus so they
+ * can steal them. Called from the timer interrupt.
  */
-void thread_consider_migration(void);
+void thread_kick_waiting(void);
 
 
 #endif /* _THREAD_H_ */
@@ -114,6 +114,23 @@ int vfs_rename(char *oldpath, char *newpath);
 int vfs_chdir(char *path);
 int vfs_getcwd(struct uio *buf);
 
+/*
+ * Name cache (see vfscache.c).
+ *
+ *    vfs_namecache_lookup - Like VOP_LOOKUP, but remembers the answer
+ *                     for single pathname components.
+ *    vfs_namecache_remove - Forget NAME in DIR. Call after anything
+ *                     that creates or removes a name.
+ *    vfs_namecache_purge  - Forget everything on volume FS.
+ *    vfs_namecache_printstats - Print hit-rate counters.
+ */
+
+int vfs_namecache_lookup(struct vnode *dir, char *name, struct vnode **ret);
+void vfs_namecache_remove(struct vnode *dir, const char *name);
+void vfs_namecache_purge(struct fs *fs);
+void vfs_namecache_printstats(void);
+void vfs_namecache_bootstrap(void);
+
 /*
  * Misc
  *
@@ -194,7 +211,9 @@ DECLARRAY(vnode, VFSINLINE);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
+ * Global one-big-lock for the VFS layer (the mount table, bootfs) and
+ * for filesystems that don't do their own locking (emufs). SFS has
+ * its own, finer-grained locks; see sfs.h.
  */
 void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
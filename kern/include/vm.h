@@ -69,6 +69,9 @@ int vm_init_first_level(paddr_t ***pagetable);
 int vm_init_second_level(paddr_t ***pagetable, uint32_t msb);
 int vm_init_third_level(paddr_t ***pagetable, uint32_t msb, uint32_t ssb);
 
+/* map an already allocated kernel page into the page table */
+int vm_insertPTE(paddr_t ***pagetable, vaddr_t vaddr, vaddr_t kpage, uint32_t dirty);
+
 /* copy page table into new address */
 int vm_copyPTE(paddr_t ***old_pt, paddr_t ***new_pt);
 int vm_init_copy_second_level(paddr_t ***new_pt, int msb);
@@ -76,5 +76,16 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Move one thread, or all threads, sleeping on FROM so they're
+ * sleeping on TO instead, without waking them. Both associated
+ * spinlocks should be locked. A moved thread still reacquires its
+ * original spinlock when it eventually wakes up.
+ */
+void wchan_transferone(struct wchan *from, struct spinlock *fromlk,
+		       struct wchan *to, struct spinlock *tolk);
+void wchan_transferall(struct wchan *from, struct spinlock *fromlk,
+		       struct wchan *to, struct spinlock *tolk);
+
 
 #endif /* _WCHAN_H_ */
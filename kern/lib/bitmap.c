@@ -47,9 +47,20 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * To make searching a mostly-full bitmap fast, words are grouped, and
+ * each group has a summary flag that, when set, means every bit in
+ * the group is set; searches skip such groups without looking inside.
+ * A flag is set when a search finds its group full, and cleared
+ * whenever a bit in the group is cleared. (So a full group's flag may
+ * be clear; that only costs a little time.)
+ */
+#define WORDS_PER_GROUP 32
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
+        unsigned char *full;    /* per group: known to be full */
 };
 
 
@@ -69,8 +80,15 @@ bitmap_create(unsigned nbits)
                 kfree(b);
                 return NULL;
         }
+        b->full = kmalloc(DIVROUNDUP(words, WORDS_PER_GROUP));
+        if (b->full == NULL) {
+                kfree(b->v);
+                kfree(b);
+                return NULL;
+        }
 
         bzero(b->v, words*sizeof(WORD_TYPE));
+        bzero(b->full, DIVROUNDUP(words, WORDS_PER_GROUP));
         b->nbits = nbits;
 
         /* Mark any leftover bits at the end in use */
@@ -95,31 +113,130 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Find the lowest clear bit in a word that has one.
+ */
+static
+inline
+unsigned
+bitmap_ffz(WORD_TYPE w)
+{
+        WORD_TYPE m = ~w;
+        unsigned bit = 0;
+
+        KASSERT(m != 0);
+        if ((m & 0x0f) == 0) {
+                m >>= 4;
+                bit += 4;
+        }
+        if ((m & 0x03) == 0) {
+                m >>= 2;
+                bit += 2;
+        }
+        if ((m & 0x01) == 0) {
+                bit += 1;
+        }
+        return bit;
+}
+
+/*
+ * Set the summary flag for GROUP if every bit in it is set.
+ */
+static
+void
+bitmap_checkfull(struct bitmap *b, unsigned group)
+{
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned ix, end;
+
+        end = (group+1) * WORDS_PER_GROUP;
+        if (end > maxix) {
+                end = maxix;
+        }
+        for (ix = group * WORDS_PER_GROUP; ix < end; ix++) {
+                if (b->v[ix] != WORD_ALLBITS) {
+                        return;
+                }
+        }
+        b->full[group] = 1;
+}
+
+/*
+ * Set bit BIT of word IX and return its index.
+ */
+static
+inline
+unsigned
+bitmap_take(struct bitmap *b, unsigned ix, unsigned bit)
+{
+        KASSERT((b->v[ix] & ((WORD_TYPE)1 << bit)) == 0);
+        b->v[ix] |= ((WORD_TYPE)1 << bit);
+        KASSERT(ix*BITS_PER_WORD + bit < b->nbits);
+        return ix*BITS_PER_WORD + bit;
+}
+
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
 {
-        unsigned ix;
         unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned ix, n, group, skip;
+        WORD_TYPE w;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+
+        /* First, the goal's own word, from the goal up */
+        ix = goal / BITS_PER_WORD;
+        w = b->v[ix] | (((WORD_TYPE)1 << (goal % BITS_PER_WORD)) - 1);
+        if (w != WORD_ALLBITS) {
+                *index = bitmap_take(b, ix, bitmap_ffz(w));
+                return 0;
+        }
+
+        /*
+         * Then every word after it, wrapping around at the end, and
+         * ending with the goal's word again for the bits before the
+         * goal. Skip groups that are known to be full.
+         */
+        for (n = 0; n < maxix; n++) {
+                ix++;
+                if (ix == maxix) {
+                        ix = 0;
+                }
+                group = ix / WORDS_PER_GROUP;
+                if (ix % WORDS_PER_GROUP == 0 && b->full[group]) {
+                        /* Whole group's full; go to its last word */
+                        skip = WORDS_PER_GROUP - 1;
+                        if (skip > maxix - 1 - ix) {
+                                skip = maxix - 1 - ix;
+                        }
+                        if (skip > maxix - 1 - n) {
+                                skip = maxix - 1 - n;
                         }
-                        KASSERT(0);
+                        ix += skip;
+                        n += skip;
+                        continue;
+                }
+                if (b->v[ix] != WORD_ALLBITS) {
+                        *index = bitmap_take(b, ix, bitmap_ffz(b->v[ix]));
+                        return 0;
+                }
+                if (ix % WORDS_PER_GROUP == WORDS_PER_GROUP - 1 ||
+                    ix == maxix - 1) {
+                        /* End of a group; see if all of it is full */
+                        bitmap_checkfull(b, group);
                 }
         }
         return ENOSPC;
 }
 
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        return bitmap_alloc_near(b, 0, index);
+}
+
 static
 inline
 void
@@ -155,6 +272,7 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        b->full[ix / WORDS_PER_GROUP] = 0;
 }
 
 
@@ -171,6 +289,7 @@ bitmap_isset(struct bitmap *b, unsigned index)
 void
 bitmap_destroy(struct bitmap *b)
 {
+        kfree(b->full);
         kfree(b->v);
         kfree(b);
 }
@@ -47,6 +47,7 @@
 #include <vfs.h>
 #include <device.h>
 #include <pid.h>
+#include <aio.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -129,7 +130,7 @@ boot(void)
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	kprintf_bootstrap();
-	exec_bootstrap();
+	aio_bootstrap();
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -41,12 +41,15 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <diskq.h>
 #include <sfs.h>
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <lockprof.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockprof.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -500,6 +503,72 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_diskqstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	diskq_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_namecachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_namecache_printstats();
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_buf_printstats();
+
+	return 0;
+}
+#endif
+
+#if OPT_LOCKPROF
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	unsigned count = 20;
+	bool reset = false;
+	int i;
+
+	for (i=1; i<nargs; i++) {
+		if (!strcmp(args[i], "reset")) {
+			reset = true;
+		}
+		else {
+			count = atoi(args[i]);
+		}
+	}
+	if (count == 0) {
+		kprintf("Usage: lockprof [count] [reset]\n");
+		return EINVAL;
+	}
+
+	lockprof_dump(count, reset);
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -569,6 +638,9 @@ static const char *testmenu[] = {
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[sch1] Scheduler latency test       ",
+	"[sch2] Load balancing test          ",
+	"[clk1] Timer test                   ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -606,6 +678,14 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[dq] Disk queue stats               ",
+	"[nc] Name cache stats               ",
+#if OPT_SFS
+	"[bc] Buffer cache stats             ",
+#endif
+#if OPT_LOCKPROF
+	"[lockprof] Lock contention stats    ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +737,14 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "dq",		cmd_diskqstats },
+	{ "nc",		cmd_namecachestats },
+#if OPT_SFS
+	{ "bc",		cmd_bufstats },
+#endif
+#if OPT_LOCKPROF
+	{ "lockprof",	cmd_lockprof },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -673,6 +761,9 @@ static struct {
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "sch1",	schedpong },
+	{ "sch2",	stealtest },
+	{ "clk1",	clocktest },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <array.h>
 #include <clock.h>
+#include <membar.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
@@ -47,30 +48,59 @@
 /*
  * Structure for holding exit data of a thread.
  *
+ * There is one of these per pid that has ever been handed out; once
+ * created it stays bound to that pid and is never freed, only marked
+ * not in use (pi_inuse) and put on the free list for reuse. This is
+ * what lets pi_get look things up without the lock: whatever it
+ * finds is always a valid pidinfo for the pid it asked about, though
+ * unless the caller holds pidlock it may be stale by the time it's
+ * looked at.
+ *
  * If pi_ppid is INVALID_PID, the parent has gone away and will not be
  * waiting. If pi_ppid is INVALID_PID and pi_exited is true, the
- * structure can be freed.
+ * structure can be released.
  */
 struct pidinfo {
 	pid_t pi_pid;			// process id of this thread
-	pid_t pi_ppid;			// process id of parent thread
+	volatile pid_t pi_ppid;		// process id of parent thread
+	volatile bool pi_inuse;		// true if pi_pid is allocated
 	volatile bool pi_exited;	// true if thread has exited
 	int pi_exitstatus;		// status (only valid if exited)
 	struct cv *pi_cv;		// use to wait for thread exit
+	struct pidinfo *pi_children;	// our children
+	struct pidinfo *pi_sibnext;	// parent's list of children
+	struct pidinfo **pi_sibprevp;
+	struct pidinfo *pi_nextfree;	// free list
 };
 
 
 /*
  * Global pid and exit data.
  *
- * The process table is an el-cheapo hash table. It's indexed by
- * (pid % PROCS_MAX), and only allows one process per slot. If a
- * new pid allocation would cause a hash collision, we just don't
- * use that pid.
+ * The process table is a two-level radix table indexed by pid. The
+ * leaves are allocated as pids in their range are first handed out,
+ * so the table grows with the number of processes instead of being
+ * sized in advance; the only hard limit is PID_MAX. Neither leaves
+ * nor pidinfos are ever freed.
+ *
+ * Released pids go on a FIFO free list. pid_alloc takes from it in
+ * O(1), but only once it has PID_REUSE_DELAY entries; until then it
+ * hands out never-used pids (also O(1)), so an exited pid isn't
+ * reused right away.
+ *
+ * Changes are made under pidlock; pi_get doesn't need it.
  */
+#define PID_LEAFSHIFT	8
+#define PID_LEAFSIZE	(1 << PID_LEAFSHIFT)
+#define PID_NLEAVES	((PID_MAX >> PID_LEAFSHIFT) + 1)
+#define PID_REUSE_DELAY	32
+
 static struct lock *pidlock;		// lock for global exit data
-static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
-static pid_t nextpid;			// next candidate pid
+static struct pidinfo **pidtable[PID_NLEAVES]; // actual pid info
+static pid_t nextpid;			// lowest never-used pid
+static struct pidinfo *freehead;	// released pids, oldest first
+static struct pidinfo **freetailp;	// end of free list
+static unsigned nfree;			// length of free list
 static int nprocs;			// number of allocated pids
 
 
@@ -80,7 +110,7 @@ static int nprocs;			// number of allocated pids
  */
 static
 struct pidinfo *
-pidinfo_create(pid_t pid, pid_t ppid)
+pidinfo_create(pid_t pid)
 {
 	struct pidinfo *pi;
 
@@ -98,132 +128,170 @@ pidinfo_create(pid_t pid, pid_t ppid)
 	}
 
 	pi->pi_pid = pid;
-	pi->pi_ppid = ppid;
+	pi->pi_ppid = INVALID_PID;
+	pi->pi_inuse = false;
 	pi->pi_exited = false;
 	pi->pi_exitstatus = 0xbeef;  /* Recognizably invalid value */
+	pi->pi_children = NULL;
+	pi->pi_sibnext = NULL;
+	pi->pi_sibprevp = NULL;
+	pi->pi_nextfree = NULL;
 
 	return pi;
 }
 
-/*
- * Clean up a pidinfo structure.
- */
-static
-void
-pidinfo_destroy(struct pidinfo *pi)
-{
-	KASSERT(pi->pi_exited == true);
-	KASSERT(pi->pi_ppid == INVALID_PID);
-	cv_destroy(pi->pi_cv);
-	kfree(pi);
-}
-
 ////////////////////////////////////////////////////////////
 
 /*
- * pid_bootstrap: initialize.
- */
-void
-pid_bootstrap(void)
-{
-	int i;
-
-	pidlock = lock_create("pidlock");
-	if (pidlock == NULL) {
-		panic("Out of memory creating pid lock\n");
-	}
-
-	/* not really necessary - should start zeroed */
-	for (i=0; i<PROCS_MAX; i++) {
-		pidinfo[i] = NULL;
-	}
-
-	pidinfo[KERNEL_PID] = pidinfo_create(KERNEL_PID, INVALID_PID);
-	if (pidinfo[KERNEL_PID]==NULL) {
-		panic("Out of memory creating kernel pid data\n");
-	}
-
-	nextpid = PID_MIN;
-	nprocs = 1;
-}
-
-/*
- * pi_get: look up a pidinfo in the process table.
+ * pi_get: look up a pidinfo in the process table. Returns NULL if the
+ * pid isn't currently allocated. Safe to call without pidlock; see
+ * above.
  */
 static
 struct pidinfo *
 pi_get(pid_t pid)
 {
+	struct pidinfo **leaf;
 	struct pidinfo *pi;
 
 	KASSERT(pid>=0);
 	KASSERT(pid != INVALID_PID);
-	KASSERT(lock_do_i_hold(pidlock));
 
-	pi = pidinfo[pid % PROCS_MAX];
-	if (pi==NULL) {
+	if (pid > PID_MAX) {
 		return NULL;
 	}
-	if (pi->pi_pid != pid) {
+	leaf = pidtable[pid >> PID_LEAFSHIFT];
+	if (leaf == NULL) {
+		return NULL;
+	}
+	membar_load_load();
+	pi = leaf[pid & (PID_LEAFSIZE - 1)];
+	if (pi == NULL) {
+		return NULL;
+	}
+	membar_load_load();
+	KASSERT(pi->pi_pid == pid);
+	if (!pi->pi_inuse) {
 		return NULL;
 	}
 	return pi;
 }
 
 /*
- * pi_put: insert a new pidinfo in the process table. The right slot
- * must be empty.
+ * pi_install: make a new pidinfo findable. Its slot must be empty.
  */
 static
-void
-pi_put(pid_t pid, struct pidinfo *pi)
+int
+pi_install(struct pidinfo *pi)
 {
+	struct pidinfo **leaf;
+	unsigned i;
+	pid_t pid = pi->pi_pid;
+
 	KASSERT(lock_do_i_hold(pidlock));
+	KASSERT(pid != INVALID_PID && pid <= PID_MAX);
 
-	KASSERT(pid != INVALID_PID);
+	leaf = pidtable[pid >> PID_LEAFSHIFT];
+	if (leaf == NULL) {
+		leaf = kmalloc(PID_LEAFSIZE * sizeof(leaf[0]));
+		if (leaf == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<PID_LEAFSIZE; i++) {
+			leaf[i] = NULL;
+		}
+		/* Finish the leaf before anyone can see it. */
+		membar_store_store();
+		pidtable[pid >> PID_LEAFSHIFT] = leaf;
+	}
 
-	KASSERT(pidinfo[pid % PROCS_MAX] == NULL);
-	pidinfo[pid % PROCS_MAX] = pi;
-	nprocs++;
+	KASSERT(leaf[pid & (PID_LEAFSIZE - 1)] == NULL);
+	membar_store_store();
+	leaf[pid & (PID_LEAFSIZE - 1)] = pi;
+	return 0;
 }
 
 /*
- * pi_drop: remove a pidinfo structure from the process table and free
- * it. It should reflect a process that has already exited and been
- * waited for.
+ * pi_orphan: detach a pidinfo from its parent.
  */
 static
 void
-pi_drop(pid_t pid)
+pi_orphan(struct pidinfo *pi)
 {
-	struct pidinfo *pi;
+	KASSERT(lock_do_i_hold(pidlock));
+	KASSERT(pi->pi_ppid != INVALID_PID);
+
+	*pi->pi_sibprevp = pi->pi_sibnext;
+	if (pi->pi_sibnext != NULL) {
+		pi->pi_sibnext->pi_sibprevp = pi->pi_sibprevp;
+	}
+	pi->pi_sibnext = NULL;
+	pi->pi_sibprevp = NULL;
+	pi->pi_ppid = INVALID_PID;
+}
 
+/*
+ * pi_drop: release a pidinfo, putting its pid on the free list. It
+ * should reflect a process that has already exited and been waited
+ * for (or disowned).
+ */
+static
+void
+pi_drop(struct pidinfo *pi)
+{
 	KASSERT(lock_do_i_hold(pidlock));
+	KASSERT(pi->pi_inuse);
+	KASSERT(pi->pi_exited == true);
+	KASSERT(pi->pi_ppid == INVALID_PID);
+	KASSERT(pi->pi_children == NULL);
 
-	pi = pidinfo[pid % PROCS_MAX];
-	KASSERT(pi != NULL);
-	KASSERT(pi->pi_pid == pid);
+	pi->pi_inuse = false;
 
-	pidinfo_destroy(pi);
-	pidinfo[pid % PROCS_MAX] = NULL;
+	pi->pi_nextfree = NULL;
+	*freetailp = pi;
+	freetailp = &pi->pi_nextfree;
+	nfree++;
 	nprocs--;
 }
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Helper function for pid_alloc.
+ * pid_bootstrap: initialize.
  */
-static
 void
-inc_nextpid(void)
+pid_bootstrap(void)
 {
-	KASSERT(lock_do_i_hold(pidlock));
+	struct pidinfo *pi;
+	int i;
+
+	pidlock = lock_create("pidlock");
+	if (pidlock == NULL) {
+		panic("Out of memory creating pid lock\n");
+	}
 
-	nextpid++;
-	if (nextpid > PID_MAX) {
-		nextpid = PID_MIN;
+	/* not really necessary - should start zeroed */
+	for (i=0; i<PID_NLEAVES; i++) {
+		pidtable[i] = NULL;
+	}
+	freehead = NULL;
+	freetailp = &freehead;
+	nfree = 0;
+
+	pi = pidinfo_create(KERNEL_PID);
+	if (pi == NULL) {
+		panic("Out of memory creating kernel pid data\n");
+	}
+	pi->pi_inuse = true;
+
+	lock_acquire(pidlock);
+	if (pi_install(pi)) {
+		panic("Out of memory creating kernel pid data\n");
 	}
+	lock_release(pidlock);
+
+	nextpid = PID_MIN;
+	nprocs = 1;
 }
 
 /*
@@ -232,50 +300,69 @@ inc_nextpid(void)
 int
 pid_alloc(pid_t *retval)
 {
-	struct pidinfo *pi;
-	pid_t pid;
-	int count;
+	struct pidinfo *pi, *parent;
+	int result;
 
 	KASSERT(curproc->p_pid != INVALID_PID);
 
 	/* lock the table */
 	lock_acquire(pidlock);
 
-	if (nprocs == PROCS_MAX) {
+	if (freehead != NULL &&
+	    (nfree >= PID_REUSE_DELAY || nextpid > PID_MAX)) {
+		/* Recycle the pid that's been free the longest. */
+		pi = freehead;
+		freehead = pi->pi_nextfree;
+		if (freehead == NULL) {
+			freetailp = &freehead;
+		}
+		nfree--;
+		pi->pi_nextfree = NULL;
+	}
+	else if (nextpid <= PID_MAX) {
+		/* Use a fresh one. */
+		pi = pidinfo_create(nextpid);
+		if (pi == NULL) {
+			lock_release(pidlock);
+			return ENOMEM;
+		}
+		result = pi_install(pi);
+		if (result) {
+			cv_destroy(pi->pi_cv);
+			kfree(pi);
+			lock_release(pidlock);
+			return result;
+		}
+		nextpid++;
+	}
+	else {
 		lock_release(pidlock);
 		return EAGAIN;
 	}
 
-	/*
-	 * The above test guarantees that this loop terminates, unless
-	 * our nprocs count is off. Even so, assert we aren't looping
-	 * forever.
-	 */
-	count = 0;
-	while (pidinfo[nextpid % PROCS_MAX] != NULL) {
-
-		/* avoid various boundary cases by allowing extra loops */
-		KASSERT(count < PROCS_MAX*2+5);
-		count++;
+	parent = pi_get(curproc->p_pid);
+	KASSERT(parent != NULL);
 
-		inc_nextpid();
-	}
-
-	pid = nextpid;
+	pi->pi_ppid = curproc->p_pid;
+	pi->pi_exited = false;
+	pi->pi_exitstatus = 0xbeef;  /* Recognizably invalid value */
+	KASSERT(pi->pi_children == NULL);
 
-	pi = pidinfo_create(pid, curproc->p_pid);
-	if (pi==NULL) {
-		lock_release(pidlock);
-		return ENOMEM;
+	pi->pi_sibnext = parent->pi_children;
+	pi->pi_sibprevp = &parent->pi_children;
+	if (parent->pi_children != NULL) {
+		parent->pi_children->pi_sibprevp = &pi->pi_sibnext;
 	}
+	parent->pi_children = pi;
 
-	pi_put(pid, pi);
-
-	inc_nextpid();
+	/* Set everything up before it becomes visible to pi_get. */
+	membar_store_store();
+	pi->pi_inuse = true;
+	nprocs++;
 
 	lock_release(pidlock);
 
-	*retval = pid;
+	*retval = pi->pi_pid;
 	return 0;
 }
 
@@ -297,12 +384,12 @@ pid_unalloc(pid_t theirpid)
 	KASSERT(them->pi_exited == false);
 	KASSERT(them->pi_ppid == curproc->p_pid);
 
-	/* keep pidinfo_destroy from complaining */
+	/* keep pi_drop from complaining */
 	them->pi_exitstatus = 0xdead;
 	them->pi_exited = true;
-	them->pi_ppid = INVALID_PID;
+	pi_orphan(them);
 
-	pi_drop(theirpid);
+	pi_drop(them);
 
 	lock_release(pidlock);
 }
@@ -324,9 +411,9 @@ pid_disown(pid_t theirpid)
 	KASSERT(them != NULL);
 	KASSERT(them->pi_ppid==curproc->p_pid);
 
-	them->pi_ppid = INVALID_PID;
+	pi_orphan(them);
 	if (them->pi_exited) {
-		pi_drop(them->pi_pid);
+		pi_drop(them);
 	}
 
 	lock_release(pidlock);
@@ -343,35 +430,30 @@ pid_disown(pid_t theirpid)
 void
 pid_setexitstatus(int status)
 {
-	struct pidinfo *us;
-	int i;
+	struct pidinfo *us, *child;
 
 	lock_acquire(pidlock);
 	KASSERT(curproc->p_pid != INVALID_PID);
 
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
+
 	/* First, disown all children */
-	for (i=0; i<PROCS_MAX; i++) {
-		if (pidinfo[i]==NULL) {
-			continue;
-		}
-		if (pidinfo[i]->pi_ppid == curproc->p_pid) {
-			pidinfo[i]->pi_ppid = INVALID_PID;
-			if (pidinfo[i]->pi_exited) {
-				pi_drop(pidinfo[i]->pi_pid);
-			}
+	while ((child = us->pi_children) != NULL) {
+		KASSERT(child->pi_ppid == curproc->p_pid);
+		pi_orphan(child);
+		if (child->pi_exited) {
+			pi_drop(child);
 		}
 	}
 
 	/* Now, wake up our parent */
-	us = pi_get(curproc->p_pid);
-	KASSERT(us != NULL);
-
 	us->pi_exitstatus = status;
 	us->pi_exited = true;
 
 	if (us->pi_ppid == INVALID_PID) {
 		/* no parent */
-		pi_drop(curproc->p_pid);
+		pi_drop(us);
 	}
 	else {
 		cv_broadcast(us->pi_cv, pidlock);
@@ -415,32 +497,35 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 		return EINVAL;
 	}
 
-	lock_acquire(pidlock);
-
+	/*
+	 * Check without the lock. Only we can release or disown our
+	 * own children, and nobody else can make a process our child,
+	 * so if this says it's our child it stays that way, and if it
+	 * says it isn't, that was true at some point during the call.
+	 */
 	them = pi_get(theirpid);
 	if (them==NULL) {
-		lock_release(pidlock);
 		return ESRCH;
 	}
 
-	KASSERT(them->pi_pid==theirpid);
-
 	/* Only allow waiting for own children. */
 	if (them->pi_ppid != curproc->p_pid) {
-		lock_release(pidlock);
 		return EPERM;
 	}
 
-	if (them->pi_exited == false) {
-		if (flags == WNOHANG) {
-			lock_release(pidlock);
-			KASSERT(ret != NULL);
-			*ret = 0;
-			return 0;
-		}
-		/* don't need to loop on this */
+	if (them->pi_exited == false && flags == WNOHANG) {
+		KASSERT(ret != NULL);
+		*ret = 0;
+		return 0;
+	}
+
+	lock_acquire(pidlock);
+
+	KASSERT(them->pi_pid==theirpid);
+	KASSERT(them->pi_ppid == curproc->p_pid);
+
+	while (them->pi_exited == false) {
 		cv_wait(them->pi_cv, pidlock);
-		KASSERT(them->pi_exited == true);
 	}
 
 	if (status != NULL) {
@@ -457,8 +542,8 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 		*ret = theirpid;
 	}
 
-	them->pi_ppid = 0;
-	pi_drop(them->pi_pid);
+	pi_orphan(them);
+	pi_drop(them);
 
 	lock_release(pidlock);
 	return 0;
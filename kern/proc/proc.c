@@ -52,6 +52,7 @@
 #include <vnode.h>
 #include <pid.h>
 #include <filetable.h>
+#include <aio.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -94,6 +95,7 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 	proc->p_filetable = NULL;
+	proc->p_aio = NULL;
 
 	return proc;
 }
@@ -125,6 +127,10 @@ proc_destroy(struct proc *proc)
 	 */
 
 	/* VFS fields */
+	if (proc->p_aio) {
+		aio_destroy(proc->p_aio);
+		proc->p_aio = NULL;
+	}
 	if (proc->p_cwd) {
 		VOP_DECREF(proc->p_cwd);
 		proc->p_cwd = NULL;
@@ -255,15 +261,14 @@ proc_create_runprogram(const char *name, struct proc **ret)
 /*
  * Clone the current process.
  *
- * The new thread is given a copy of the caller's file handles if RET
- * is not null. (If RET is null, what we're creating is a kernel-only
- * thread and it doesn't need an address space or file handles.)
- * However, the new thread always inherits its current working
- * directory from the caller. The new thread is given no address space
- * (the caller decides that).
+ * The new process gets a copy of the caller's file handles, if it has
+ * any, and always inherits its current working directory. If COPYVM
+ * is set it also gets a copy of the caller's address space; otherwise
+ * it is given no address space (the caller decides that).
  */
+static
 int
-proc_fork(struct proc **ret)
+proc_clone(bool copyvm, struct proc **ret)
 {
 	struct proc *newproc;
 	struct addrspace *as;
@@ -292,7 +297,7 @@ proc_fork(struct proc **ret)
 #endif
 
 	/* VM fields */
-	as = proc_getas();
+	as = copyvm ? proc_getas() : NULL;
 	if (as != NULL) {
 		result = as_copy(as, &newproc->p_addrspace);
 		if (result) {
@@ -334,7 +339,26 @@ proc_fork(struct proc **ret)
 }
 
 /*
- * Undo proc_fork if nothing's run in the new process yet.
+ * Create a new process for fork(): a copy of the current one.
+ */
+int
+proc_fork(struct proc **ret)
+{
+	return proc_clone(true, ret);
+}
+
+/*
+ * Create a new process for spawn(): like proc_fork, but without
+ * copying the address space, which is about to be replaced anyway.
+ */
+int
+proc_spawn(struct proc **ret)
+{
+	return proc_clone(false, ret);
+}
+
+/*
+ * Undo proc_fork (or proc_spawn) if nothing's run in the new process yet.
  */
 void
 proc_unfork(struct proc *newproc)
@@ -355,6 +379,15 @@ proc_exit(int status)
 	/* The kernel isn't supposed to exit. */
 	KASSERT(proc != kproc);
 
+	/*
+	 * Wait for any async I/O still running, so that once waitpid
+	 * returns in the parent, all our writes are done.
+	 */
+	if (proc->p_aio != NULL) {
+		aio_destroy(proc->p_aio);
+		proc->p_aio = NULL;
+	}
+
 	/* Set exit status and wake up anyone waiting for us. */
 	pid_setexitstatus(status);
 
@@ -0,0 +1,655 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Asynchronous I/O: aio_setup() and aio_enter(), and the worker
+ * threads that do the I/O for them.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/aio.h>
+#include <lib.h>
+#include <uio.h>
+#include <proc.h>
+#include <current.h>
+#include <thread.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <aio.h>
+#include <syscall.h>
+
+/*
+ * Number of worker threads. This is how many operations can be
+ * actually running at once, across all processes; anything beyond
+ * that waits in the queue.
+ */
+#define AIO_NWORKERS	4
+
+/*
+ * One operation.
+ *
+ * The data goes through a kernel buffer: writes are copied in when
+ * they're submitted, and reads are copied out when the completion is
+ * posted, both in the process's own context. That way the workers
+ * never touch user memory and don't need the process's address space.
+ */
+struct aiojob {
+	struct aiojob *aj_next;		/* on the work queue or done list */
+	struct aioctx *aj_ctx;		/* who it belongs to */
+	struct openfile *aj_file;	/* NULL if it failed up front */
+	int aj_op;			/* AIO_OP_* */
+	off_t aj_offset;		/* file position */
+	userptr_t aj_ubuf;		/* user's buffer */
+	size_t aj_len;			/* transfer size */
+	void *aj_kbuf;			/* kernel buffer */
+	uint32_t aj_tag;		/* from the submission entry */
+	int aj_result;			/* byte count or -errno */
+};
+
+/*
+ * Per-process state.
+ *
+ * The kernel keeps its own copies of the ring indexes it owns
+ * (ac_sqhead and ac_cqtail) and only ever writes them to the ring, so
+ * the process scribbling on the ring can't confuse it.
+ */
+struct aioctx {
+	struct lock *ac_lock;		/* protects everything here */
+	struct cv *ac_cv;		/* signalled when a job finishes */
+	userptr_t ac_ring;		/* the ring in user memory */
+	unsigned ac_nentries;		/* ring size (power of 2) */
+	unsigned ac_sqhead;		/* next submission to consume */
+	unsigned ac_cqtail;		/* next completion slot to fill */
+	unsigned ac_inflight;		/* jobs queued or running */
+	unsigned ac_ndone;		/* jobs on the done list */
+	struct aiojob *ac_done;		/* finished, not yet posted */
+	struct aiojob **ac_donetail;
+};
+
+/*
+ * The work queue, shared by all processes.
+ */
+static struct lock *aio_qlock;
+static struct cv *aio_qcv;
+static struct aiojob *aio_qhead;
+static struct aiojob **aio_qtail = &aio_qhead;
+
+/* Addresses of things in the user's ring. */
+#define RING_FIELD(ctx, f) \
+	((userptr_t)&((struct aio_ring *)(ctx)->ac_ring)->f)
+#define RING_SQHEAD(ctx) RING_FIELD(ctx, ar_sqhead)
+#define RING_SQTAIL(ctx) RING_FIELD(ctx, ar_sqtail)
+#define RING_CQHEAD(ctx) RING_FIELD(ctx, ar_cqhead)
+#define RING_CQTAIL(ctx) RING_FIELD(ctx, ar_cqtail)
+#define RING_SQE(ctx, i) ((ctx)->ac_ring + sizeof(struct aio_ring) + \
+	((i) & ((ctx)->ac_nentries - 1)) * sizeof(struct aio_sqe))
+#define RING_CQE(ctx, i) ((ctx)->ac_ring + sizeof(struct aio_ring) + \
+	(ctx)->ac_nentries * sizeof(struct aio_sqe) + \
+	((i) & ((ctx)->ac_nentries - 1)) * sizeof(struct aio_cqe))
+
+////////////////////////////////////////////////////////////
+// jobs
+
+/*
+ * Make a job from a submission entry. If the entry is no good, the
+ * job comes back with aj_file NULL and the error in aj_result, ready
+ * to be completed straight away. Returns NULL only if out of memory.
+ */
+static
+struct aiojob *
+aiojob_create(struct aioctx *ctx, const struct aio_sqe *sqe)
+{
+	struct aiojob *job;
+	struct openfile *file;
+	int badaccmode;
+	int result;
+
+	job = kmalloc(sizeof(*job));
+	if (job == NULL) {
+		return NULL;
+	}
+	job->aj_next = NULL;
+	job->aj_ctx = ctx;
+	job->aj_file = NULL;
+	job->aj_op = sqe->sqe_op;
+	job->aj_offset = sqe->sqe_offset;
+	job->aj_ubuf = sqe->sqe_buf;
+	job->aj_len = 0;
+	job->aj_kbuf = NULL;
+	job->aj_tag = sqe->sqe_tag;
+	job->aj_result = 0;
+
+	switch (sqe->sqe_op) {
+	    case AIO_OP_READ:
+		badaccmode = O_WRONLY;
+		break;
+	    case AIO_OP_WRITE:
+		badaccmode = O_RDONLY;
+		break;
+	    case AIO_OP_FSYNC:
+		badaccmode = -1;
+		break;
+	    default:
+		job->aj_result = -EINVAL;
+		return job;
+	}
+
+	if (sqe->sqe_op != AIO_OP_FSYNC) {
+		if (sqe->sqe_len > AIO_MAXIO) {
+			job->aj_result = -EINVAL;
+			return job;
+		}
+		job->aj_len = sqe->sqe_len;
+	}
+
+	result = filetable_get(curproc->p_filetable, sqe->sqe_fd, &file);
+	if (result) {
+		job->aj_result = -result;
+		return job;
+	}
+	if (file->of_accmode == badaccmode) {
+		filetable_put(curproc->p_filetable, sqe->sqe_fd, file);
+		job->aj_result = -EBADF;
+		return job;
+	}
+	/*
+	 * Devices like the console can block indefinitely, which would
+	 * tie up one of the few shared workers and keep the process
+	 * from exiting (aio_destroy waits for everything in flight), so
+	 * only files are allowed.
+	 */
+	if (!VOP_ISSEEKABLE(file->of_vnode)) {
+		filetable_put(curproc->p_filetable, sqe->sqe_fd, file);
+		job->aj_result = -ESPIPE;
+		return job;
+	}
+	if (job->aj_offset < 0) {
+		filetable_put(curproc->p_filetable, sqe->sqe_fd, file);
+		job->aj_result = -EINVAL;
+		return job;
+	}
+
+	/* keep our own reference, as the fd might be closed meanwhile */
+	openfile_incref(file);
+	filetable_put(curproc->p_filetable, sqe->sqe_fd, file);
+
+	if (job->aj_len > 0) {
+		job->aj_kbuf = kmalloc(job->aj_len);
+		if (job->aj_kbuf == NULL) {
+			openfile_decref(file);
+			job->aj_result = -ENOMEM;
+			return job;
+		}
+	}
+	if (job->aj_op == AIO_OP_WRITE && job->aj_len > 0) {
+		result = copyin(job->aj_ubuf, job->aj_kbuf, job->aj_len);
+		if (result) {
+			kfree(job->aj_kbuf);
+			job->aj_kbuf = NULL;
+			openfile_decref(file);
+			job->aj_result = -result;
+			return job;
+		}
+	}
+
+	job->aj_file = file;
+	return job;
+}
+
+/*
+ * Destructor for jobs.
+ */
+static
+void
+aiojob_destroy(struct aiojob *job)
+{
+	if (job->aj_file != NULL) {
+		openfile_decref(job->aj_file);
+	}
+	if (job->aj_kbuf != NULL) {
+		kfree(job->aj_kbuf);
+	}
+	kfree(job);
+}
+
+/*
+ * Put a finished job on its context's done list. Call with ac_lock
+ * held.
+ */
+static
+void
+aiojob_finish(struct aiojob *job)
+{
+	struct aioctx *ctx = job->aj_ctx;
+
+	KASSERT(lock_do_i_hold(ctx->ac_lock));
+
+	job->aj_next = NULL;
+	*ctx->ac_donetail = job;
+	ctx->ac_donetail = &job->aj_next;
+	ctx->ac_ndone++;
+}
+
+////////////////////////////////////////////////////////////
+// workers
+
+/*
+ * Do the I/O for a job.
+ */
+static
+void
+aio_dojob(struct aiojob *job)
+{
+	struct vnode *vn = job->aj_file->of_vnode;
+	struct iovec iov;
+	struct uio kuio;
+	int result;
+
+	switch (job->aj_op) {
+	    case AIO_OP_READ:
+		uio_kinit(&iov, &kuio, job->aj_kbuf, job->aj_len,
+			  job->aj_offset, UIO_READ);
+		result = VOP_READ(vn, &kuio);
+		break;
+	    case AIO_OP_WRITE:
+		uio_kinit(&iov, &kuio, job->aj_kbuf, job->aj_len,
+			  job->aj_offset, UIO_WRITE);
+		result = VOP_WRITE(vn, &kuio);
+		break;
+	    case AIO_OP_FSYNC:
+		result = VOP_FSYNC(vn);
+		job->aj_result = -result;
+		return;
+	    default:
+		panic("aio: invalid op %d\n", job->aj_op);
+	}
+
+	if (result) {
+		job->aj_result = -result;
+	}
+	else {
+		job->aj_result = job->aj_len - kuio.uio_resid;
+	}
+}
+
+/*
+ * Worker thread: take jobs off the queue and do them, forever.
+ */
+static
+void
+aio_worker(void *unused1, unsigned long unused2)
+{
+	struct aiojob *job;
+	struct aioctx *ctx;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		lock_acquire(aio_qlock);
+		while (aio_qhead == NULL) {
+			cv_wait(aio_qcv, aio_qlock);
+		}
+		job = aio_qhead;
+		aio_qhead = job->aj_next;
+		if (aio_qhead == NULL) {
+			aio_qtail = &aio_qhead;
+		}
+		lock_release(aio_qlock);
+
+		aio_dojob(job);
+
+		/* the context can go away as soon as we unlock it */
+		ctx = job->aj_ctx;
+		lock_acquire(ctx->ac_lock);
+		KASSERT(ctx->ac_inflight > 0);
+		ctx->ac_inflight--;
+		aiojob_finish(job);
+		cv_broadcast(ctx->ac_cv, ctx->ac_lock);
+		lock_release(ctx->ac_lock);
+	}
+}
+
+/*
+ * Start the workers.
+ */
+void
+aio_bootstrap(void)
+{
+	char name[32];
+	unsigned i;
+	int result;
+
+	aio_qlock = lock_create("aio queue");
+	if (aio_qlock == NULL) {
+		panic("aio_bootstrap: out of memory\n");
+	}
+	aio_qcv = cv_create("aio queue");
+	if (aio_qcv == NULL) {
+		panic("aio_bootstrap: out of memory\n");
+	}
+
+	for (i=0; i<AIO_NWORKERS; i++) {
+		snprintf(name, sizeof(name), "aio worker %u", i);
+		result = thread_fork(name, kproc, aio_worker, NULL, i);
+		if (result) {
+			panic("aio_bootstrap: thread_fork: %s\n",
+			      strerror(result));
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// contexts
+
+/*
+ * Constructor for struct aioctx.
+ */
+static
+struct aioctx *
+aioctx_create(userptr_t ring, unsigned nentries)
+{
+	struct aioctx *ctx;
+
+	ctx = kmalloc(sizeof(*ctx));
+	if (ctx == NULL) {
+		return NULL;
+	}
+	ctx->ac_lock = lock_create("aio");
+	if (ctx->ac_lock == NULL) {
+		kfree(ctx);
+		return NULL;
+	}
+	ctx->ac_cv = cv_create("aio");
+	if (ctx->ac_cv == NULL) {
+		lock_destroy(ctx->ac_lock);
+		kfree(ctx);
+		return NULL;
+	}
+	ctx->ac_ring = ring;
+	ctx->ac_nentries = nentries;
+	ctx->ac_sqhead = 0;
+	ctx->ac_cqtail = 0;
+	ctx->ac_inflight = 0;
+	ctx->ac_ndone = 0;
+	ctx->ac_done = NULL;
+	ctx->ac_donetail = &ctx->ac_done;
+	return ctx;
+}
+
+/*
+ * Destructor for struct aioctx. Waits for any jobs still running,
+ * and discards any results not yet posted.
+ */
+void
+aio_destroy(struct aioctx *ctx)
+{
+	struct aiojob *job;
+
+	lock_acquire(ctx->ac_lock);
+	while (ctx->ac_inflight > 0) {
+		cv_wait(ctx->ac_cv, ctx->ac_lock);
+	}
+	while (ctx->ac_done != NULL) {
+		job = ctx->ac_done;
+		ctx->ac_done = job->aj_next;
+		aiojob_destroy(job);
+	}
+	lock_release(ctx->ac_lock);
+
+	cv_destroy(ctx->ac_cv);
+	lock_destroy(ctx->ac_lock);
+	kfree(ctx);
+}
+
+/*
+ * Post finished jobs to the completion queue, as many as will fit.
+ * Returns in *AVAIL the number of completions now waiting for the
+ * process in the ring.
+ */
+static
+int
+aio_reap(struct aioctx *ctx, unsigned *avail)
+{
+	struct aiojob *job;
+	struct aio_cqe cqe;
+	unsigned cqhead;
+	int result;
+
+	KASSERT(lock_do_i_hold(ctx->ac_lock));
+
+	result = copyin(RING_CQHEAD(ctx), &cqhead, sizeof(cqhead));
+	if (result) {
+		return result;
+	}
+	if (ctx->ac_cqtail - cqhead > ctx->ac_nentries) {
+		/* the process has trashed the ring */
+		return EINVAL;
+	}
+
+	while (ctx->ac_done != NULL &&
+	       ctx->ac_cqtail - cqhead < ctx->ac_nentries) {
+		job = ctx->ac_done;
+
+		if (job->aj_op == AIO_OP_READ && job->aj_result > 0) {
+			result = copyout(job->aj_kbuf, job->aj_ubuf,
+					 job->aj_result);
+			if (result) {
+				job->aj_result = -result;
+			}
+		}
+
+		cqe.cqe_tag = job->aj_tag;
+		cqe.cqe_result = job->aj_result;
+		result = copyout(&cqe, RING_CQE(ctx, ctx->ac_cqtail),
+				 sizeof(cqe));
+		if (result) {
+			return result;
+		}
+		ctx->ac_cqtail++;
+
+		ctx->ac_done = job->aj_next;
+		if (ctx->ac_done == NULL) {
+			ctx->ac_donetail = &ctx->ac_done;
+		}
+		ctx->ac_ndone--;
+		aiojob_destroy(job);
+	}
+
+	result = copyout(&ctx->ac_cqtail, RING_CQTAIL(ctx),
+			 sizeof(ctx->ac_cqtail));
+	if (result) {
+		return result;
+	}
+
+	*avail = ctx->ac_cqtail - cqhead;
+	return 0;
+}
+
+/*
+ * Consume up to TOSUBMIT entries from the submission queue and start
+ * them. Stops early if the queue is empty or the process already has
+ * as many operations outstanding as the ring can hold.
+ */
+static
+int
+aio_submit(struct aioctx *ctx, unsigned tosubmit, unsigned *submitted)
+{
+	struct aio_sqe sqe;
+	struct aiojob *job;
+	unsigned sqtail, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(ctx->ac_lock));
+
+	result = copyin(RING_SQTAIL(ctx), &sqtail, sizeof(sqtail));
+	if (result) {
+		return result;
+	}
+
+	n = 0;
+	while (n < tosubmit && ctx->ac_sqhead != sqtail &&
+	       ctx->ac_inflight + ctx->ac_ndone < ctx->ac_nentries) {
+		result = copyin(RING_SQE(ctx, ctx->ac_sqhead),
+				&sqe, sizeof(sqe));
+		if (result) {
+			break;
+		}
+		job = aiojob_create(ctx, &sqe);
+		if (job == NULL) {
+			result = ENOMEM;
+			break;
+		}
+		ctx->ac_sqhead++;
+		n++;
+
+		if (job->aj_file == NULL) {
+			/* failed already; it's done */
+			aiojob_finish(job);
+			continue;
+		}
+
+		ctx->ac_inflight++;
+		lock_acquire(aio_qlock);
+		*aio_qtail = job;
+		aio_qtail = &job->aj_next;
+		cv_signal(aio_qcv, aio_qlock);
+		lock_release(aio_qlock);
+	}
+
+	/* an error only counts if we didn't get anything going */
+	if (n > 0) {
+		result = 0;
+	}
+	if (result == 0) {
+		result = copyout(&ctx->ac_sqhead, RING_SQHEAD(ctx),
+				 sizeof(ctx->ac_sqhead));
+	}
+
+	*submitted = n;
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// system calls
+
+/*
+ * aio_setup() - register RING, with NENTRIES entries in each queue,
+ * as the process's async I/O ring.
+ */
+int
+sys_aio_setup(userptr_t ring, unsigned nentries)
+{
+	struct aio_ring zero;
+	struct aioctx *ctx;
+	int result;
+
+	if (curproc->p_aio != NULL) {
+		return EBUSY;
+	}
+	if (nentries == 0 || nentries > AIO_MAXENTRIES ||
+	    (nentries & (nentries - 1)) != 0) {
+		return EINVAL;
+	}
+
+	/* start with empty queues; this also checks the pointer */
+	bzero(&zero, sizeof(zero));
+	result = copyout(&zero, ring, sizeof(zero));
+	if (result) {
+		return result;
+	}
+
+	ctx = aioctx_create(ring, nentries);
+	if (ctx == NULL) {
+		return ENOMEM;
+	}
+	curproc->p_aio = ctx;
+	return 0;
+}
+
+/*
+ * aio_enter() - submit up to TOSUBMIT new operations, then wait until
+ * at least MINWAIT completions are in the ring (or nothing more is
+ * outstanding). Returns the number submitted.
+ */
+int
+sys_aio_enter(unsigned tosubmit, unsigned minwait, int *retval)
+{
+	struct aioctx *ctx;
+	unsigned submitted, avail;
+	int result;
+
+	ctx = curproc->p_aio;
+	if (ctx == NULL) {
+		return EINVAL;
+	}
+	if (minwait > ctx->ac_nentries) {
+		return EINVAL;
+	}
+
+	lock_acquire(ctx->ac_lock);
+
+	/* post what's already done first, to make room */
+	result = aio_reap(ctx, &avail);
+	if (result) {
+		goto out;
+	}
+
+	result = aio_submit(ctx, tosubmit, &submitted);
+	if (result) {
+		goto out;
+	}
+
+	while (1) {
+		result = aio_reap(ctx, &avail);
+		if (result) {
+			goto out;
+		}
+		if (avail >= minwait) {
+			break;
+		}
+		if (ctx->ac_inflight == 0 && ctx->ac_done == NULL) {
+			/* nothing else is coming */
+			break;
+		}
+		if (ctx->ac_done == NULL) {
+			cv_wait(ctx->ac_cv, ctx->ac_lock);
+		}
+	}
+
+	*retval = submitted;
+ out:
+	lock_release(ctx->ac_lock);
+	return result;
+}
@@ -35,6 +35,7 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <kern/limits.h>
+#include <limits.h>
 #include <kern/seek.h>
 #include <kern/stat.h>
 #include <lib.h>
@@ -105,22 +106,44 @@ sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
 }
 
 /*
- * Common logic for read and write.
+ * Largest total transfer for one call; the count returned has to fit
+ * in the (signed) return value.
+ */
+#define RW_MAX	((size_t)0x7fffffff)
+
+/*
+ * Common logic for read and write and their variants.
  *
- * Look up the fd, then use VOP_READ or VOP_WRITE.
+ * Look up the fd, then use VOP_READ or VOP_WRITE on the user buffers
+ * in IOV.
+ *
+ * For plain read and write (and readv and writev), use and update the
+ * file's seek position. For pread and pwrite (POSITIONAL set), use POS
+ * instead and leave the seek position alone; that way they don't need
+ * the offset lock, and threads sharing a file can do them in parallel.
  */
 static
 int
-sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
-	      int badaccmode, ssize_t *retval)
+sys_readwrite(int fd, struct iovec *iov, unsigned iovcnt,
+	      bool positional, off_t pos,
+	      enum uio_rw rw, int badaccmode, ssize_t *retval)
 {
 	struct openfile *file;
 	bool locked;
-	off_t pos;
-	struct iovec iov;
+	size_t size;
+	unsigned i;
 	struct uio useruio;
 	int result;
 
+	/* add up the total size, watching for overflow */
+	size = 0;
+	for (i=0; i<iovcnt; i++) {
+		if (iov[i].iov_len > RW_MAX - size) {
+			return EINVAL;
+		}
+		size += iov[i].iov_len;
+	}
+
 	/* better be a valid file descriptor */
 	result = filetable_get(curproc->p_filetable, fd, &file);
 	if (result) {
@@ -128,8 +151,19 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 	}
 
 	/* Only lock the seek position if we're really using it. */
-	locked = VOP_ISSEEKABLE(file->of_vnode);
-	if (locked) {
+	locked = false;
+	if (positional) {
+		if (!VOP_ISSEEKABLE(file->of_vnode)) {
+			result = ESPIPE;
+			goto fail;
+		}
+		if (pos < 0) {
+			result = EINVAL;
+			goto fail;
+		}
+	}
+	else if (VOP_ISSEEKABLE(file->of_vnode)) {
+		locked = true;
 		lock_acquire(file->of_offsetlock);
 		pos = file->of_offset;
 	}
@@ -142,8 +176,14 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 		goto fail;
 	}
 
-	/* set up a uio with the buffer, its size, and the current offset */
-	uio_uinit(&iov, &useruio, buf, size, pos, rw);
+	/* set up a uio with the buffers, their size, and the offset */
+	useruio.uio_iov = iov;
+	useruio.uio_iovcnt = iovcnt;
+	useruio.uio_offset = pos;
+	useruio.uio_resid = size;
+	useruio.uio_segflg = UIO_USERSPACE;
+	useruio.uio_rw = rw;
+	useruio.uio_space = proc_getas();
 
 	/* do the read or write */
 	result = (rw == UIO_READ) ?
@@ -177,13 +217,52 @@ fail:
 	return result;
 }
 
+/*
+ * Common logic for readv and writev: fetch the iovec array from
+ * userspace, then use sys_readwrite.
+ */
+static
+int
+sys_readwritev(int fd, const_userptr_t uiov, int iovcnt,
+	       enum uio_rw rw, int badaccmode, ssize_t *retval)
+{
+	struct iovec *iov;
+	int result;
+
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
+	}
+
+	iov = kmalloc(iovcnt * sizeof(struct iovec));
+	if (iov == NULL) {
+		return ENOMEM;
+	}
+
+	/* the user and kernel layouts of struct iovec are the same */
+	result = copyin(uiov, iov, iovcnt * sizeof(struct iovec));
+	if (result) {
+		kfree(iov);
+		return result;
+	}
+
+	result = sys_readwrite(fd, iov, iovcnt, false, 0,
+			       rw, badaccmode, retval);
+	kfree(iov);
+	return result;
+}
+
 /*
  * read() - use sys_readwrite
  */
 int
 sys_read(int fd, userptr_t buf, size_t size, int *retval)
 {
-	return sys_readwrite(fd, buf, size, UIO_READ, O_WRONLY, retval);
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return sys_readwrite(fd, &iov, 1, false, 0,
+			     UIO_READ, O_WRONLY, retval);
 }
 
 /*
@@ -192,7 +271,236 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 int
 sys_write(int fd, userptr_t buf, size_t size, int *retval)
 {
-	return sys_readwrite(fd, buf, size, UIO_WRITE, O_RDONLY, retval);
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return sys_readwrite(fd, &iov, 1, false, 0,
+			     UIO_WRITE, O_RDONLY, retval);
+}
+
+/*
+ * readv() - use sys_readwritev
+ */
+int
+sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return sys_readwritev(fd, iov, iovcnt, UIO_READ, O_WRONLY, retval);
+}
+
+/*
+ * writev() - use sys_readwritev
+ */
+int
+sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return sys_readwritev(fd, iov, iovcnt, UIO_WRITE, O_RDONLY, retval);
+}
+
+/*
+ * pread() - use sys_readwrite with an explicit position
+ */
+int
+sys_pread(int fd, userptr_t buf, size_t size, off_t pos, int *retval)
+{
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return sys_readwrite(fd, &iov, 1, true, pos,
+			     UIO_READ, O_WRONLY, retval);
+}
+
+/*
+ * pwrite() - use sys_readwrite with an explicit position
+ */
+int
+sys_pwrite(int fd, userptr_t buf, size_t size, off_t pos, int *retval)
+{
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return sys_readwrite(fd, &iov, 1, true, pos,
+			     UIO_WRITE, O_RDONLY, retval);
+}
+
+/*
+ * Size of the kernel buffer sendfile moves data through. A multiple
+ * of the file system block size, so that reads and writes of whole
+ * chunks are whole blocks.
+ */
+#define SENDFILE_CHUNK	4096
+
+/*
+ * Read or write one chunk between a kernel buffer and an open file,
+ * for sendfile. Like sys_readwrite, uses *POSP if it isn't NULL, and
+ * the file's seek position (under the offset lock) if it is.
+ */
+static
+int
+sendfile_io(struct openfile *file, void *buf, size_t len, off_t *posp,
+	    enum uio_rw rw, size_t *done)
+{
+	struct iovec iov;
+	struct uio kuio;
+	bool locked;
+	off_t pos;
+	int result;
+
+	locked = false;
+	if (posp != NULL) {
+		pos = *posp;
+	}
+	else if (VOP_ISSEEKABLE(file->of_vnode)) {
+		locked = true;
+		lock_acquire(file->of_offsetlock);
+		pos = file->of_offset;
+	}
+	else {
+		pos = 0;
+	}
+
+	uio_kinit(&iov, &kuio, buf, len, pos, rw);
+	result = (rw == UIO_READ) ?
+		VOP_READ(file->of_vnode, &kuio) :
+		VOP_WRITE(file->of_vnode, &kuio);
+	if (result == 0) {
+		if (posp != NULL) {
+			*posp = kuio.uio_offset;
+		}
+		else if (locked) {
+			file->of_offset = kuio.uio_offset;
+		}
+		*done = len - kuio.uio_resid;
+	}
+
+	if (locked) {
+		lock_release(file->of_offsetlock);
+	}
+	return result;
+}
+
+/*
+ * sendfile() - copy up to COUNT bytes from INFD to OUTFD without
+ * passing through userspace. The data goes through a kernel buffer a
+ * chunk at a time.
+ *
+ * If UOFFSET is not NULL, read INFD starting at *UOFFSET, and update
+ * *UOFFSET rather than INFD's seek position. The output always uses
+ * (and advances) OUTFD's seek position.
+ *
+ * Each chunk is read and written as a separate operation, so if other
+ * threads use the same files at the same time, their I/O may land
+ * between chunks. (Just as if userspace had done the copy.)
+ */
+int
+sys_sendfile(int outfd, int infd, userptr_t uoffset, size_t count,
+	     int *retval)
+{
+	struct openfile *infile, *outfile;
+	off_t inpos, *inposp;
+	char *buf;
+	size_t len, got, wrote, total;
+	int result;
+
+	if (count > RW_MAX) {
+		count = RW_MAX;
+	}
+
+	result = filetable_get(curproc->p_filetable, infd, &infile);
+	if (result) {
+		return result;
+	}
+	result = filetable_get(curproc->p_filetable, outfd, &outfile);
+	if (result) {
+		filetable_put(curproc->p_filetable, infd, infile);
+		return result;
+	}
+
+	if (infile->of_accmode == O_WRONLY ||
+	    outfile->of_accmode == O_RDONLY) {
+		result = EBADF;
+		goto out;
+	}
+
+	inposp = NULL;
+	if (uoffset != NULL) {
+		if (!VOP_ISSEEKABLE(infile->of_vnode)) {
+			result = ESPIPE;
+			goto out;
+		}
+		result = copyin(uoffset, &inpos, sizeof(inpos));
+		if (result) {
+			goto out;
+		}
+		if (inpos < 0) {
+			result = EINVAL;
+			goto out;
+		}
+		inposp = &inpos;
+	}
+
+	buf = kmalloc(SENDFILE_CHUNK);
+	if (buf == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	total = 0;
+	while (total < count) {
+		len = count - total;
+		if (len > SENDFILE_CHUNK) {
+			len = SENDFILE_CHUNK;
+		}
+
+		result = sendfile_io(infile, buf, len, inposp, UIO_READ, &got);
+		if (result || got == 0) {
+			/* error or EOF */
+			break;
+		}
+
+		result = sendfile_io(outfile, buf, got, NULL, UIO_WRITE,
+				     &wrote);
+		if (result) {
+			wrote = 0;
+		}
+		total += wrote;
+
+		if (wrote < got) {
+			/*
+			 * Short write. Put back what we didn't write, if
+			 * we can, so the caller can pick up from there.
+			 */
+			if (inposp != NULL) {
+				*inposp -= got - wrote;
+			}
+			else if (VOP_ISSEEKABLE(infile->of_vnode)) {
+				lock_acquire(infile->of_offsetlock);
+				infile->of_offset -= got - wrote;
+				lock_release(infile->of_offsetlock);
+			}
+			break;
+		}
+	}
+	kfree(buf);
+
+	/* as with write, report partial success rather than the error */
+	if (total > 0) {
+		result = 0;
+	}
+
+	if (result == 0 && inposp != NULL) {
+		result = copyout(&inpos, uoffset, sizeof(inpos));
+	}
+	if (result == 0) {
+		*retval = total;
+	}
+
+out:
+	filetable_put(curproc->p_filetable, outfd, outfile);
+	filetable_put(curproc->p_filetable, infd, infile);
+	return result;
 }
 
 /*
@@ -203,6 +511,7 @@ sys_close(int fd)
 {
 	struct filetable *ft;
 	struct openfile *file;
+	int result;
 
 	ft = curproc->p_filetable;
 
@@ -212,7 +521,8 @@ sys_close(int fd)
 	}
 
 	/* place null in the filetable and get the file previously there */
-	filetable_placeat(ft, NULL, fd, &file);
+	result = filetable_placeat(ft, NULL, fd, &file);
+	KASSERT(result == 0);
 
 	if (file == NULL) {
 		/* oops, it wasn't open, that's an error */
@@ -321,7 +631,11 @@ sys_dup2(int oldfd, int newfd, int *retval)
 	filetable_put(ft, oldfd, oldfdfile);
 
 	/* place it */
-	filetable_placeat(ft, oldfdfile, newfd, &newfdfile);
+	result = filetable_placeat(ft, oldfdfile, newfd, &newfdfile);
+	if (result) {
+		openfile_decref(oldfdfile);
+		return result;
+	}
 
 	/* if there was a file already there, drop that reference */
 	if (newfdfile != NULL) {
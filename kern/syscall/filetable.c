@@ -34,9 +34,104 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <membar.h>
+#include <synch.h>
 #include <openfile.h>
 #include <filetable.h>
 
+/*
+ * Initial number of slots. Enough for most processes.
+ */
+#define FILETABLE_INITSIZE	16
+
+
+/*
+ * Make an empty slot array.
+ */
+static
+struct fdarray *
+fdarray_create(unsigned num)
+{
+	struct fdarray *fa;
+	unsigned i;
+
+	fa = kmalloc(sizeof(struct fdarray));
+	if (fa == NULL) {
+		return NULL;
+	}
+	fa->fa_files = kmalloc(num * sizeof(struct openfile *));
+	if (fa->fa_files == NULL) {
+		kfree(fa);
+		return NULL;
+	}
+	for (i = 0; i < num; i++) {
+		fa->fa_files[i] = NULL;
+	}
+	fa->fa_num = num;
+	fa->fa_old = NULL;
+	return fa;
+}
+
+/*
+ * Destroy a slot array, and all the ones retired before it.
+ */
+static
+void
+fdarray_destroy(struct fdarray *fa)
+{
+	struct fdarray *old;
+
+	while (fa != NULL) {
+		old = fa->fa_old;
+		kfree((void *)fa->fa_files);
+		kfree(fa);
+		fa = old;
+	}
+}
+
+/*
+ * Make sure a filetable has at least NUM slots, growing it if needed.
+ * Must hold the table's lock.
+ *
+ * The new array is filled in before it's published, so a lookup sees
+ * either the old array or the new one, and the same files in either.
+ */
+static
+int
+filetable_grow(struct filetable *ft, unsigned num)
+{
+	struct fdarray *oldfa, *newfa;
+	unsigned newnum, i;
+
+	KASSERT(lock_do_i_hold(ft->ft_lock));
+	KASSERT(num <= OPEN_MAX);
+
+	oldfa = ft->ft_files;
+	if (num <= oldfa->fa_num) {
+		return 0;
+	}
+
+	newnum = oldfa->fa_num * 2;
+	while (newnum < num) {
+		newnum *= 2;
+	}
+	if (newnum > OPEN_MAX) {
+		newnum = OPEN_MAX;
+	}
+
+	newfa = fdarray_create(newnum);
+	if (newfa == NULL) {
+		return ENOMEM;
+	}
+	for (i = 0; i < oldfa->fa_num; i++) {
+		newfa->fa_files[i] = oldfa->fa_files[i];
+	}
+	newfa->fa_old = oldfa;
+
+	membar_store_store();
+	ft->ft_files = newfa;
+	return 0;
+}
 
 /*
  * Construct a filetable.
@@ -45,16 +140,24 @@ struct filetable *
 filetable_create(void)
 {
 	struct filetable *ft;
-	int fd;
 
 	ft = kmalloc(sizeof(struct filetable));
 	if (ft == NULL) {
 		return NULL;
 	}
 
+	ft->ft_lock = lock_create("filetable");
+	if (ft->ft_lock == NULL) {
+		kfree(ft);
+		return NULL;
+	}
+
 	/* the table starts empty */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		ft->ft_openfiles[fd] = NULL;
+	ft->ft_files = fdarray_create(FILETABLE_INITSIZE);
+	if (ft->ft_files == NULL) {
+		lock_destroy(ft->ft_lock);
+		kfree(ft);
+		return NULL;
 	}
 
 	return ft;
@@ -66,17 +169,21 @@ filetable_create(void)
 void
 filetable_destroy(struct filetable *ft)
 {
-	int fd;
+	struct fdarray *fa;
+	unsigned fd;
 
 	KASSERT(ft != NULL);
 
 	/* Close any open files. */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		if (ft->ft_openfiles[fd] != NULL) {
-			openfile_decref(ft->ft_openfiles[fd]);
-			ft->ft_openfiles[fd] = NULL;
+	fa = ft->ft_files;
+	for (fd = 0; fd < fa->fa_num; fd++) {
+		if (fa->fa_files[fd] != NULL) {
+			openfile_decref(fa->fa_files[fd]);
+			fa->fa_files[fd] = NULL;
 		}
 	}
+	fdarray_destroy(fa);
+	lock_destroy(ft->ft_lock);
 	kfree(ft);
 }
 
@@ -99,8 +206,10 @@ int
 filetable_copy(struct filetable *src, struct filetable **dest_ret)
 {
 	struct filetable *dest;
+	struct fdarray *srcfa, *destfa;
 	struct openfile *file;
-	int fd;
+	unsigned fd;
+	int result;
 
 	/* Copying the nonexistent table avoids special cases elsewhere */
 	if (src == NULL) {
@@ -114,25 +223,39 @@ filetable_copy(struct filetable *src, struct filetable **dest_ret)
 	}
 
 	/* share the entries */
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		file = src->ft_openfiles[fd];
+	lock_acquire(src->ft_lock);
+	srcfa = src->ft_files;
+
+	lock_acquire(dest->ft_lock);
+	result = filetable_grow(dest, srcfa->fa_num);
+	lock_release(dest->ft_lock);
+	if (result) {
+		lock_release(src->ft_lock);
+		filetable_destroy(dest);
+		return result;
+	}
+
+	destfa = dest->ft_files;
+	for (fd = 0; fd < srcfa->fa_num; fd++) {
+		file = srcfa->fa_files[fd];
 		if (file != NULL) {
 			openfile_incref(file);
 		}
-		dest->ft_openfiles[fd] = file;
+		destfa->fa_files[fd] = file;
 	}
+	lock_release(src->ft_lock);
 
 	*dest_ret = dest;
 	return 0;
 }
 
 /*
- * Check if a file handle is in range.
+ * Check if a file handle is in range. This is the range the table can
+ * grow to, not its current size.
  */
 bool
 filetable_okfd(struct filetable *ft, int fd)
 {
-	/* We have a fixed-size table so we don't need to check the size */
 	(void)ft;
 
 	return (fd >= 0 && fd < OPEN_MAX);
@@ -145,19 +268,43 @@ filetable_okfd(struct filetable *ft, int fd)
  * This checks that the file handle is in range and fails rather than
  * returning a null openfile; it only yields files that are actually
  * open.
+ *
+ * The openfile returned carries a reference of its own, so it stays
+ * valid even if another thread closes the handle before we're done.
+ *
+ * No locks are taken. Another thread may be closing the file as we
+ * look, so once we have a reference, check the slot again: if the
+ * file's still there, we got it while it was open (even if it was
+ * closed, reused, and reopened at the same handle in between, which
+ * is as good); if not, drop it and start over.
  */
 int
 filetable_get(struct filetable *ft, int fd, struct openfile **ret)
 {
+	struct fdarray *fa;
 	struct openfile *file;
 
 	if (!filetable_okfd(ft, fd)) {
 		return EBADF;
 	}
 
-	file = ft->ft_openfiles[fd];
-	if (file == NULL) {
-		return EBADF;
+	while (1) {
+		fa = ft->ft_files;
+		membar_load_load();
+		if ((unsigned)fd >= fa->fa_num) {
+			return EBADF;
+		}
+		file = fa->fa_files[fd];
+		if (file == NULL) {
+			return EBADF;
+		}
+		if (openfile_tryincref(file)) {
+			/* the array only grows, so fd is still in range */
+			if (ft->ft_files->fa_files[fd] == file) {
+				break;
+			}
+			openfile_decref(file);
+		}
 	}
 
 	*ret = file;
@@ -165,26 +312,22 @@ filetable_get(struct filetable *ft, int fd, struct openfile **ret)
 }
 
 /*
- * Put a file handle back when done with it. This does not actually do
- * anything (other than crosscheck) but it's always good practice to
- * build things so when you take them out you put them back again
- * rather than dropping them on the floor. Then if you need to do
- * something at cleanup time you can put it in this function instead
- * of having to hunt for all the places to insert the new logic.
- *
- * (For example, if you have multithreaded processes you will need to
- * insert additional lock and/or refcount manipulations here and in
- * filetable_get.)
+ * Put a file handle back when done with it. This drops the reference
+ * taken by filetable_get. (The file may no longer be in the table at
+ * this point, if another thread has closed or replaced it; in that
+ * case this may be the last reference.)
  *
  * The openfile should be the one returned from filetable_get. If you
- * want to manipulate the table so the assertion's no longer true, get
- * your own reference to the openfile (with openfile_incref) and call
- * filetable_put before mucking about.
+ * want to keep using it afterwards, get your own reference to the
+ * openfile (with openfile_incref) before calling filetable_put.
  */
 void
 filetable_put(struct filetable *ft, int fd, struct openfile *file)
 {
-	KASSERT(ft->ft_openfiles[fd] == file);
+	(void)ft;
+	(void)fd;
+
+	openfile_decref(file);
 }
 
 /*
@@ -200,17 +343,36 @@ filetable_put(struct filetable *ft, int fd, struct openfile *file)
 int
 filetable_place(struct filetable *ft, struct openfile *file, int *fd_ret)
 {
-	int fd;
+	struct fdarray *fa;
+	unsigned fd;
+	int result;
 
-	for (fd = 0; fd < OPEN_MAX; fd++) {
-		if (ft->ft_openfiles[fd] == NULL) {
-			ft->ft_openfiles[fd] = file;
-			*fd_ret = fd;
-			return 0;
+	lock_acquire(ft->ft_lock);
+	fa = ft->ft_files;
+	for (fd = 0; fd < fa->fa_num; fd++) {
+		if (fa->fa_files[fd] == NULL) {
+			break;
 		}
 	}
+	if (fd == OPEN_MAX) {
+		lock_release(ft->ft_lock);
+		return EMFILE;
+	}
 
-	return EMFILE;
+	/* if it's full, grow it */
+	result = filetable_grow(ft, fd + 1);
+	if (result) {
+		lock_release(ft->ft_lock);
+		return result;
+	}
+
+	/* make sure the file is visibly set up before it's findable */
+	membar_store_store();
+	ft->ft_files->fa_files[fd] = file;
+	lock_release(ft->ft_lock);
+
+	*fd_ret = fd;
+	return 0;
 }
 
 /*
@@ -221,17 +383,42 @@ filetable_place(struct filetable *ft, struct openfile *file, int *fd_ret)
  * reference to the old openfile object (if not NULL); this should
  * generally be decref'd.
  *
- * Doesn't fail.
+ * Fails only if the table needs to grow and can't, and thus never
+ * fails when placing NULL.
  *
  * Note that you can use this to place NULL in the filetable, which is
  * potentially handy.
  */
-void
+int
 filetable_placeat(struct filetable *ft, struct openfile *newfile, int fd,
 		  struct openfile **oldfile_ret)
 {
+	struct fdarray *fa;
+	int result;
+
 	KASSERT(filetable_okfd(ft, fd));
 
-	*oldfile_ret = ft->ft_openfiles[fd];
-	ft->ft_openfiles[fd] = newfile;
+	lock_acquire(ft->ft_lock);
+	fa = ft->ft_files;
+	if ((unsigned)fd >= fa->fa_num) {
+		if (newfile == NULL) {
+			/* nothing there, and nothing to put there */
+			lock_release(ft->ft_lock);
+			*oldfile_ret = NULL;
+			return 0;
+		}
+		result = filetable_grow(ft, fd + 1);
+		if (result) {
+			lock_release(ft->ft_lock);
+			return result;
+		}
+		fa = ft->ft_files;
+	}
+
+	*oldfile_ret = fa->fa_files[fd];
+	membar_store_store();
+	fa->fa_files[fd] = newfile;
+	lock_release(ft->ft_lock);
+
+	return 0;
 }
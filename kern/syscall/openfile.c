@@ -35,10 +35,19 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <lib.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <atomic.h>
 #include <synch.h>
 #include <vfs.h>
 #include <openfile.h>
 
+/*
+ * Free list of openfile structures; see openfile.h.
+ */
+static struct spinlock openfile_freelock = SPINLOCK_INITIALIZER;
+static struct openfile *openfile_freelist;
+
 /*
  * Constructor for struct openfile.
  */
@@ -53,22 +62,36 @@ openfile_create(struct vnode *vn, int accmode)
 		accmode == O_WRONLY ||
 		accmode == O_RDWR);
 
-	file = kmalloc(sizeof(struct openfile));
-	if (file == NULL) {
-		return NULL;
+	/* reuse one if we can */
+	spinlock_acquire(&openfile_freelock);
+	file = openfile_freelist;
+	if (file != NULL) {
+		openfile_freelist = file->of_nextfree;
 	}
+	spinlock_release(&openfile_freelock);
 
-	file->of_offsetlock = lock_create("openfile");
-	if (file->of_offsetlock == NULL) {
-		kfree(file);
-		return NULL;
+	if (file == NULL) {
+		file = kmalloc(sizeof(struct openfile));
+		if (file == NULL) {
+			return NULL;
+		}
+
+		file->of_offsetlock = lock_create("openfile");
+		if (file->of_offsetlock == NULL) {
+			kfree(file);
+			return NULL;
+		}
+		file->of_refcount = 0;
 	}
-
-	spinlock_init(&file->of_reflock);
+	KASSERT(file->of_refcount == 0);
 
 	file->of_vnode = vn;
 	file->of_accmode = accmode;
 	file->of_offset = 0;
+	file->of_nextfree = NULL;
+
+	/* finish setting up before anyone can take a reference */
+	membar_store_store();
 	file->of_refcount = 1;
 
 	return file;
@@ -77,17 +100,24 @@ openfile_create(struct vnode *vn, int accmode)
 /*
  * Destructor for struct openfile. Private; should only be used via
  * openfile_decref().
+ *
+ * The structure itself isn't freed, because openfile_tryincref may
+ * still be looking at it; it goes on the free list instead.
  */
 static
 void
 openfile_destroy(struct openfile *file)
 {
+	KASSERT(file->of_refcount == 0);
+
 	/* balance vfs_open with vfs_close (not VOP_DECREF) */
 	vfs_close(file->of_vnode);
+	file->of_vnode = NULL;
 
-	spinlock_cleanup(&file->of_reflock);
-	lock_destroy(file->of_offsetlock);
-	kfree(file);
+	spinlock_acquire(&openfile_freelock);
+	file->of_nextfree = openfile_freelist;
+	openfile_freelist = file;
+	spinlock_release(&openfile_freelock);
 }
 
 /*
@@ -117,14 +147,33 @@ openfile_open(char *filename, int openflags, mode_t mode,
 }
 
 /*
- * Increment the reference count on an openfile.
+ * Increment the reference count on an openfile. The caller must
+ * already hold a reference.
  */
 void
 openfile_incref(struct openfile *file)
 {
-	spinlock_acquire(&file->of_reflock);
-	file->of_refcount++;
-	spinlock_release(&file->of_reflock);
+	unsigned count;
+
+	count = atomic_add(&file->of_refcount, 1);
+	KASSERT(count > 1);
+}
+
+/*
+ * Try to get a reference to an openfile the caller found without
+ * holding one. Fails if the file has been closed. Note that even on
+ * success the structure might have been reused for a different file
+ * in the meantime; the caller needs to check.
+ */
+bool
+openfile_tryincref(struct openfile *file)
+{
+	if (!atomic_inc_nonzero(&file->of_refcount)) {
+		return false;
+	}
+	/* don't let reads of the file get ahead of the reference */
+	membar_load_load();
+	return true;
 }
 
 /*
@@ -134,16 +183,19 @@ openfile_incref(struct openfile *file)
 void
 openfile_decref(struct openfile *file)
 {
-	spinlock_acquire(&file->of_reflock);
+	unsigned count;
+
+	/* finish with the file before giving up the reference */
+	membar_any_store();
+
+	count = atomic_add(&file->of_refcount, -1);
 
 	/* if this is the last close of this file, free it up */
-	if (file->of_refcount == 1) {
-		spinlock_release(&file->of_reflock);
+	if (count == 0) {
+		membar_load_load();
 		openfile_destroy(file);
 	}
 	else {
-		KASSERT(file->of_refcount > 1);
-		file->of_refcount--;
-		spinlock_release(&file->of_reflock);
+		KASSERT(count < (unsigned)-1);
 	}
 }
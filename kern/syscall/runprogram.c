@@ -28,18 +28,20 @@
  */
 
 /*
- * Code for running a user program from the menu, and code for execv,
- * which have a lot in common.
+ * Code for running a user program from the menu, and code for execv
+ * and spawn, which have a lot in common.
  */
 
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <kern/unistd.h>
+#include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
 #include <proc.h>
 #include <current.h>
+#include <thread.h>
 #include <synch.h>
 #include <copyinout.h>
 #include <addrspace.h>
@@ -47,6 +49,8 @@
 #include <vfs.h>
 #include <openfile.h>
 #include <filetable.h>
+#include <aio.h>
+#include <pid.h>
 #include <syscall.h>
 #include <test.h>
 
@@ -55,34 +59,27 @@
  *
  * This is an abstraction that holds an argv while it's being shuffled
  * through the kernel during exec.
+ *
+ * ARG_MAX is one page (see <kern/limits.h>), so the strings are
+ * collected into a single page, laid out the way they'll appear at
+ * the top of the new process's stack. Then, rather than copying them
+ * out again, the page itself is given to the new address space (see
+ * argbuf_install). Only the array of argv pointers gets copied out.
  */
+#if ARG_MAX > PAGE_SIZE
+#error "argbuf assumes an argv fits in one page"
+#endif
+
 struct argbuf {
-	char *data;
+	vaddr_t page;		/* kernel page holding strings, or 0 */
 	size_t len;
-	size_t max;
 	int nargs;
-	bool tooksem;
 };
 
 /*
- * Throttle to limit the number of processes in exec at once. Or,
- * rather, the number trying to use large exec buffers at once. See
- * design notes for the rationale.
- */
-#define EXEC_BIGBUF_THROTTLE	1
-static struct semaphore *execthrottle;
-
-/*
- * Set things up.
+ * Number of argv pointers to fetch from userspace at once.
  */
-void
-exec_bootstrap(void)
-{
-	execthrottle = sem_create("exec", EXEC_BIGBUF_THROTTLE);
-	if (execthrottle == NULL) {
-		panic("Cannot create exec throttle semaphore\n");
-	}
-}
+#define ARGV_BATCH	32
 
 /*
  * Initialize an argv buffer.
@@ -91,48 +88,65 @@ static
 void
 argbuf_init(struct argbuf *buf)
 {
-	buf->data = NULL;
+	buf->page = 0;
 	buf->len = 0;
-	buf->max = 0;
 	buf->nargs = 0;
-	buf->tooksem = false;
 }
 
 /*
- * Clean up an argv buffer when done.
+ * Clean up an argv buffer when done. A page that has been handed off
+ * to an address space is zeroed out and isn't freed.
  */
 static
 void
 argbuf_cleanup(struct argbuf *buf)
 {
-	if (buf->data != NULL) {
-		kfree(buf->data);
-		buf->data = NULL;
+	if (buf->page != 0) {
+		free_kpages(buf->page);
+		buf->page = 0;
 	}
 	buf->len = 0;
-	buf->max = 0;
 	buf->nargs = 0;
-	if (buf->tooksem) {
-		V(execthrottle);
-		buf->tooksem = false;
-	}
 }
 
 /*
- * Allocate the memory for an argv buffer.
+ * Find room for the next byte of an argv buffer, getting the page if
+ * we don't have it yet. Hands back a pointer to it and the number of
+ * bytes left.
  */
 static
 int
-argbuf_allocate(struct argbuf *buf, size_t size)
+argbuf_space(struct argbuf *buf, char **ptr, size_t *avail)
 {
-	buf->data = kmalloc(size);
-	if (buf->data == NULL) {
-		return ENOMEM;
+	if (buf->len >= ARG_MAX) {
+		return E2BIG;
+	}
+
+	if (buf->page == 0) {
+		buf->page = alloc_kpages(1);
+		if (buf->page == 0) {
+			return ENOMEM;
+		}
+		/* the unused part will be visible to the new process */
+		bzero((void *)buf->page, PAGE_SIZE);
 	}
-	buf->max = size;
+
+	*ptr = (char *)buf->page + buf->len;
+	*avail = ARG_MAX - buf->len;
 	return 0;
 }
 
+/*
+ * Get the byte at position POS in an argv buffer.
+ */
+static
+char
+argbuf_getbyte(struct argbuf *buf, size_t pos)
+{
+	KASSERT(pos < buf->len);
+	return ((char *)buf->page)[pos];
+}
+
 /*
  * Prepare an argv buffer for runprogram, using a kernel pointer.
  *
@@ -143,66 +157,52 @@ static
 int
 argbuf_fromkernel(struct argbuf *buf, const char *progname)
 {
-	size_t len;
+	size_t len, avail;
+	char *dest;
 	int result;
 
 	len = strlen(progname) + 1;
 
-	result = argbuf_allocate(buf, len);
+	result = argbuf_space(buf, &dest, &avail);
 	if (result) {
 		return result;
 	}
-	strcpy(buf->data, progname);
-	buf->len = len;
+	if (len > avail) {
+		return E2BIG;
+	}
+	memcpy(dest, progname, len);
+	buf->len += len;
 	buf->nargs = 1;
 
 	return 0;
 }
 
 /*
- * Copy an argv array into kernel space, using an argvdata buffer.
+ * Copy one argument string into an argv buffer.
  */
 static
 int
-argbuf_copyin(struct argbuf *buf, userptr_t uargv)
+argbuf_copyinstr(struct argbuf *buf, userptr_t thisarg)
 {
-	userptr_t thisarg;
-	size_t thisarglen;
+	char *dest;
+	size_t avail, thisarglen;
 	int result;
 
-	/* loop through the argv, grabbing each arg string */
-	buf->nargs = 0;
-	while (1) {
-		/*
-		 * First, grab the pointer at argv.
-		 * (argv is incremented at the end of the loop)
-		 */
-		result = copyin(uargv, &thisarg, sizeof(userptr_t));
-		if (result) {
-			return result;
-		}
-
-		/* If we got NULL, we're at the end of the argv. */
-		if (thisarg == NULL) {
-			break;
-		}
-
-		/* Use the pointer to fetch the argument string. */
-		result = copyinstr(thisarg, buf->data + buf->len,
-				   buf->max - buf->len, &thisarglen);
-		if (result == ENAMETOOLONG) {
-			return E2BIG;
-		}
-		else if (result) {
-			return result;
-		}
+	result = argbuf_space(buf, &dest, &avail);
+	if (result) {
+		return result;
+	}
 
-		/* Move ahead. Note: thisarglen includes the \0. */
-		buf->len += thisarglen;
-		uargv += sizeof(userptr_t);
-		buf->nargs++;
+	result = copyinstr(thisarg, dest, avail, &thisarglen);
+	if (result == ENAMETOOLONG) {
+		return E2BIG;
+	}
+	if (result) {
+		return result;
 	}
 
+	/* Note: thisarglen includes the \0. */
+	buf->len += thisarglen;
 	return 0;
 }
 
@@ -213,121 +213,140 @@ static
 int
 argbuf_fromuser(struct argbuf *buf, userptr_t uargv)
 {
+	userptr_t ptrs[ARGV_BATCH];
+	size_t n, i;
 	int result;
 
-	/* try with a small buffer */
-	result = argbuf_allocate(buf, PAGE_SIZE);
-	if (result) {
-		return result;
-	}
-
-	/* do the copyin */
-	result = argbuf_copyin(buf, uargv);
-	if (result == E2BIG) {
+	/* loop through the argv, grabbing each arg string */
+	buf->nargs = 0;
+	while (1) {
 		/*
-		 * Try again with the full-size buffer. Just start
-		 * over instead of trying to keep the page we already
-		 * did; this is a bit inefficient but it's not that
-		 * important.
+		 * First, grab a batch of pointers at argv. Don't read
+		 * past the end of the page argv is on, as the NULL
+		 * might be the last thing in it. (argv is incremented
+		 * at the end of the loop)
 		 */
-		argbuf_cleanup(buf);
-		argbuf_init(buf);
-
-		/* Wait on the semaphore, to throttle this allocation */
-		P(execthrottle);
-		buf->tooksem = true;
-
-		result = argbuf_allocate(buf, ARG_MAX);
+		n = (PAGE_SIZE - ((vaddr_t)uargv % PAGE_SIZE)) /
+			sizeof(userptr_t);
+		if (n == 0) {
+			/* misaligned pointer straddling a page */
+			n = 1;
+		}
+		if (n > ARGV_BATCH) {
+			n = ARGV_BATCH;
+		}
+		result = copyin(uargv, ptrs, n * sizeof(userptr_t));
 		if (result) {
 			return result;
 		}
 
-		result = argbuf_copyin(buf, uargv);
+		for (i=0; i<n; i++) {
+			/* If we got NULL, we're at the end of the argv. */
+			if (ptrs[i] == NULL) {
+				return 0;
+			}
+
+			/* Use the pointer to fetch the argument string. */
+			result = argbuf_copyinstr(buf, ptrs[i]);
+			if (result) {
+				return result;
+			}
+			buf->nargs++;
+		}
+
+		/* Move ahead. */
+		uargv += n * sizeof(userptr_t);
 	}
-	return result;
 }
 
 /*
- * Copy an argv out of kernel space to user space.
+ * Put an argv into a new address space, whose stack top is *USTACKP.
+ * The address space must be current.
+ *
+ * The page holding the strings is mapped directly below the stack
+ * top, and the address space takes it over; then the argv pointer
+ * array is built and copied out below it.
  *
  * Note: ustackp is an in/out argument.
  */
 static
 int
-argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
+argbuf_install(struct argbuf *buf, struct addrspace *as, vaddr_t *ustackp,
 	       int *argc_ret, userptr_t *uargv_ret)
 {
-	vaddr_t ustack;
-	userptr_t ustringbase, uargvbase, uargv_i;
-	userptr_t thisarg;
-	size_t thisarglen;
-	size_t pos;
+	vaddr_t ustack, ustringbase;
+	userptr_t *kargv;
+	size_t pos, kargvsize;
+	int j;
 	int result;
 
 	/* Begin the stack at the passed in top. */
 	ustack = *ustackp;
+	KASSERT((ustack & PAGE_FRAME) == ustack);
 
 	/*
-	 * Allocate space.
-	 *
-	 * buf->pos is the amount of space used by the strings; put that
-	 * first, then align the stack, then make space for the argv
-	 * pointers. Allow an extra slot for the ending NULL.
+	 * Allocate space: the string page first (if there are any
+	 * strings), then the argv pointers. Allow an extra slot for
+	 * the ending NULL.
 	 */
+	ustringbase = ustack;
+	if (buf->page != 0) {
+		ustringbase -= PAGE_SIZE;
+	}
 
-	ustack -= buf->len;
-	ustack -= (ustack & (sizeof(void *) - 1));
-	ustringbase = (userptr_t)ustack;
-
-	ustack -= (buf->nargs + 1) * sizeof(userptr_t);
-	uargvbase = (userptr_t)ustack;
+	kargvsize = (buf->nargs + 1) * sizeof(userptr_t);
+	kargv = kmalloc(kargvsize);
+	if (kargv == NULL) {
+		return ENOMEM;
+	}
 
-	/* Now copy the data out. */
+	/* Find where each string will be. */
 	pos = 0;
-	uargv_i = uargvbase;
-	while (pos < buf->len) {
-		/* The user address of the string will be ustringbase + pos. */
-		thisarg = ustringbase + pos;
-
-		/* Place it in the argv array. */
-		result = copyout(&thisarg, uargv_i, sizeof(thisarg));
-		if (result) {
-			return result;
+	for (j=0; j<buf->nargs; j++) {
+		kargv[j] = (userptr_t)(ustringbase + pos);
+		while (argbuf_getbyte(buf, pos) != 0) {
+			pos++;
 		}
+		/* skip the \0 */
+		pos++;
+	}
+	/* Should have come out even... */
+	KASSERT(pos == buf->len);
+	kargv[buf->nargs] = NULL;
 
-		/* Push out the string. */
-		result = copyoutstr(buf->data + pos, thisarg,
-				    buf->len - pos, &thisarglen);
+	/* Hand over the page. */
+	if (buf->page != 0) {
+		result = as_map_page(as, ustringbase, buf->page);
 		if (result) {
+			kfree(kargv);
 			return result;
 		}
-
-		/* thisarglen includes the \0 */
-		pos += thisarglen;
-		uargv_i += sizeof(thisarg);
+		buf->page = 0;
 	}
-	/* Should have come out even... */
-	KASSERT(pos == buf->len);
 
-	/* Add the NULL. */
-	thisarg = NULL;
-	result = copyout(&thisarg, uargv_i, sizeof(userptr_t));
+	ustack = ustringbase - kargvsize;
+
+	/* Now copy the pointers out. */
+	result = copyout(kargv, (userptr_t)ustack, kargvsize);
+	kfree(kargv);
 	if (result) {
 		return result;
 	}
 
 	*ustackp = ustack;
 	*argc_ret = buf->nargs;
-	*uargv_ret = uargvbase;
+	*uargv_ret = (userptr_t)ustack;
 	return 0;
 }
 
 /*
- * Common code for execv and runprogram: loading the executable.
+ * Common code for execv and runprogram: loading the executable and
+ * setting up its argv.
  */
 static
 int
-loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
+loadexec(char *path, struct argbuf *buf, vaddr_t *entrypoint,
+	 vaddr_t *stackptr, int *argc_ret, userptr_t *uargv_ret)
 {
 	struct addrspace *newvm, *oldvm;
 	struct vnode *v;
@@ -385,6 +404,16 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 		return result;
         }
 
+	/* Send the argv strings to the process. */
+	result = argbuf_install(buf, newvm, stackptr, argc_ret, uargv_ret);
+	if (result) {
+		proc_setas(oldvm);
+		as_activate();
+		as_destroy(newvm);
+		kfree(newname);
+		return result;
+	}
+
 	/*
 	 * Wipe out old address space.
 	 *
@@ -395,6 +424,12 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 		as_destroy(oldvm);
 	}
 
+	/* Any async I/O ring was in the old image; forget it. */
+	if (curproc->p_aio != NULL) {
+		aio_destroy(curproc->p_aio);
+		curproc->p_aio = NULL;
+	}
+
 	/*
 	 * Now that we know we're succeeding, change the current thread's
 	 * name to reflect the new process.
@@ -431,7 +466,11 @@ placed_open(const char *path, int openflags, int fd)
 	}
 
 	/* place the file in the filetable in the right slot */
-	filetable_placeat(curproc->p_filetable, newfile, fd, &oldfile);
+	result = filetable_placeat(curproc->p_filetable, newfile, fd, &oldfile);
+	if (result) {
+		openfile_decref(newfile);
+		return result;
+	}
 
 	/* the table should previously have been empty */
 	KASSERT(oldfile == NULL);
@@ -519,18 +558,13 @@ runprogram(char *progname)
 	}
 
 	/* Load the executable. Note: must not fail after this succeeds. */
-	result = loadexec(progname, &entrypoint, &stackptr);
+	result = loadexec(progname, &kargv, &entrypoint, &stackptr,
+			  &argc, &uargv);
 	if (result) {
 		argbuf_cleanup(&kargv);
 		return result;
 	}
 
-	result = argbuf_copyout(&kargv, &stackptr, &argc, &uargv);
-	if (result) {
-		/* If copyout fails, *we* messed up, so panic */
-		panic("execv: copyout_args failed: %s\n", strerror(result));
-	}
-
 	/* free the space */
 	argbuf_cleanup(&kargv);
 
@@ -546,10 +580,9 @@ runprogram(char *progname)
  * execv.
  *
  * 1. Copy in the program name.
- * 2. Copy in the argv with copyin_args.
- * 3. Load the executable.
- * 4. Copy the argv out again with copyout_args.
- * 5. Warp to usermode.
+ * 2. Copy in the argv with argbuf_fromuser.
+ * 3. Load the executable, giving it the argv with argbuf_install.
+ * 4. Warp to usermode.
  */
 int
 sys_execv(userptr_t prog, userptr_t uargv)
@@ -584,7 +617,8 @@ sys_execv(userptr_t prog, userptr_t uargv)
 	}
 
 	/* Load the executable. Note: must not fail after this succeeds. */
-	result = loadexec(path, &entrypoint, &stackptr);
+	result = loadexec(path, &kargv, &entrypoint, &stackptr,
+			  &argc, &uargv);
 	if (result) {
 		argbuf_cleanup(&kargv);
 		kfree(path);
@@ -594,13 +628,6 @@ sys_execv(userptr_t prog, userptr_t uargv)
 	/* don't need this any more */
 	kfree(path);
 
-	/* Send the argv strings to the process. */
-	result = argbuf_copyout(&kargv, &stackptr, &argc, &uargv);
-	if (result) {
-		/* if copyout fails, *we* messed up, so panic */
-		panic("execv: copyout_args failed: %s\n", strerror(result));
-	}
-
 	/* free the argv buffer space */
 	argbuf_cleanup(&kargv);
 
@@ -611,3 +638,130 @@ sys_execv(userptr_t prog, userptr_t uargv)
 	panic("enter_new_process returned\n");
 	return EINVAL;
 }
+
+/*
+ * spawn.
+ *
+ * This is fork and execv in one call, for the common case where the
+ * child of a fork does nothing but exec. The child never gets a copy
+ * of the parent's address space; it starts with none and loads the
+ * new program directly.
+ *
+ * The parent copies in the program name and argv (from its own
+ * address space, so they have to be collected before the child
+ * exists) and then waits for the child to finish loading, so that
+ * exec failures are reported back to the caller like execv's would
+ * be rather than showing up only as an exit status.
+ */
+
+struct spawninfo {
+	char *path;			/* program to run */
+	struct argbuf kargv;		/* its argv */
+	struct semaphore *done;		/* signalled when child is loaded */
+	int result;			/* outcome of load */
+};
+
+static
+void
+spawn_newthread(void *vsi, unsigned long junk)
+{
+	struct spawninfo *si = vsi;
+	vaddr_t entrypoint, stackptr;
+	int argc;
+	userptr_t uargv;
+	int result;
+
+	(void)junk;
+
+	/* We have no address space yet; loadexec makes one. */
+	KASSERT(proc_getas() == NULL);
+
+	result = loadexec(si->path, &si->kargv, &entrypoint, &stackptr,
+			  &argc, &uargv);
+
+	/* The parent owns si; we must not touch it after this. */
+	si->result = result;
+	V(si->done);
+
+	if (result == 0) {
+		/* Warp to user mode. */
+		enter_new_process(argc, uargv, NULL /*uenv*/,
+				  stackptr, entrypoint);
+	}
+
+	/* Load failed; the parent will collect us. */
+	proc_exit(_MKWAIT_EXIT(255));
+}
+
+int
+sys_spawn(userptr_t prog, userptr_t uargv, pid_t *retval)
+{
+	struct spawninfo si;
+	struct proc *newproc;
+	pid_t pid;
+	int result;
+
+	si.path = kmalloc(PATH_MAX);
+	if (si.path == NULL) {
+		return ENOMEM;
+	}
+
+	/* Get the filename. */
+	result = copyinstr(prog, si.path, PATH_MAX, NULL);
+	if (result) {
+		kfree(si.path);
+		return result;
+	}
+
+	/* get the argv strings. */
+	argbuf_init(&si.kargv);
+	result = argbuf_fromuser(&si.kargv, uargv);
+	if (result) {
+		argbuf_cleanup(&si.kargv);
+		kfree(si.path);
+		return result;
+	}
+
+	si.done = sem_create("spawn", 0);
+	if (si.done == NULL) {
+		argbuf_cleanup(&si.kargv);
+		kfree(si.path);
+		return ENOMEM;
+	}
+	si.result = 0;
+
+	result = proc_spawn(&newproc);
+	if (result) {
+		sem_destroy(si.done);
+		argbuf_cleanup(&si.kargv);
+		kfree(si.path);
+		return result;
+	}
+	pid = newproc->p_pid;
+
+	result = thread_fork(curthread->t_name, newproc,
+			     spawn_newthread, &si, 0);
+	if (result) {
+		proc_unfork(newproc);
+		sem_destroy(si.done);
+		argbuf_cleanup(&si.kargv);
+		kfree(si.path);
+		return result;
+	}
+
+	/* Wait for the child to load (or fail to). */
+	P(si.done);
+
+	sem_destroy(si.done);
+	argbuf_cleanup(&si.kargv);
+	kfree(si.path);
+
+	if (si.result) {
+		/* Reap the child, which has exited or is about to. */
+		pid_wait(pid, NULL, 0, NULL);
+		return si.result;
+	}
+
+	*retval = pid;
+	return 0;
+}
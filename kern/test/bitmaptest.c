@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -40,7 +41,7 @@ bitmaptest(int nargs, char **args)
 	struct bitmap *b;
 	char data[TESTSIZE];
 	uint32_t x;
-	int i;
+	int i, result;
 
 	(void)nargs;
 	(void)args;
@@ -101,6 +102,19 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* bitmap_alloc_near takes the first clear bit from the goal on */
+	bitmap_unmark(b, 7);
+	bitmap_unmark(b, 300);
+	bitmap_unmark(b, TESTSIZE-1);
+	result = bitmap_alloc_near(b, 301, &x);
+	KASSERT(result==0 && x==TESTSIZE-1);
+	result = bitmap_alloc_near(b, 301, &x);
+	KASSERT(result==0 && x==7);
+	result = bitmap_alloc_near(b, 300, &x);
+	KASSERT(result==0 && x==300);
+	result = bitmap_alloc_near(b, 0, &x);
+	KASSERT(result==ENOSPC);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
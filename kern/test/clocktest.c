@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Timer tests: sleep latency, timeout accuracy, and tickless idle.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <synch.h>
+#include <test.h>
+
+#define SLEEP_ROUNDS	20
+#define NTIMEOUTS	16
+
+/*
+ * The clock code works in whole microseconds, so allow for one
+ * microsecond of truncation before calling anything early.
+ */
+#define EARLY(elapsed, usecs)	((elapsed) + 1 < (usecs))
+
+struct clockrec {
+	struct timeout cr_to;
+	struct timespec cr_start;
+	uint64_t cr_usecs;		/* Requested delay */
+	uint64_t cr_elapsed;		/* Actual delay */
+	bool cr_fired;
+};
+
+static struct semaphore *clocksem;
+static struct clockrec clockrecs[NTIMEOUTS];
+static struct clockrec cancelrec;
+static struct timeout ticklessto;
+static unsigned tickless_seen;
+
+/*
+ * Microseconds since START.
+ */
+static
+uint64_t
+usecs_since(const struct timespec *start)
+{
+	struct timespec now, diff;
+
+	gettime(&now);
+	timespec_sub(&now, start, &diff);
+	return (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
+
+/*
+ * How far past the requested time clockusleep wakes up.
+ */
+static
+bool
+sleeplatency(void)
+{
+	static const uint64_t delays[] = { 10, 100, 1000, 10000 };
+	struct timespec start;
+	uint64_t us, total, max;
+	unsigned i, j, early;
+	bool ok;
+
+	ok = true;
+	for (i=0; i<sizeof(delays)/sizeof(delays[0]); i++) {
+		total = max = 0;
+		early = 0;
+		for (j=0; j<SLEEP_ROUNDS; j++) {
+			gettime(&start);
+			clockusleep(delays[i]);
+			us = usecs_since(&start);
+			if (EARLY(us, delays[i])) {
+				early++;
+				continue;
+			}
+			us -= delays[i];
+			total += us;
+			if (us > max) {
+				max = us;
+			}
+		}
+		kprintf("clocktest: usleep %llu us: late avg %llu us, "
+			"max %llu us, %u early\n", delays[i],
+			total / SLEEP_ROUNDS, max, early);
+		if (early > 0) {
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+/*
+ * Timeout callback; runs from the timer interrupt.
+ */
+static
+void
+clockrec_fire(void *data)
+{
+	struct clockrec *cr = data;
+
+	cr->cr_elapsed = usecs_since(&cr->cr_start);
+	cr->cr_fired = true;
+	V(clocksem);
+}
+
+static
+void
+clockrec_start(struct clockrec *cr, uint64_t usecs)
+{
+	cr->cr_usecs = usecs;
+	cr->cr_elapsed = 0;
+	cr->cr_fired = false;
+	timeout_init(&cr->cr_to, clockrec_fire, cr);
+	gettime(&cr->cr_start);
+	timeout_add(&cr->cr_to, usecs);
+}
+
+/*
+ * Start a batch of timeouts at once, spread over several levels of
+ * the wheel, plus one that gets cancelled; check that each goes off
+ * no earlier than asked and that the cancelled one doesn't go off.
+ */
+static
+bool
+timeoutaccuracy(void)
+{
+	uint64_t late, max;
+	unsigned i, early;
+	bool ok;
+
+	ok = true;
+	for (i=0; i<NTIMEOUTS; i++) {
+		/* 50 us up to about 0.8 s */
+		clockrec_start(&clockrecs[i], 50ULL << (i * 15 / NTIMEOUTS));
+	}
+	clockrec_start(&cancelrec, 200000);
+	if (!timeout_del(&cancelrec.cr_to)) {
+		kprintf("clocktest: timeout_del missed a pending timeout\n");
+		ok = false;
+	}
+
+	/* The last of these is due well after the cancelled one. */
+	for (i=0; i<NTIMEOUTS; i++) {
+		P(clocksem);
+	}
+
+	max = 0;
+	early = 0;
+	for (i=0; i<NTIMEOUTS; i++) {
+		KASSERT(clockrecs[i].cr_fired);
+		if (EARLY(clockrecs[i].cr_elapsed, clockrecs[i].cr_usecs)) {
+			early++;
+			continue;
+		}
+		late = clockrecs[i].cr_elapsed - clockrecs[i].cr_usecs;
+		if (late > max) {
+			max = late;
+		}
+	}
+	kprintf("clocktest: %u timeouts from 50 us to %llu us: "
+		"max late %llu us, %u early\n", NTIMEOUTS,
+		clockrecs[NTIMEOUTS-1].cr_usecs, max, early);
+	if (early > 0) {
+		ok = false;
+	}
+	if (cancelrec.cr_fired) {
+		kprintf("clocktest: cancelled timeout went off\n");
+		ok = false;
+	}
+	return ok;
+}
+
+/*
+ * Timeout callback that counts the cpus whose hardclock is off.
+ */
+static
+void
+tickless_count(void *data)
+{
+	unsigned i, n;
+
+	(void)data;
+
+	n = 0;
+	for (i=0; i<cpu_count(); i++) {
+		if (cpu_get(i)->c_tickless) {
+			n++;
+		}
+	}
+	tickless_seen = n;
+}
+
+/*
+ * Sleep for a second with nothing else running and see how many
+ * hardclocks each cpu takes. With the tick stopped on idle cpus this
+ * should be close to zero rather than HZ.
+ */
+static
+void
+ticklessidle(void)
+{
+	unsigned ncpus, i;
+	unsigned *before;
+
+	ncpus = cpu_count();
+	before = kmalloc(ncpus * sizeof(before[0]));
+	if (before == NULL) {
+		kprintf("clocktest: Out of memory\n");
+		return;
+	}
+
+	tickless_seen = 0;
+	timeout_init(&ticklessto, tickless_count, NULL);
+	for (i=0; i<ncpus; i++) {
+		before[i] = cpu_get(i)->c_hardclocks;
+	}
+	timeout_add(&ticklessto, 500000);
+	clocksleep(1);
+
+	kprintf("clocktest: hardclocks in 1 s idle (HZ %u):", HZ);
+	for (i=0; i<ncpus; i++) {
+		kprintf(" %u", cpu_get(i)->c_hardclocks - before[i]);
+	}
+	kprintf("\n");
+	kprintf("clocktest: %u of %u cpus tickless at 0.5 s\n",
+		tickless_seen, ncpus);
+
+	kfree(before);
+}
+
+int
+clocktest(int nargs, char **args)
+{
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	clocksem = sem_create("clocktest", 0);
+	if (clocksem == NULL) {
+		panic("clocktest: sem_create failed\n");
+	}
+
+	kprintf("Starting timer test...\n");
+	ok = sleeplatency();
+	if (!timeoutaccuracy()) {
+		ok = false;
+	}
+	ticklessidle();
+	kprintf("Timer test %s.\n", ok ? "done" : "FAILED");
+
+	sem_destroy(clocksem);
+	return 0;
+}
@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Scheduler tests.
+ *
+ * These run in the kernel against the real scheduler and print what
+ * they measure; they check for outright failure (a thread that never
+ * gets to run) but leave the judgment of the numbers to the reader.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <test.h>
+
+#define PONG_ROUNDS	200
+#define PONG_HOGS	8
+#define PONG_MAXHOGS	32
+
+static struct semaphore *pingsem;
+static struct semaphore *pongsem;
+static struct semaphore *hogsem;
+static volatile bool hogs_stop;
+static volatile unsigned hoglevel[PONG_MAXHOGS];
+
+/*
+ * Microseconds since START.
+ */
+static
+uint64_t
+usecs_since(const struct timespec *start)
+{
+	struct timespec now, diff;
+
+	gettime(&now);
+	timespec_sub(&now, start, &diff);
+	return (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
+
+/*
+ * A CPU-bound thread. It never sleeps, so it should sink to the
+ * bottom run queue level; it records the level it's at as it goes.
+ */
+static
+void
+hogthread(void *junk, unsigned long num)
+{
+	volatile unsigned i;
+
+	(void)junk;
+
+	while (!hogs_stop) {
+		for (i=0; i<1000; i++);
+		hoglevel[num] = curthread->t_priority;
+	}
+	V(hogsem);
+}
+
+static
+void
+pongthread(void *junk, unsigned long rounds)
+{
+	unsigned long i;
+
+	(void)junk;
+
+	for (i=0; i<rounds; i++) {
+		P(pingsem);
+		V(pongsem);
+	}
+}
+
+/*
+ * Bounce a token back and forth with pongthread ROUNDS times while
+ * NHOGS hog threads compete for the cpus, and report the round trip
+ * times. Each round wakes pongthread from a semaphore, so this is
+ * the wakeup latency an interactive thread sees.
+ */
+static
+void
+pong_run(unsigned nhogs, unsigned rounds)
+{
+	struct timespec start;
+	uint64_t us, total, max;
+	unsigned i;
+	int result;
+
+	hogs_stop = false;
+	for (i=0; i<nhogs; i++) {
+		hoglevel[i] = 0;
+		result = thread_fork("schedhog", NULL, hogthread, NULL, i);
+		if (result) {
+			panic("schedpong: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	if (nhogs > 0) {
+		/* Give the hogs time to use up their quanta. */
+		clocksleep(1);
+	}
+
+	result = thread_fork("schedpong", NULL, pongthread, NULL, rounds);
+	if (result) {
+		panic("schedpong: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+
+	total = max = 0;
+	for (i=0; i<rounds; i++) {
+		gettime(&start);
+		V(pingsem);
+		P(pongsem);
+		us = usecs_since(&start);
+		total += us;
+		if (us > max) {
+			max = us;
+		}
+	}
+
+	hogs_stop = true;
+	for (i=0; i<nhogs; i++) {
+		P(hogsem);
+	}
+
+	kprintf("schedpong: %u hogs: round trip avg %llu us, max %llu us\n",
+		nhogs, total / rounds, max);
+	if (nhogs > 0) {
+		kprintf("schedpong: hog levels:");
+		for (i=0; i<nhogs; i++) {
+			kprintf(" %u", hoglevel[i]);
+		}
+		kprintf(" (of %u)\n", SCHED_NLEVELS - 1);
+	}
+}
+
+/*
+ * Wakeup latency under load. Usage: sch1 [nhogs]
+ */
+int
+schedpong(int nargs, char **args)
+{
+	unsigned nhogs;
+
+	nhogs = PONG_HOGS;
+	if (nargs > 1) {
+		nhogs = atoi(args[1]);
+	}
+	if (nhogs > PONG_MAXHOGS) {
+		kprintf("Usage: sch1 [nhogs]; at most %u hogs\n",
+			PONG_MAXHOGS);
+		return EINVAL;
+	}
+
+	pingsem = sem_create("ping", 0);
+	pongsem = sem_create("pong", 0);
+	hogsem = sem_create("hogs", 0);
+	if (pingsem == NULL || pongsem == NULL || hogsem == NULL) {
+		panic("schedpong: sem_create failed\n");
+	}
+
+	kprintf("Starting scheduler latency test...\n");
+	pong_run(0, PONG_ROUNDS);
+	pong_run(nhogs, PONG_ROUNDS);
+	kprintf("Scheduler latency test done.\n");
+
+	sem_destroy(hogsem);
+	sem_destroy(pongsem);
+	sem_destroy(pingsem);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// load balancing
+
+#define STEAL_THREADS	8
+#define STEAL_MAXTHREADS	32
+#define STEAL_CHUNKS	2000
+
+struct stealrec {
+	unsigned sr_cpus;		/* Mask of cpus seen (first 32) */
+	unsigned sr_moves;		/* Times seen on a new cpu */
+	unsigned sr_lastcpu;		/* Cpu it finished on */
+};
+
+static struct semaphore *stealsem;
+static struct stealrec stealrecs[STEAL_MAXTHREADS];
+
+/*
+ * A fixed amount of CPU-bound work, noting which cpu it's on every
+ * so often.
+ */
+static
+void
+stealwork(struct stealrec *sr)
+{
+	volatile unsigned i;
+	unsigned chunk, cpu;
+
+	sr->sr_cpus = 0;
+	sr->sr_moves = 0;
+	sr->sr_lastcpu = curcpu->c_number;
+	for (chunk=0; chunk<STEAL_CHUNKS; chunk++) {
+		for (i=0; i<1000; i++);
+		cpu = curcpu->c_number;
+		if (cpu < 32) {
+			sr->sr_cpus |= (1U << cpu);
+		}
+		if (cpu != sr->sr_lastcpu) {
+			sr->sr_moves++;
+			sr->sr_lastcpu = cpu;
+		}
+	}
+}
+
+static
+void
+stealthread(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	stealwork(&stealrecs[num]);
+	V(stealsem);
+}
+
+/*
+ * Fork a pile of CPU-bound threads on one cpu and see whether the
+ * other cpus pick them up. Reports where each thread ran, how many
+ * threads each cpu stole, and the elapsed time against running the
+ * same work once by itself. Usage: sch2 [nthreads]
+ */
+int
+stealtest(int nargs, char **args)
+{
+	struct timespec start;
+	struct stealrec solo;
+	struct cpu *c;
+	unsigned nthreads, ncpus, i, j;
+	unsigned steals[32];
+	uint64_t one, all;
+	int result;
+
+	nthreads = STEAL_THREADS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nthreads == 0 || nthreads > STEAL_MAXTHREADS) {
+		kprintf("Usage: sch2 [nthreads]; 1 to %u threads\n",
+			STEAL_MAXTHREADS);
+		return EINVAL;
+	}
+
+	stealsem = sem_create("steal", 0);
+	if (stealsem == NULL) {
+		panic("stealtest: sem_create failed\n");
+	}
+
+	ncpus = cpu_count();
+	if (ncpus > 32) {
+		ncpus = 32;
+	}
+
+	kprintf("Starting load balancing test...\n");
+
+	gettime(&start);
+	stealwork(&solo);
+	one = usecs_since(&start);
+
+	for (i=0; i<ncpus; i++) {
+		steals[i] = cpu_get(i)->c_steals;
+	}
+
+	gettime(&start);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("stealtest", NULL, stealthread, NULL, i);
+		if (result) {
+			panic("stealtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(stealsem);
+	}
+	all = usecs_since(&start);
+	if (all == 0) {
+		all = 1;
+	}
+
+	for (i=0; i<nthreads; i++) {
+		kprintf("stealtest: thread %u: cpus", i);
+		for (j=0; j<ncpus; j++) {
+			if (stealrecs[i].sr_cpus & (1U << j)) {
+				kprintf(" %u", j);
+			}
+		}
+		kprintf(", %u moves\n", stealrecs[i].sr_moves);
+	}
+	kprintf("stealtest: steals by cpu:");
+	for (i=0; i<ncpus; i++) {
+		c = cpu_get(i);
+		kprintf(" %u", c->c_steals - steals[i]);
+	}
+	kprintf("\n");
+	kprintf("stealtest: 1 thread %llu us, %u threads %llu us "
+		"on %u cpus\n", one, nthreads, all, ncpus);
+	kprintf("stealtest: speedup %llu.%02llu (ideal %u)\n",
+		one * nthreads / all, (one * nthreads * 100 / all) % 100,
+		nthreads < ncpus ? nthreads : ncpus);
+	kprintf("Load balancing test done.\n");
+
+	sem_destroy(stealsem);
+	return 0;
+}
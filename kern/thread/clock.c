@@ -30,17 +30,25 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * hardclock() drives the scheduler. It runs HZ times a second on
+ * each cpu that has something to do; idle cpus turn it off (see
+ * below).
+ *
+ * Everything else that needs to happen at a particular time is a
+ * timeout. Pending timeouts live in a hierarchical timing wheel and
+ * the timer device behind timerclock() is programmed, one-shot, for
+ * the earliest of them, so timeouts fire to within the resolution of
+ * that device (microseconds for ltimer) rather than of hardclock.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -50,14 +58,371 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	100	/* Reset priorities every second. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * The timing wheel.
+ *
+ * Time is kept in microseconds. The wheel turns in units of
+ * 2^TW_UNITSHIFT usecs (about a millisecond) and has TW_LEVELS levels
+ * of TW_SLOTS slots each; a slot at level L covers TW_SLOTS^L units.
+ * A timeout goes in the lowest level whose range reaches its expiry
+ * time, and when the wheel has turned far enough it's cascaded down
+ * into a lower level. Level 0 slots hold timeouts expiring within
+ * the same unit; they're checked against the exact time. Anything
+ * past the end of the top level (about 4.8 hours) is parked in the
+ * farthest slot and gets re-sorted when it cascades.
+ *
+ * wheel_now is the unit the wheel has been turned to. Timeouts due
+ * before that are put in the current slot and run at the next
+ * timerclock().
+ *
+ * All of this is protected by timeout_lock.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+#define TW_UNITSHIFT	10
+#define TW_SLOTSHIFT	6
+#define TW_SLOTS	(1U << TW_SLOTSHIFT)
+#define TW_SLOTMASK	(TW_SLOTS - 1)
+#define TW_LEVELS	4
+#define TW_LEVELSHIFT(l)	(TW_SLOTSHIFT * (l))
+#define TW_RANGE	((uint64_t)1 << TW_LEVELSHIFT(TW_LEVELS))
+
+/* Longest we'll set the timer device for in one go (1 hour) */
+#define TIMERCLOCK_MAXALARM	3600000000U
+
+static struct spinlock timeout_lock;
+static struct timeout *tw_slots[TW_LEVELS][TW_SLOTS];
+static unsigned tw_count[TW_LEVELS];
+static unsigned tw_total;
+static uint64_t wheel_now;
+
+/*
+ * The timer device, and when it's next going to go off.
+ */
+static void *tc_devdata;
+static void (*tc_setalarm)(void *devdata, uint32_t usecs);
+static bool tc_alarmset;
+static uint64_t tc_alarmtime;
+
+/*
+ * Current time in microseconds.
+ */
+static
+uint64_t
+clock_usecs(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Put a timeout on the wheel.
+ */
+static
+void
+timeout_insert(struct timeout *to)
+{
+	uint64_t units, delta;
+	unsigned level, slot;
+
+	KASSERT(spinlock_do_i_hold(&timeout_lock));
+
+	units = to->to_when >> TW_UNITSHIFT;
+	if (units < wheel_now) {
+		units = wheel_now;
+	}
+	delta = units - wheel_now;
+	if (delta >= TW_RANGE) {
+		units = wheel_now + TW_RANGE - 1;
+		delta = TW_RANGE - 1;
+	}
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < ((uint64_t)1 << TW_LEVELSHIFT(level + 1))) {
+			break;
+		}
+	}
+	slot = (units >> TW_LEVELSHIFT(level)) & TW_SLOTMASK;
+
+	to->to_level = level;
+	to->to_prevp = &tw_slots[level][slot];
+	to->to_next = tw_slots[level][slot];
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = &to->to_next;
+	}
+	tw_slots[level][slot] = to;
+	tw_count[level]++;
+	tw_total++;
+	to->to_pending = true;
+}
+
+/*
+ * Take a timeout off the wheel.
+ */
+static
+void
+timeout_remove(struct timeout *to)
+{
+	KASSERT(spinlock_do_i_hold(&timeout_lock));
+	KASSERT(to->to_pending);
+
+	*to->to_prevp = to->to_next;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = to->to_prevp;
+	}
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	KASSERT(tw_count[to->to_level] > 0);
+	tw_count[to->to_level]--;
+	tw_total--;
+	to->to_pending = false;
+}
+
+/*
+ * Move everything in one slot at LEVEL back down the wheel.
+ */
+static
+void
+timeout_cascade(unsigned level, unsigned slot)
+{
+	struct timeout *to;
+
+	while ((to = tw_slots[level][slot]) != NULL) {
+		timeout_remove(to);
+		timeout_insert(to);
+	}
+}
+
+/*
+ * Take everything that's due (as of NOW) out of the current level 0
+ * slot and chain it onto EXPIRED through to_next.
+ */
+static
+void
+timeout_expire_slot(uint64_t now, struct timeout **expired)
+{
+	struct timeout *to, *next;
+
+	for (to = tw_slots[0][wheel_now & TW_SLOTMASK]; to != NULL; to = next) {
+		next = to->to_next;
+		if (to->to_when <= now) {
+			timeout_remove(to);
+			to->to_next = *expired;
+			*expired = to;
+		}
+	}
+}
+
+/*
+ * Turn the wheel forward to NOW, collecting expired timeouts.
+ *
+ * Rather than stepping one unit at a time, skip straight to the next
+ * point where something might happen: if the low levels are empty,
+ * nothing happens until the lowest nonempty level cascades.
+ */
+static
+void
+timeout_advance(uint64_t now, struct timeout **expired)
+{
+	uint64_t nowunits, step, next;
+	unsigned level;
+
+	nowunits = now >> TW_UNITSHIFT;
+
+	while (1) {
+		timeout_expire_slot(now, expired);
+		if (wheel_now >= nowunits) {
+			break;
+		}
+		if (tw_total == 0) {
+			wheel_now = nowunits;
+			break;
+		}
+
+		for (level = 0; tw_count[level] == 0; level++) {
+			/* nothing */
+		}
+		step = (uint64_t)1 << TW_LEVELSHIFT(level);
+		next = (wheel_now | (step - 1)) + 1;
+		if (next > nowunits) {
+			/* Nothing happens between here and now. */
+			wheel_now = nowunits;
+			continue;
+		}
+		wheel_now = next;
+
+		/* Cascade, lowest level first. */
+		for (level = 1; level < TW_LEVELS; level++) {
+			step = (uint64_t)1 << TW_LEVELSHIFT(level);
+			if ((wheel_now & (step - 1)) != 0) {
+				break;
+			}
+			timeout_cascade(level, (wheel_now >> TW_LEVELSHIFT(level))
+					& TW_SLOTMASK);
+		}
+	}
+}
+
+/*
+ * Find the earliest expiry time on one slot's list.
+ */
+static
+bool
+timeout_slotmin(struct timeout *list, uint64_t *ret)
+{
+	struct timeout *to;
+	bool found = false;
+
+	for (to = list; to != NULL; to = to->to_next) {
+		if (!found || to->to_when < *ret) {
+			*ret = to->to_when;
+			found = true;
+		}
+	}
+	return found;
+}
+
+/*
+ * Find the time the next timeout is due. Within a level, slots are
+ * in time order starting from the current position (for level 0) or
+ * just after it (for higher levels, whose current slot has already
+ * been cascaded and thus holds only things a full turn away); but
+ * levels can overlap, so check each of them.
+ */
+static
+bool
+timeout_nextdue(uint64_t *ret)
+{
+	uint64_t base, when;
+	unsigned level, i;
+	bool found = false;
+
+	for (level = 0; level < TW_LEVELS; level++) {
+		if (tw_count[level] == 0) {
+			continue;
+		}
+		base = wheel_now >> TW_LEVELSHIFT(level);
+		for (i = (level == 0) ? 0 : 1; i <= TW_SLOTS; i++) {
+			if (timeout_slotmin(tw_slots[level][(base+i) & TW_SLOTMASK],
+					    &when)) {
+				if (!found || when < *ret) {
+					*ret = when;
+					found = true;
+				}
+				break;
+			}
+		}
+	}
+	return found;
+}
+
+/*
+ * Program the timer device for the next timeout, if it isn't
+ * already set to go off in time for it.
+ */
+static
+void
+timeout_setalarm(uint64_t now)
+{
+	uint64_t when, delta;
+
+	KASSERT(spinlock_do_i_hold(&timeout_lock));
+
+	if (tc_setalarm == NULL || !timeout_nextdue(&when)) {
+		return;
+	}
+	if (tc_alarmset && tc_alarmtime <= when) {
+		return;
+	}
+
+	delta = (when > now) ? when - now : 1;
+	if (delta > TIMERCLOCK_MAXALARM) {
+		delta = TIMERCLOCK_MAXALARM;
+	}
+	tc_alarmset = true;
+	tc_alarmtime = now + delta;
+	tc_setalarm(tc_devdata, delta);
+}
+
+/*
+ * Set up a timeout.
+ */
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *data)
+{
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	to->to_when = 0;
+	to->to_level = 0;
+	to->to_pending = false;
+	to->to_func = func;
+	to->to_data = data;
+}
+
+/*
+ * Schedule a timeout to go off USECS microseconds from now. If it's
+ * already pending, reschedule it.
+ */
+void
+timeout_add(struct timeout *to, uint64_t usecs)
+{
+	uint64_t now;
+
+	spinlock_acquire(&timeout_lock);
+	now = clock_usecs();
+	if (to->to_pending) {
+		timeout_remove(to);
+	}
+	if (tw_total == 0) {
+		/* Nothing pending; the wheel might be well behind. */
+		wheel_now = now >> TW_UNITSHIFT;
+	}
+	to->to_when = now + usecs;
+	timeout_insert(to);
+	timeout_setalarm(now);
+	spinlock_release(&timeout_lock);
+}
+
+/*
+ * Cancel a timeout. Returns true if it was pending. If it returns
+ * false, the timeout has already gone off, or may be going off right
+ * now on another cpu.
+ */
+bool
+timeout_del(struct timeout *to)
+{
+	bool ret;
+
+	spinlock_acquire(&timeout_lock);
+	ret = to->to_pending;
+	if (ret) {
+		timeout_remove(to);
+	}
+	spinlock_release(&timeout_lock);
+
+	/*
+	 * Don't bother reprogramming the timer; if it goes off early
+	 * timerclock() will find nothing to do and set it again.
+	 */
+	return ret;
+}
+
+/*
+ * Called by the driver for the device that provides timerclock().
+ * SETALARM should arrange for one call to timerclock() after the
+ * given number of microseconds, replacing any previous request.
+ */
+void
+timerclock_attach(void *devdata, void (*setalarm)(void *, uint32_t))
+{
+	KASSERT(tc_setalarm == NULL);
+
+	spinlock_acquire(&timeout_lock);
+	tc_devdata = devdata;
+	tc_setalarm = setalarm;
+	spinlock_release(&timeout_lock);
+}
 
 /*
  * Setup.
@@ -65,24 +430,34 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
-	}
+	spinlock_init(&timeout_lock);
+	spinlock_profile(&timeout_lock, "timeouts");
 }
 
 /*
- * This is called once per second, on one processor, by the timer
- * code.
+ * This is called, on one processor, by the timer device when the
+ * alarm set by timeout_setalarm goes off. Run whatever is due.
  */
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
+	struct timeout *expired, *to;
+	uint64_t now;
+
+	expired = NULL;
+
+	spinlock_acquire(&timeout_lock);
+	now = clock_usecs();
+	tc_alarmset = false;
+	timeout_advance(now, &expired);
+	timeout_setalarm(now);
+	spinlock_release(&timeout_lock);
+
+	while ((to = expired) != NULL) {
+		expired = to->to_next;
+		to->to_next = NULL;
+		to->to_func(to->to_data);
+	}
 }
 
 /*
@@ -92,18 +467,99 @@ timerclock(void)
 void
 hardclock(void)
 {
+	/*
+	 * If the cpu is idle, there's nothing to schedule. Turn the
+	 * tick off; thread_switch calls hardclock_resume() when the
+	 * cpu stops idling. Idle cpus are woken by interprocessor
+	 * interrupts when work turns up.
+	 */
+	if (curcpu->c_isidle) {
+		curcpu->c_tickless = true;
+		mainbus_hardclock_stop();
+		return;
+	}
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
-	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	thread_kick_waiting();
+	if (thread_tick()) {
+		thread_yield();
+	}
+}
+
+/*
+ * Restart hardclock on a cpu that's coming out of idle.
+ */
+void
+hardclock_resume(void)
+{
+	if (curcpu->c_tickless) {
+		curcpu->c_tickless = false;
+		mainbus_hardclock_start();
+	}
+}
+
+/*
+ * Sleeping. Each sleeper gets its own wait channel so that waking
+ * one doesn't disturb any of the others.
+ */
+struct clocksleeper {
+	struct spinlock cs_lock;
+	struct wchan *cs_wchan;
+	bool cs_done;
+};
+
+static
+void
+clocksleep_wakeup(void *data)
+{
+	struct clocksleeper *cs = data;
+
+	spinlock_acquire(&cs->cs_lock);
+	cs->cs_done = true;
+	wchan_wakeone(cs->cs_wchan, &cs->cs_lock);
+	spinlock_release(&cs->cs_lock);
+}
+
+/*
+ * Suspend execution for USECS microseconds.
+ */
+void
+clockusleep(uint64_t usecs)
+{
+	struct clocksleeper cs;
+	struct timeout to;
+	uint64_t until;
+
+	cs.cs_wchan = wchan_create("clocksleep");
+	if (cs.cs_wchan == NULL) {
+		/* Out of memory; fall back to spinning politely. */
+		until = clock_usecs() + usecs;
+		while (clock_usecs() < until) {
+			thread_yield();
+		}
+		return;
+	}
+	spinlock_init(&cs.cs_lock);
+	cs.cs_done = false;
+
+	timeout_init(&to, clocksleep_wakeup, &cs);
+	timeout_add(&to, usecs);
+
+	spinlock_acquire(&cs.cs_lock);
+	while (!cs.cs_done) {
+		wchan_sleep(cs.cs_wchan, &cs.cs_lock);
+	}
+	spinlock_release(&cs.cs_lock);
+
+	spinlock_cleanup(&cs.cs_lock);
+	wchan_destroy(cs.cs_wchan);
 }
 
 /*
@@ -112,10 +568,7 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	if (num_secs > 0) {
+		clockusleep((uint64_t)num_secs * 1000000);
 	}
-	spinlock_release(&lbolt_lock);
 }
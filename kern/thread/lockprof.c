@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock contention profiler.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <current.h>
+#include <mainbus.h>
+#include <lockprof.h>
+
+/* Registry of profiled locks. This lock itself isn't on it. */
+static struct spinlock lockprof_lock = SPINLOCK_INITIALIZER;
+static struct lockprof *lockprof_list;
+
+/* Snapshot of one entry, for sorting and printing. */
+struct lockprof_entry {
+	char le_name[32];
+	unsigned le_acquires;
+	unsigned le_contended;
+	uint64_t le_waittotal;
+	uint64_t le_waitmax;
+	uint64_t le_holdmax;
+};
+
+/*
+ * Current cycle count, or 0 before curcpu exists (very early in
+ * boot, when nothing is contended anyway).
+ */
+static
+uint64_t
+lockprof_now(void)
+{
+	if (!CURCPU_EXISTS()) {
+		return 0;
+	}
+	return mainbus_cycles();
+}
+
+static
+const struct cpu *
+lockprof_cpu(void)
+{
+	return CURCPU_EXISTS() ? curcpu->c_self : NULL;
+}
+
+/*
+ * Set up LP for the lock LK. It isn't on the registry until
+ * lockprof_register is called.
+ */
+void
+lockprof_init(struct lockprof *lp, const void *lk)
+{
+	lp->lp_name = NULL;
+	lp->lp_lock = lk;
+	lp->lp_acquires = 0;
+	lp->lp_contended = 0;
+	lp->lp_waittotal = 0;
+	lp->lp_waitmax = 0;
+	lp->lp_holdmax = 0;
+	lp->lp_holdstart = 0;
+	lp->lp_holdcpu = NULL;
+	lp->lp_next = NULL;
+	lp->lp_prevp = NULL;
+}
+
+/*
+ * Add LP to the registry under NAME (which may be NULL). The lock
+ * must be cleaned up, taking it off again, before its memory is
+ * freed or reused.
+ */
+void
+lockprof_register(struct lockprof *lp, const char *name)
+{
+	struct lockprof *other;
+
+	lp->lp_name = name;
+
+	spinlock_acquire(&lockprof_lock);
+	/* Catch a lock that was reinitialized without being cleaned up */
+	for (other = lockprof_list; other != NULL; other = other->lp_next) {
+		KASSERT(other != lp);
+	}
+	lp->lp_next = lockprof_list;
+	lp->lp_prevp = &lockprof_list;
+	if (lockprof_list != NULL) {
+		lockprof_list->lp_prevp = &lp->lp_next;
+	}
+	lockprof_list = lp;
+	spinlock_release(&lockprof_lock);
+}
+
+/*
+ * Take LP off the registry.
+ */
+void
+lockprof_cleanup(struct lockprof *lp)
+{
+	if (lp->lp_prevp == NULL) {
+		/* never registered */
+		return;
+	}
+
+	spinlock_acquire(&lockprof_lock);
+	*lp->lp_prevp = lp->lp_next;
+	if (lp->lp_next != NULL) {
+		lp->lp_next->lp_prevp = lp->lp_prevp;
+	}
+	spinlock_release(&lockprof_lock);
+	lp->lp_next = NULL;
+	lp->lp_prevp = NULL;
+}
+
+/*
+ * About to try to get a lock.
+ */
+void
+lockprof_waitstart(struct lockprof_wait *lw)
+{
+	lw->lw_start = lockprof_now();
+	lw->lw_cpu = lockprof_cpu();
+	lw->lw_contended = false;
+}
+
+/*
+ * Got the lock. Must be called with it held (for sleep locks, with
+ * the lock's spinlock held too).
+ */
+void
+lockprof_acquired(struct lockprof *lp, struct lockprof_wait *lw)
+{
+	uint64_t now, wait;
+	const struct cpu *c;
+
+	now = lockprof_now();
+	c = lockprof_cpu();
+
+	lp->lp_acquires++;
+	if (lw->lw_contended) {
+		lp->lp_contended++;
+		if (c == lw->lw_cpu && now > lw->lw_start) {
+			wait = now - lw->lw_start;
+			lp->lp_waittotal += wait;
+			if (wait > lp->lp_waitmax) {
+				lp->lp_waitmax = wait;
+			}
+		}
+	}
+	lp->lp_holdstart = now;
+	lp->lp_holdcpu = c;
+}
+
+/*
+ * About to let go of the lock. Same locking as lockprof_acquired.
+ */
+void
+lockprof_released(struct lockprof *lp)
+{
+	uint64_t now, hold;
+
+	now = lockprof_now();
+	if (lockprof_cpu() == lp->lp_holdcpu && now > lp->lp_holdstart) {
+		hold = now - lp->lp_holdstart;
+		if (hold > lp->lp_holdmax) {
+			lp->lp_holdmax = hold;
+		}
+	}
+}
+
+/*
+ * Print the COUNT locks with the most total wait time. If RESET is
+ * true, zero everyone's counters afterwards.
+ *
+ * The counters are read without taking the locks they belong to, so
+ * a busy lock's numbers may be slightly inconsistent.
+ */
+void
+lockprof_dump(unsigned count, bool reset)
+{
+	struct lockprof_entry *entries, tmp;
+	struct lockprof *lp;
+	unsigned num, max, i, j;
+
+	/* Count them, then allocate outside the spinlock. */
+	spinlock_acquire(&lockprof_lock);
+	max = 0;
+	for (lp = lockprof_list; lp != NULL; lp = lp->lp_next) {
+		max++;
+	}
+	spinlock_release(&lockprof_lock);
+
+	/* Leave some room for locks created in the meantime. */
+	max += 16;
+	entries = kmalloc(max * sizeof(*entries));
+	if (entries == NULL) {
+		kprintf("lockprof: Out of memory\n");
+		return;
+	}
+
+	num = 0;
+	spinlock_acquire(&lockprof_lock);
+	for (lp = lockprof_list; lp != NULL && num < max; lp = lp->lp_next) {
+		if (lp->lp_name != NULL) {
+			snprintf(entries[num].le_name,
+				 sizeof(entries[num].le_name),
+				 "%s", lp->lp_name);
+		}
+		else {
+			snprintf(entries[num].le_name,
+				 sizeof(entries[num].le_name),
+				 "spinlock %p", lp->lp_lock);
+		}
+		entries[num].le_acquires = lp->lp_acquires;
+		entries[num].le_contended = lp->lp_contended;
+		entries[num].le_waittotal = lp->lp_waittotal;
+		entries[num].le_waitmax = lp->lp_waitmax;
+		entries[num].le_holdmax = lp->lp_holdmax;
+		num++;
+	}
+	if (reset) {
+		for (lp = lockprof_list; lp != NULL; lp = lp->lp_next) {
+			lp->lp_acquires = 0;
+			lp->lp_contended = 0;
+			lp->lp_waittotal = 0;
+			lp->lp_waitmax = 0;
+			lp->lp_holdmax = 0;
+		}
+	}
+	spinlock_release(&lockprof_lock);
+
+	/* Insertion sort, most waited-for first. */
+	for (i=1; i<num; i++) {
+		tmp = entries[i];
+		for (j=i; j>0 && entries[j-1].le_waittotal < tmp.le_waittotal;
+		     j--) {
+			entries[j] = entries[j-1];
+		}
+		entries[j] = tmp;
+	}
+
+	kprintf("%-24s %10s %10s %14s %12s %12s\n", "lock", "acquires",
+		"contended", "wait cycles", "max wait", "max hold");
+	for (i=0; i<num && i<count; i++) {
+		kprintf("%-24s %10u %10u %14llu %12llu %12llu\n",
+			entries[i].le_name,
+			entries[i].le_acquires,
+			entries[i].le_contended,
+			entries[i].le_waittotal,
+			entries[i].le_waitmax,
+			entries[i].le_holdmax);
+	}
+	kprintf("%u locks registered\n", num);
+
+	kfree(entries);
+}
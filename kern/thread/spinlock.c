@@ -30,6 +30,7 @@
 /* Make sure to build out-of-line versions of inline functions */
 #define SPINLOCK_INLINE   /* empty */
 #define MEMBAR_INLINE     /* empty */
+#define ATOMIC_INLINE     /* empty */
 
 #include <types.h>
 #include <lib.h>
@@ -37,6 +38,7 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <membar.h>
+#include <atomic.h>
 #include <current.h>	/* for curcpu */
 
 /*
@@ -52,9 +54,23 @@ spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
 	splk->splk_holder = NULL;
+	LOCKPROF_INIT(&splk->splk_prof, splk);
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
 }
 
+/*
+ * Put a spinlock on the lock profiler's list under NAME. Only for
+ * locks that are cleaned up with spinlock_cleanup, if ever, and not
+ * initialized again in between.
+ */
+void
+spinlock_profile(struct spinlock *splk, const char *name)
+{
+	(void)splk;
+	(void)name;
+	LOCKPROF_REGISTER(&splk->splk_prof, name);
+}
+
 /*
  * Clean up spinlock.
  */
@@ -63,6 +79,7 @@ spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
 	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	LOCKPROF_CLEANUP(&splk->splk_prof);
 }
 
 /*
@@ -76,6 +93,7 @@ void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	LOCKPROF_WAIT(wait);
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,6 +111,7 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
+	LOCKPROF_WAITSTART(&wait);
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -105,9 +124,11 @@ spinlock_acquire(struct spinlock *splk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&splk->splk_lock) != 0) {
+			LOCKPROF_CONTENDED(&wait);
 			continue;
 		}
 		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
+			LOCKPROF_CONTENDED(&wait);
 			continue;
 		}
 		break;
@@ -115,10 +136,57 @@ spinlock_acquire(struct spinlock *splk)
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+	LOCKPROF_ACQUIRED(&splk->splk_prof, &wait);
+
+	if (CURCPU_EXISTS()) {
+		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
+	}
+}
+
+/*
+ * Try to get the lock without spinning. Returns true, with the lock
+ * held and interrupts disabled, if it was free; returns false and
+ * leaves the interrupt state alone if not.
+ *
+ * Because this never waits it can't deadlock, so it's safe to use to
+ * take a lock that would otherwise be out of order.
+ */
+bool
+spinlock_tryacquire(struct spinlock *splk)
+{
+	struct cpu *mycpu;
+	LOCKPROF_WAIT(wait);
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		mycpu = curcpu->c_self;
+		if (splk->splk_holder == mycpu) {
+			panic("Deadlock on spinlock %p\n", splk);
+		}
+	}
+	else {
+		mycpu = NULL;
+	}
+
+	if (spinlock_data_get(&splk->splk_lock) != 0 ||
+	    spinlock_data_testandset(&splk->splk_lock) != 0) {
+		spllower(IPL_HIGH, IPL_NONE);
+		return false;
+	}
+
+	membar_store_any();
+	splk->splk_holder = mycpu;
+	LOCKPROF_WAITSTART(&wait);
+	LOCKPROF_ACQUIRED(&splk->splk_prof, &wait);
 
 	if (CURCPU_EXISTS()) {
+		mycpu->c_spinlocks++;
+		HANGMAN_WAIT(&curcpu->c_hangman, &splk->splk_hangman);
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
+	return true;
 }
 
 /*
@@ -135,6 +203,7 @@ spinlock_release(struct spinlock *splk)
 		HANGMAN_RELEASE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
 
+	LOCKPROF_RELEASED(&splk->splk_prof);
 	splk->splk_holder = NULL;
 	membar_any_store();
 	spinlock_data_set(&splk->splk_lock, 0);
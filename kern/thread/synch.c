@@ -37,6 +37,8 @@
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
+#include <membar.h>
 #include <current.h>
 #include <synch.h>
 
@@ -138,6 +140,13 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * How long to spin waiting for a lock whose holder is running on
+ * another cpu before giving up and going to sleep. This should be
+ * somewhat less than the cost of a context switch there and back.
+ */
+#define LOCK_SPIN_MAX	1000
+
 struct lock *
 lock_create(const char *name)
 {
@@ -164,6 +173,10 @@ lock_create(const char *name)
 	}
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
+	lock->lk_spinwins = 0;
+	lock->lk_blocks = 0;
+	LOCKPROF_INIT(&lock->lk_prof, lock);
+	LOCKPROF_REGISTER(&lock->lk_prof, lock->lk_name);
 
 	return lock;
 }
@@ -174,6 +187,7 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+	LOCKPROF_CLEANUP(&lock->lk_prof);
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
 
@@ -181,23 +195,81 @@ lock_destroy(struct lock *lock)
 	kfree(lock);
 }
 
+/*
+ * Check if HOLDER, which holds LOCK, is running on HOLDERCPU. We
+ * never look inside HOLDER itself unless we have lk_lock, because
+ * once it has released the lock it might exit and be freed; cpus,
+ * on the other hand, never go away.
+ */
+static
+bool
+lock_holder_running(struct lock *lock, struct thread *holder,
+		    struct cpu *holdercpu)
+{
+	return lock->lk_holder == holder &&
+		holdercpu->c_curthread == holder &&
+		!holdercpu->c_isidle;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	struct cpu *holdercpu;
+	bool spun, slept;
+	unsigned i;
+	LOCKPROF_WAIT(wait);
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
 
+	LOCKPROF_WAITSTART(&wait);
 	spinlock_acquire(&lock->lk_lock);
 
 	/* Call this (atomically) before waiting for a lock */
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
 	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
+	spun = slept = false;
+	while ((holder = lock->lk_holder) != NULL) {
+		LOCKPROF_CONTENDED(&wait);
+		holdercpu = holder->t_cpu;
+		if (!spun && holdercpu != curcpu->c_self &&
+		    lock_holder_running(lock, holder, holdercpu)) {
+			/*
+			 * The holder is running on another cpu, so
+			 * it'll probably let go soon. Spin (with
+			 * lk_lock released so it can) for a bit
+			 * before deciding to sleep. Only do this
+			 * once; if it's still held afterwards, it's
+			 * not a short critical section.
+			 */
+			spinlock_release(&lock->lk_lock);
+			for (i=0; i<LOCK_SPIN_MAX; i++) {
+				/* make sure we reread everything */
+				membar_load_load();
+				if (!lock_holder_running(lock, holder,
+							 holdercpu)) {
+					break;
+				}
+			}
+			spinlock_acquire(&lock->lk_lock);
+			spun = true;
+			continue;
+		}
+
 		/* As in the semaphore. */
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+		slept = true;
 	}
 	lock->lk_holder = curthread;
+	if (slept) {
+		lock->lk_blocks++;
+	}
+	else if (spun) {
+		lock->lk_spinwins++;
+	}
+	LOCKPROF_ACQUIRED(&lock->lk_prof, &wait);
 
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
@@ -213,6 +285,7 @@ lock_release(struct lock *lock)
 	spinlock_acquire(&lock->lk_lock);
 
 	KASSERT(lock->lk_holder == curthread);
+	LOCKPROF_RELEASED(&lock->lk_prof);
 	lock->lk_holder = NULL;
 	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
 
@@ -298,20 +371,248 @@ cv_wait(struct cv *cv, struct lock *lock)
 	lock_acquire(lock);
 }
 
+/*
+ * Wait morphing: if we hold LOCK (as we should), a waiter woken now
+ * would only go straight back to sleep in lock_acquire. So instead of
+ * waking waiters, move them onto the lock's wait channel; each
+ * lock_release then wakes one of them, which returns from cv_wait's
+ * wchan_sleep and gets the lock in the usual way. This turns a
+ * broadcast into a chain of handoffs instead of a thundering herd.
+ *
+ * The order cv_wchanlock, then lk_lock, matches cv_wait.
+ */
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-	(void)lock;
 	spinlock_acquire(&cv->cv_wchanlock);
-	wchan_wakeone(cv->cv_wchan, &cv->cv_wchanlock);
+	spinlock_acquire(&lock->lk_lock);
+	if (lock->lk_holder == curthread) {
+		wchan_transferone(cv->cv_wchan, &cv->cv_wchanlock,
+				  lock->lk_wchan, &lock->lk_lock);
+		spinlock_release(&lock->lk_lock);
+	}
+	else {
+		spinlock_release(&lock->lk_lock);
+		wchan_wakeone(cv->cv_wchan, &cv->cv_wchanlock);
+	}
 	spinlock_release(&cv->cv_wchanlock);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	(void)lock;
 	spinlock_acquire(&cv->cv_wchanlock);
-	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
+	spinlock_acquire(&lock->lk_lock);
+	if (lock->lk_holder == curthread) {
+		wchan_transferall(cv->cv_wchan, &cv->cv_wchanlock,
+				  lock->lk_wchan, &lock->lk_lock);
+		spinlock_release(&lock->lk_lock);
+	}
+	else {
+		spinlock_release(&lock->lk_lock);
+		wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
+	}
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name, int policy)
+{
+	struct rwlock *rw;
+
+	KASSERT(policy == RWLOCK_READERPREF ||
+		policy == RWLOCK_WRITERPREF ||
+		policy == RWLOCK_FAIR);
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlk_name = kstrdup(name);
+	if (rw->rwlk_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	HANGMAN_LOCKABLEINIT(&rw->rwlk_hangman, rw->rwlk_name);
+
+	rw->rwlk_rwchan = wchan_create(rw->rwlk_name);
+	if (rw->rwlk_rwchan == NULL) {
+		kfree(rw->rwlk_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rwlk_wwchan = wchan_create(rw->rwlk_name);
+	if (rw->rwlk_wwchan == NULL) {
+		wchan_destroy(rw->rwlk_rwchan);
+		kfree(rw->rwlk_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rwlk_lock);
+	rw->rwlk_policy = policy;
+	rw->rwlk_readers = 0;
+	rw->rwlk_writer = NULL;
+	rw->rwlk_rwaiting = 0;
+	rw->rwlk_wwaiting = 0;
+	rw->rwlk_readpass = 0;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rwlk_readers == 0);
+	KASSERT(rw->rwlk_writer == NULL);
+	spinlock_cleanup(&rw->rwlk_lock);
+	wchan_destroy(rw->rwlk_wwchan);
+	wchan_destroy(rw->rwlk_rwchan);
+
+	kfree(rw->rwlk_name);
+	kfree(rw);
+}
+
+/*
+ * Check if a reader has to wait.
+ */
+static
+bool
+rwlock_reader_blocked(struct rwlock *rw)
+{
+	if (rw->rwlk_writer != NULL) {
+		return true;
+	}
+	if (rw->rwlk_policy == RWLOCK_READERPREF) {
+		return false;
+	}
+	/* Stand aside for waiting writers, unless we've got a pass. */
+	return rw->rwlk_wwaiting > 0 && rw->rwlk_readpass == 0;
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rwlk_lock);
+
+	KASSERT(rw->rwlk_writer != curthread);
+
+	/* Wait for the writer, if any, as for a lock. */
+	HANGMAN_WAIT(&curthread->t_hangman, &rw->rwlk_hangman);
+
+	while (rwlock_reader_blocked(rw)) {
+		rw->rwlk_rwaiting++;
+		wchan_sleep(rw->rwlk_rwchan, &rw->rwlk_lock);
+		rw->rwlk_rwaiting--;
+	}
+	rw->rwlk_readers++;
+	if (rw->rwlk_readpass > 0) {
+		rw->rwlk_readpass--;
+	}
+
+	/* We don't track readers as holders; just stop waiting. */
+	HANGMAN_ACQUIRE(&curthread->t_hangman, &rw->rwlk_hangman);
+	HANGMAN_RELEASE(&curthread->t_hangman, &rw->rwlk_hangman);
+
+	spinlock_release(&rw->rwlk_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rwlk_lock);
+
+	KASSERT(rw->rwlk_readers > 0);
+	KASSERT(rw->rwlk_writer == NULL);
+	rw->rwlk_readers--;
+	if (rw->rwlk_readers == 0 && rw->rwlk_wwaiting > 0) {
+		wchan_wakeone(rw->rwlk_wwchan, &rw->rwlk_lock);
+	}
+
+	spinlock_release(&rw->rwlk_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rwlk_lock);
+
+	KASSERT(rw->rwlk_writer != curthread);
+
+	HANGMAN_WAIT(&curthread->t_hangman, &rw->rwlk_hangman);
+
+	while (rw->rwlk_writer != NULL || rw->rwlk_readers > 0 ||
+	       rw->rwlk_readpass > 0) {
+		rw->rwlk_wwaiting++;
+		wchan_sleep(rw->rwlk_wwchan, &rw->rwlk_lock);
+		rw->rwlk_wwaiting--;
+	}
+	rw->rwlk_writer = curthread;
+
+	HANGMAN_ACQUIRE(&curthread->t_hangman, &rw->rwlk_hangman);
+
+	spinlock_release(&rw->rwlk_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rwlk_lock);
+
+	KASSERT(rw->rwlk_writer == curthread);
+	KASSERT(rw->rwlk_readers == 0);
+	rw->rwlk_writer = NULL;
+
+	/*
+	 * Choose who goes next. Under FAIR, the readers that queued
+	 * up behind us get a pass past any waiting writers; otherwise
+	 * writers go first, except under READERPREF.
+	 */
+	if (rw->rwlk_rwaiting > 0 &&
+	    (rw->rwlk_policy != RWLOCK_WRITERPREF || rw->rwlk_wwaiting == 0)) {
+		if (rw->rwlk_policy == RWLOCK_FAIR) {
+			rw->rwlk_readpass = rw->rwlk_rwaiting;
+		}
+		wchan_wakeall(rw->rwlk_rwchan, &rw->rwlk_lock);
+	}
+	else if (rw->rwlk_wwaiting > 0) {
+		wchan_wakeone(rw->rwlk_wwchan, &rw->rwlk_lock);
+	}
+
+	HANGMAN_RELEASE(&curthread->t_hangman, &rw->rwlk_hangman);
+
+	spinlock_release(&rw->rwlk_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rwlk_lock);
+	ret = (rw->rwlk_writer == curthread);
+	spinlock_release(&rw->rwlk_lock);
+
+	return ret;
+}
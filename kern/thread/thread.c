@@ -49,6 +49,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
@@ -72,6 +73,10 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Load balancing; see below. */
+static bool thread_steal(unsigned minwait);
+static void thread_kick_idle(struct cpu *busy, unsigned count);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -144,6 +149,9 @@ thread_create(const char *name)
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_lastran = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -169,6 +177,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -182,10 +191,16 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_tickless = false;
+	c->c_steals = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
 	spinlock_init(&c->c_runqueue_lock);
+	spinlock_profile(&c->c_runqueue_lock, "runqueue");
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -317,6 +332,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *tl;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -331,9 +349,13 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		tl = &curcpu->c_runqueue[i];
+		tl->tl_count = 0;
+		tl->tl_head.tln_next = &tl->tl_tail;
+		tl->tl_tail.tln_prev = &tl->tl_head;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -423,6 +445,27 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+/*
+ * Number of cpus.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Get cpu number NUM, or NULL if there isn't one.
+ */
+struct cpu *
+cpu_get(unsigned num)
+{
+	if (num >= cpuarray_num(&allcpus)) {
+		return NULL;
+	}
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -445,6 +488,119 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. The caller must hold the cpu's runqueue lock.
+ *
+ * runqueue_add puts a thread on the end of the queue for its
+ * priority level. runqueue_remhead takes the first thread from the
+ * highest-priority nonempty level; runqueue_remtail takes the last
+ * thread from the lowest-priority nonempty level.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runcount++;
+}
+
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Put a thread on its cpu's run queue. The run queue must be locked.
+ */
+static
+void
+thread_make_ready(struct cpu *targetcpu, struct thread *target)
+{
+	KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
+	KASSERT(target->t_cpu == targetcpu);
+
+	/*
+	 * If the thread is being woken up (from wchan_wakeone or
+	 * wchan_wakeall), it blocked before using up its quantum, so
+	 * it's behaving like an I/O-bound thread. Move it up a level.
+	 * (We hold the runqueue lock the sleeper held until it was
+	 * switched out, so t_state is reliably S_SLEEP here.)
+	 */
+	if (target->t_state == S_SLEEP && target->t_priority > 0) {
+		target->t_priority--;
+		target->t_ticks = 0;
+	}
+
+	/* Target thread is now ready to run; put it on the run queue. */
+	target->t_state = S_READY;
+	runqueue_add(targetcpu, target);
+}
+
+/*
+ * Having put COUNT threads on TARGETCPU's run queue, make sure
+ * someone notices. If none of them is curthread, they all have to
+ * wait for something. The run queue must be locked.
+ */
+static
+void
+thread_notify_ready(struct cpu *targetcpu, unsigned count, bool hascur)
+{
+	KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
+
+	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
+		/*
+		 * Other processor is idle; send interrupt to make
+		 * sure it unidles.
+		 */
+		ipi_send(targetcpu, IPI_UNIDLE);
+	}
+	else if (!targetcpu->c_isidle && !hascur) {
+		/*
+		 * The target is busy, so the threads will have to
+		 * wait. Idle cpus don't get hardclocks, so they won't
+		 * notice this by themselves; wake some up so they can
+		 * come and steal them.
+		 */
+		thread_kick_idle(targetcpu, count);
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -467,17 +623,8 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
-	/* Target thread is now ready to run; put it on the run queue. */
-	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
-
-	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
-		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
-		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
-	}
+	thread_make_ready(targetcpu, target);
+	thread_notify_ready(targetcpu, 1, target == curthread);
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -590,8 +737,23 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
+	/*
+	 * Remember when we stopped running here, so the work stealing
+	 * code can tell whether we're still cache-hot.
+	 */
+	cur->t_lastran = curcpu->c_hardclocks;
+
+	/*
+	 * If we're yielding and nothing else is runnable here, see if
+	 * there's a heavily loaded cpu we can take some work from.
+	 * (If we're going to sleep we'll do that below when idle.)
+	 */
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
+		thread_steal(2);
+	}
+
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -625,7 +787,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call cpu_idle().
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and failing that call cpu_idle().
 	 * curcpu->c_isidle must be true when cpu_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -644,7 +807,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
+		if (next == NULL && thread_steal(1)) {
+			continue;
+		}
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
 			cpu_idle();
@@ -653,6 +819,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	/* If the tick was stopped while we were idle, restart it. */
+	hardclock_resume();
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -821,139 +990,275 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multilevel feedback queue. Each cpu has SCHED_NLEVELS
+ * run queues; thread_switch always picks the first thread from the
+ * highest-priority (lowest-numbered) nonempty level, and threads at
+ * the same level run round-robin.
+ *
+ * New threads start at level 0. A thread's quantum at level N is
+ * SCHED_QUANTUM(N) hardclocks; a thread that uses up its quantum
+ * drops one level (and gets a longer quantum next time), so CPU
+ * hogs sink to the bottom. A thread that sleeps and is woken before
+ * its quantum runs out moves up a level (see thread_make_runnable),
+ * so interactive and I/O-bound threads float to the top.
+ *
+ * To keep the hogs from starving, schedule() periodically moves
+ * every thread on the cpu back to level 0.
+ */
+
+/* Quantum, in hardclocks, at scheduler level L. */
+#define SCHED_QUANTUM(l)	(1U << (l))
+
+/*
+ * Charge the current thread for a hardclock, demoting it if it has
+ * used up its quantum. This is called from hardclock() on every
+ * tick; returns true if the current thread should yield, either
+ * because its quantum ran out or because a thread with higher
+ * priority is waiting.
  */
+bool
+thread_tick(void)
+{
+	struct thread *cur;
+	bool expired, preempt;
+	unsigned i;
+
+	cur = curthread;
 
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	if (curcpu->c_isidle) {
+		/* Interrupted the idle loop; nothing to charge. */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return false;
+	}
+
+	expired = false;
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		expired = true;
+	}
+
+	preempt = false;
+	for (i=0; i<cur->t_priority; i++) {
+		if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+			preempt = true;
+			break;
+		}
+	}
+
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return expired || preempt;
+}
+
+/*
+ * Anti-starvation reset. This is called periodically from
+ * hardclock(); it moves every thread on the current cpu back to the
+ * top priority level, so threads that have sunk to the bottom get to
+ * run again and threads whose behavior has changed get reclassified.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct threadlist *top;
+	struct thread *t;
+	unsigned i;
+
+	top = &curcpu->c_runqueue[0];
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i])) != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(top, t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
- * Thread migration.
+ * Load balancing by work stealing.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * A cpu whose run queue is empty looks for the cpu with the most
+ * waiting threads and pulls one across. Idle cpus do this every time
+ * they wake up (thread_kick_idle wakes one when a busy cpu gets a
+ * thread waiting, since idle cpus don't get hardclocks). That one
+ * try can fail, so a busy cpu with threads waiting also kicks idle
+ * cpus from its hardclock (thread_kick_waiting) until its queue
+ * drains; otherwise CPU-bound threads that never sleep would never
+ * produce another kick and could wait forever. Busy cpus with
+ * nothing else queued do it when their thread yields, but only from
+ * cpus with at least two threads waiting, so two busy cpus don't
+ * just trade a thread back and forth.
+ *
+ * The busiest cpu is found by reading the c_runcount fields without
+ * locking; this is only a hint and is rechecked once we have the
+ * lock. The caller holds its own runqueue lock, so the other cpu's
+ * is taken with spinlock_tryacquire: two cpus stealing from each
+ * other at once with spinlock_acquire would deadlock. If it's busy
+ * we just give up; we'll be back soon enough.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * which is fairly slow. So we don't take threads that have run within
+ * the last STEAL_HOT_HARDCLOCKS ticks of the other cpu, and otherwise
+ * take from the lowest priority level (the CPU-bound threads, which
+ * gain the most from another cpu) first.
+ */
+
+#define STEAL_HOT_HARDCLOCKS	2
+
+/*
+ * Pick a thread on VICTIM's run queue to steal, or NULL if there
+ * isn't a suitable one.
+ */
+static
+struct thread *
+thread_steal_choose(struct cpu *victim)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&victim->c_runqueue_lock));
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		THREADLIST_FORALL_REV(t, victim->c_runqueue[i]) {
+			/*
+			 * Ordinarily, the other cpu's curthread will
+			 * not appear on its run queue. However, it can
+			 * if it went to sleep, the cpu went idle so it
+			 * remained curthread, and it was then woken up
+			 * before the cpu has fully unidled. Migrating
+			 * it in that state can cause bad things to
+			 * happen, so leave it alone.
+			 */
+			if (t == victim->c_curthread) {
+				continue;
+			}
+			if (victim->c_hardclocks - t->t_lastran <
+			    STEAL_HOT_HARDCLOCKS) {
+				/* still cache-hot */
+				continue;
+			}
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Wake up to COUNT idle cpus (other than BUSY and ourselves), if
+ * there are any, so they can steal work. The c_isidle reads are
+ * unlocked; the worst that can happen is an unnecessary interrupt or
+ * a missed chance that gets picked up on the busy cpu's next
+ * hardclock.
  */
+static
 void
-thread_consider_migration(void)
+thread_kick_idle(struct cpu *busy, unsigned count)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
 	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	unsigned i, numcpus;
 
-	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
+	for (i=0; i<numcpus && count > 0; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c == busy || c == curcpu->c_self) {
+			continue;
+		}
+		if (c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			count--;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
-	}
+/*
+ * Called from hardclock. If threads are waiting here, keep kicking
+ * idle cpus so they retry stealing them. The c_runcount read is
+ * unlocked; it's only a hint.
+ */
+void
+thread_kick_waiting(void)
+{
+	unsigned count;
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	count = curcpu->c_runcount;
+	if (count > 0) {
+		thread_kick_idle(curcpu->c_self, count);
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+}
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+/*
+ * Try to move one thread from the busiest other cpu to the current
+ * cpu's run queue. Only cpus with at least MINWAIT threads waiting
+ * are considered. Returns true if a thread was stolen.
+ */
+static
+bool
+thread_steal(unsigned minwait)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, most;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		if (c == curcpu->c_self) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		if (c->c_runcount > most) {
+			most = c->c_runcount;
+			victim = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+	}
+	if (victim == NULL || most < minwait) {
+		return false;
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	if (!spinlock_tryacquire(&victim->c_runqueue_lock)) {
+		return false;
+	}
+	t = NULL;
+	if (victim->c_runcount >= minwait) {
+		t = thread_steal_choose(victim);
+	}
+	if (t != NULL) {
+		threadlist_remove(&victim->c_runqueue[t->t_priority], t);
+		victim->c_runcount--;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return false;
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	/*
+	 * t_lastran was in the victim's ticks; restart it in ours, so
+	 * the thread counts as hot here and isn't pulled straight off
+	 * again.
+	 */
+	t->t_lastran = curcpu->c_hardclocks;
+	t->t_cpu = curcpu->c_self;
+	runqueue_add(curcpu->c_self, t);
+	curcpu->c_steals++;
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return true;
 }
 
 ////////////////////////////////////////////////////////////
@@ -1055,11 +1360,14 @@ void
 wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
-	struct threadlist list;
+	struct threadlist list, others;
+	struct cpu *targetcpu;
+	unsigned count;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
 	threadlist_init(&list);
+	threadlist_init(&others);
 
 	/*
 	 * Grab all the threads from the channel, moving them to a
@@ -1070,17 +1378,79 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	}
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Wake them up one cpu at a time: take the cpu of the first
+	 * thread left, lock its run queue once, and put every thread
+	 * bound for that cpu on it, setting the rest aside for the
+	 * next pass. Then send at most one round of IPIs for the
+	 * batch. The passes are O(sleepers * cpus), which is fine
+	 * for the numbers of either we have.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		targetcpu = target->t_cpu;
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+
+		thread_make_ready(targetcpu, target);
+		count = 1;
+		while ((target = threadlist_remhead(&list)) != NULL) {
+			if (target->t_cpu == targetcpu) {
+				thread_make_ready(targetcpu, target);
+				count++;
+			}
+			else {
+				threadlist_addtail(&others, target);
+			}
+		}
+		thread_notify_ready(targetcpu, count, false);
+
+		spinlock_release(&targetcpu->c_runqueue_lock);
+
+		while ((target = threadlist_remhead(&others)) != NULL) {
+			threadlist_addtail(&list, target);
+		}
 	}
 
+	threadlist_cleanup(&others);
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Move one thread, or all threads, sleeping on wait channel FROM onto
+ * wait channel TO without waking them. They will be woken by
+ * whatever wakes TO, and return from wchan_sleep reacquiring the
+ * spinlock they originally went to sleep with, same as always. Both
+ * spinlocks must be held (FROMLK first).
+ */
+void
+wchan_transferone(struct wchan *from, struct spinlock *fromlk,
+		  struct wchan *to, struct spinlock *tolk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	target = threadlist_remhead(&from->wc_threads);
+	if (target != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+	}
+}
+
+void
+wchan_transferall(struct wchan *from, struct spinlock *fromlk,
+		  struct wchan *to, struct spinlock *tolk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	while ((target = threadlist_remhead(&from->wc_threads)) != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+	}
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -0,0 +1,478 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Disk request queue. See diskq.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <diskq.h>
+
+/* How long (in msec) a request can wait before it goes next anyway */
+#define DISKQ_DEADLINE	500
+
+/*
+ * Most iovecs in one merged transfer. They go on the worker thread's
+ * stack, which has nothing else much on it.
+ */
+#define DISKQ_MAXIOV	32
+
+/* Most bytes in one merged transfer */
+#define DISKQ_MAXXFER	(64*1024)
+
+/*
+ * A waiting request. These live on the requesting thread's stack.
+ */
+struct diskq_req {
+	struct uio *dr_uio;
+	off_t dr_start;			/* byte offset on the device */
+	size_t dr_len;			/* number of bytes */
+	struct timespec dr_queued;	/* when it arrived */
+	struct diskq_req *dr_next;	/* queue, or merged transfer */
+	bool dr_done;			/* set by the worker when finished */
+	int dr_result;
+};
+
+struct diskq {
+	char *dq_name;
+	unsigned dq_sectsize;
+	int (*dq_doio)(void *data, struct uio *uio);
+	void *dq_data;
+
+	struct lock *dq_lock;		/* protects everything below */
+	struct cv *dq_workcv;		/* worker waits here for requests */
+	struct cv *dq_donecv;		/* requesters wait here */
+	struct diskq_req *dq_head;	/* waiting requests, oldest first */
+	struct diskq_req *dq_tail;
+	unsigned dq_depth;		/* number of waiting requests */
+	off_t dq_headpos;		/* where the last transfer ended */
+
+	/* Statistics */
+	unsigned dq_nreqs;		/* requests queued */
+	unsigned dq_nxfers;		/* transfers done */
+	unsigned dq_nmerged;		/* requests merged into another's */
+	unsigned dq_nlate;		/* requests picked on the deadline */
+	unsigned dq_maxdepth;		/* most requests waiting at once */
+	uint64_t dq_totdepth;		/* total of depth seen on arrival */
+	uint64_t dq_totwait;		/* total usecs, arrival to finish */
+	uint64_t dq_maxwait;		/* longest usecs, arrival to finish */
+
+	struct diskq *dq_nextq;		/* list of all queues */
+};
+
+/*
+ * All the queues, for diskq_printstats. Queues are made as devices
+ * attach at boot, and never go away, so this doesn't need a lock.
+ */
+static struct diskq *diskq_all;
+
+/*
+ * Microseconds from THEN to NOW.
+ */
+static
+uint64_t
+diskq_usecs(const struct timespec *then, const struct timespec *now)
+{
+	struct timespec diff;
+
+	timespec_sub(now, then, &diff);
+	return diff.tv_sec * (uint64_t)1000000 + diff.tv_nsec / 1000;
+}
+
+/*
+ * Take a request off the queue.
+ */
+static
+void
+diskq_remove(struct diskq *dq, struct diskq_req *req)
+{
+	struct diskq_req **rp, *prev;
+
+	prev = NULL;
+	for (rp = &dq->dq_head; *rp != req; rp = &(*rp)->dr_next) {
+		KASSERT(*rp != NULL);
+		prev = *rp;
+	}
+	*rp = req->dr_next;
+	if (dq->dq_tail == req) {
+		dq->dq_tail = prev;
+	}
+	req->dr_next = NULL;
+	KASSERT(dq->dq_depth > 0);
+	dq->dq_depth--;
+}
+
+/*
+ * Choose the next request to do: the oldest, if it's past the
+ * deadline; otherwise the first one at or after where the disk head
+ * is now, or failing that, the lowest one (C-LOOK).
+ */
+static
+struct diskq_req *
+diskq_choose(struct diskq *dq)
+{
+	struct diskq_req *req, *ahead, *lowest;
+	struct timespec now;
+
+	KASSERT(dq->dq_head != NULL);
+
+	gettime(&now);
+	if (diskq_usecs(&dq->dq_head->dr_queued, &now) >
+	    DISKQ_DEADLINE * (uint64_t)1000) {
+		dq->dq_nlate++;
+		return dq->dq_head;
+	}
+
+	ahead = lowest = NULL;
+	for (req = dq->dq_head; req != NULL; req = req->dr_next) {
+		if (req->dr_start >= dq->dq_headpos &&
+		    (ahead == NULL || req->dr_start < ahead->dr_start)) {
+			ahead = req;
+		}
+		if (lowest == NULL || req->dr_start < lowest->dr_start) {
+			lowest = req;
+		}
+	}
+	return ahead != NULL ? ahead : lowest;
+}
+
+/*
+ * Find a waiting request that starts where REQ ends and goes the
+ * same direction, and that we can add to a transfer that has NIOV
+ * iovecs and LEN bytes so far.
+ */
+static
+struct diskq_req *
+diskq_findmerge(struct diskq *dq, struct diskq_req *req,
+		unsigned niov, size_t len)
+{
+	struct diskq_req *next;
+
+	for (next = dq->dq_head; next != NULL; next = next->dr_next) {
+		if (next->dr_start == req->dr_start + (off_t)req->dr_len &&
+		    next->dr_uio->uio_rw == req->dr_uio->uio_rw &&
+		    niov + next->dr_uio->uio_iovcnt <= DISKQ_MAXIOV &&
+		    len + next->dr_len <= DISKQ_MAXXFER) {
+			return next;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Advance UIO by LEN bytes, as if uiomove had done them. For handing
+ * each request its share of a merged transfer.
+ */
+static
+void
+diskq_uioskip(struct uio *uio, size_t len)
+{
+	struct iovec *iov;
+	size_t amt;
+
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+	KASSERT(len <= uio->uio_resid);
+
+	while (len > 0) {
+		iov = uio->uio_iov;
+		if (iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			KASSERT(uio->uio_iovcnt > 0);
+			continue;
+		}
+		amt = iov->iov_len < len ? iov->iov_len : len;
+		iov->iov_kbase = (char *)iov->iov_kbase + amt;
+		iov->iov_len -= amt;
+		uio->uio_resid -= amt;
+		uio->uio_offset += amt;
+		len -= amt;
+	}
+}
+
+/*
+ * Do a list of requests for consecutive sectors (linked through
+ * dr_next) as one transfer, and set each one's result. Called
+ * without dq_lock.
+ */
+static
+void
+diskq_transfer(struct diskq *dq, struct diskq_req *first)
+{
+	struct iovec iov[DISKQ_MAXIOV];
+	struct uio ku;
+	struct diskq_req *req;
+	unsigned niov, i;
+	size_t done, amt;
+	int result;
+
+	if (first->dr_next == NULL) {
+		/* Just the one; no need to copy anything */
+		first->dr_result = dq->dq_doio(dq->dq_data, first->dr_uio);
+		return;
+	}
+
+	niov = 0;
+	for (req = first; req != NULL; req = req->dr_next) {
+		for (i=0; i<req->dr_uio->uio_iovcnt; i++) {
+			KASSERT(niov < DISKQ_MAXIOV);
+			iov[niov++] = req->dr_uio->uio_iov[i];
+		}
+	}
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = niov;
+	ku.uio_offset = first->dr_start;
+	ku.uio_resid = 0;
+	for (req = first; req != NULL; req = req->dr_next) {
+		ku.uio_resid += req->dr_len;
+	}
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = first->dr_uio->uio_rw;
+	ku.uio_space = NULL;
+
+	done = ku.uio_resid;
+	result = dq->dq_doio(dq->dq_data, &ku);
+	done -= ku.uio_resid;
+
+	/*
+	 * Everything up to where it stopped got done; anything after
+	 * that gets the error.
+	 */
+	for (req = first; req != NULL; req = req->dr_next) {
+		amt = done < req->dr_len ? done : req->dr_len;
+		diskq_uioskip(req->dr_uio, amt);
+		done -= amt;
+		req->dr_result = req->dr_uio->uio_resid == 0 ? 0 : result;
+	}
+}
+
+/*
+ * Worker thread: take requests off the queue and do them.
+ */
+static
+void
+diskq_worker(void *vdq, unsigned long unused)
+{
+	struct diskq *dq = vdq;
+	struct diskq_req *first, *last, *req, *next;
+	struct timespec now;
+	unsigned niov;
+	size_t len;
+	uint64_t wait;
+
+	(void)unused;
+
+	lock_acquire(dq->dq_lock);
+	while (1) {
+		while (dq->dq_head == NULL) {
+			cv_wait(dq->dq_workcv, dq->dq_lock);
+		}
+
+		/* Pick one, then add any that continue where it ends */
+		first = last = diskq_choose(dq);
+		diskq_remove(dq, first);
+		niov = first->dr_uio->uio_iovcnt;
+		len = first->dr_len;
+		while ((req = diskq_findmerge(dq, last, niov, len)) != NULL) {
+			diskq_remove(dq, req);
+			last->dr_next = req;
+			last = req;
+			niov += req->dr_uio->uio_iovcnt;
+			len += req->dr_len;
+			dq->dq_nmerged++;
+		}
+		dq->dq_headpos = last->dr_start + last->dr_len;
+		dq->dq_nxfers++;
+
+		lock_release(dq->dq_lock);
+		diskq_transfer(dq, first);
+		lock_acquire(dq->dq_lock);
+
+		/* The requests vanish once they're marked done. */
+		gettime(&now);
+		for (req = first; req != NULL; req = next) {
+			next = req->dr_next;
+			wait = diskq_usecs(&req->dr_queued, &now);
+			dq->dq_totwait += wait;
+			if (wait > dq->dq_maxwait) {
+				dq->dq_maxwait = wait;
+			}
+			req->dr_done = true;
+		}
+		cv_broadcast(dq->dq_donecv, dq->dq_lock);
+	}
+}
+
+/*
+ * Queue an I/O request and wait for the worker to do it.
+ */
+int
+diskq_io(struct diskq *dq, struct uio *uio)
+{
+	struct diskq_req req;
+
+	if (uio->uio_segflg != UIO_SYSSPACE || uio->uio_resid == 0 ||
+	    uio->uio_offset % dq->dq_sectsize != 0 ||
+	    uio->uio_resid % dq->dq_sectsize != 0) {
+		/* Not ours to deal with; let the driver sort it out */
+		return dq->dq_doio(dq->dq_data, uio);
+	}
+
+	req.dr_uio = uio;
+	req.dr_start = uio->uio_offset;
+	req.dr_len = uio->uio_resid;
+	gettime(&req.dr_queued);
+	req.dr_next = NULL;
+	req.dr_done = false;
+	req.dr_result = 0;
+
+	lock_acquire(dq->dq_lock);
+	if (dq->dq_tail == NULL) {
+		dq->dq_head = &req;
+	}
+	else {
+		dq->dq_tail->dr_next = &req;
+	}
+	dq->dq_tail = &req;
+	dq->dq_depth++;
+
+	dq->dq_nreqs++;
+	dq->dq_totdepth += dq->dq_depth;
+	if (dq->dq_depth > dq->dq_maxdepth) {
+		dq->dq_maxdepth = dq->dq_depth;
+	}
+
+	cv_signal(dq->dq_workcv, dq->dq_lock);
+	while (!req.dr_done) {
+		cv_wait(dq->dq_donecv, dq->dq_lock);
+	}
+	lock_release(dq->dq_lock);
+
+	return req.dr_result;
+}
+
+/*
+ * Print statistics for all the queues.
+ */
+void
+diskq_printstats(void)
+{
+	struct diskq *dq;
+	unsigned avg;
+
+	for (dq = diskq_all; dq != NULL; dq = dq->dq_nextq) {
+		lock_acquire(dq->dq_lock);
+		kprintf("%s: %u requests in %u transfers (%u merged), "
+			"%u past deadline\n", dq->dq_name, dq->dq_nreqs,
+			dq->dq_nxfers, dq->dq_nmerged, dq->dq_nlate);
+		avg = dq->dq_nreqs ? dq->dq_totdepth * 100 / dq->dq_nreqs : 0;
+		kprintf("    queue depth %u now, %u max, %u.%02u average\n",
+			dq->dq_depth, dq->dq_maxdepth, avg / 100, avg % 100);
+		kprintf("    latency %llu usec average, %llu max\n",
+			dq->dq_nreqs ?
+			(unsigned long long)(dq->dq_totwait / dq->dq_nreqs) :
+			0ULL,
+			(unsigned long long)dq->dq_maxwait);
+		lock_release(dq->dq_lock);
+	}
+}
+
+/*
+ * Make a queue and start its worker.
+ */
+struct diskq *
+diskq_create(const char *name, unsigned sectsize,
+	     int (*doio)(void *data, struct uio *uio), void *data)
+{
+	struct diskq *dq;
+	int result;
+
+	dq = kmalloc(sizeof(*dq));
+	if (dq == NULL) {
+		return NULL;
+	}
+	dq->dq_name = kstrdup(name);
+	if (dq->dq_name == NULL) {
+		goto fail;
+	}
+	dq->dq_lock = lock_create(name);
+	if (dq->dq_lock == NULL) {
+		goto fail_name;
+	}
+	dq->dq_workcv = cv_create(name);
+	if (dq->dq_workcv == NULL) {
+		goto fail_lock;
+	}
+	dq->dq_donecv = cv_create(name);
+	if (dq->dq_donecv == NULL) {
+		goto fail_workcv;
+	}
+
+	dq->dq_sectsize = sectsize;
+	dq->dq_doio = doio;
+	dq->dq_data = data;
+	dq->dq_head = dq->dq_tail = NULL;
+	dq->dq_depth = 0;
+	dq->dq_headpos = 0;
+	dq->dq_nreqs = 0;
+	dq->dq_nxfers = 0;
+	dq->dq_nmerged = 0;
+	dq->dq_nlate = 0;
+	dq->dq_maxdepth = 0;
+	dq->dq_totdepth = 0;
+	dq->dq_totwait = 0;
+	dq->dq_maxwait = 0;
+
+	result = thread_fork(dq->dq_name, NULL, diskq_worker, dq, 0);
+	if (result) {
+		goto fail_donecv;
+	}
+
+	dq->dq_nextq = diskq_all;
+	diskq_all = dq;
+	return dq;
+
+ fail_donecv:
+	cv_destroy(dq->dq_donecv);
+ fail_workcv:
+	cv_destroy(dq->dq_workcv);
+ fail_lock:
+	lock_destroy(dq->dq_lock);
+ fail_name:
+	kfree(dq->dq_name);
+ fail:
+	kfree(dq);
+	return NULL;
+}
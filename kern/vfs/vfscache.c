@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VFS name cache.
+ *
+ * This remembers the results of recent lookups of single pathname
+ * components: (directory vnode, name) -> vnode, or (directory vnode,
+ * name) -> "no such file" (a negative entry), so that opening or
+ * stat'ing the same names over and over doesn't have to go into the
+ * filesystem each time. Only names with no slash in them are cached;
+ * the filesystem still resolves multi-component paths itself.
+ *
+ * An entry holds a reference to both its directory and its vnode, so
+ * neither can be reclaimed and have its memory reused while the entry
+ * exists. The operations in vfspath.c that add or remove names drop
+ * the affected entries when they finish, and vfs_unmount drops all
+ * entries for a volume before unmounting it.
+ *
+ * A lookup that misses does the real lookup without the cache lock
+ * held, and another thread might create or remove the name
+ * meanwhile. So every removal bumps nc_gen, and an entry is only
+ * added if nc_gen is still what it was when the lookup missed.
+ *
+ * References are dropped only after nc_lock is released, because
+ * dropping the last one can call into the filesystem to reclaim the
+ * vnode.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/* Number of entries */
+#define NC_SIZE		128
+
+/* Number of hash buckets */
+#define NC_HASHSIZE	64
+
+/* Longest name cached; most names are short */
+#define NC_NAMELEN	31
+
+struct namecache {
+	struct vnode *nc_dir;		/* directory, or NULL if unused */
+	struct vnode *nc_vn;		/* result, or NULL if negative */
+	struct namecache *nc_hashnext;	/* hash chain */
+	struct namecache *nc_lruprev;	/* LRU list, oldest first */
+	struct namecache *nc_lrunext;
+	char nc_name[NC_NAMELEN+1];
+};
+
+static struct lock *nc_lock;
+static struct namecache nc_entries[NC_SIZE];
+static struct namecache *nc_hash[NC_HASHSIZE];
+static struct namecache *nc_lruhead, *nc_lrutail;
+static unsigned nc_gen;
+
+/* Statistics */
+static unsigned nc_hits, nc_neghits, nc_misses, nc_enters, nc_removes;
+
+static
+unsigned
+nc_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned hash = (uintptr_t)dir >> 4;
+
+	while (*name) {
+		hash = hash*31 + (unsigned char)*name++;
+	}
+	return hash % NC_HASHSIZE;
+}
+
+static
+void
+nc_lru_remove(struct namecache *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		nc_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		nc_lrutail = nc->nc_lruprev;
+	}
+}
+
+/* Make NC the most recently used */
+static
+void
+nc_lru_touch(struct namecache *nc)
+{
+	nc_lru_remove(nc);
+	nc->nc_lrunext = NULL;
+	nc->nc_lruprev = nc_lrutail;
+	if (nc_lrutail != NULL) {
+		nc_lrutail->nc_lrunext = nc;
+	}
+	else {
+		nc_lruhead = nc;
+	}
+	nc_lrutail = nc;
+}
+
+/* Make NC the next to be reused */
+static
+void
+nc_lru_demote(struct namecache *nc)
+{
+	nc_lru_remove(nc);
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = nc_lruhead;
+	if (nc_lruhead != NULL) {
+		nc_lruhead->nc_lruprev = nc;
+	}
+	else {
+		nc_lrutail = nc;
+	}
+	nc_lruhead = nc;
+}
+
+static
+struct namecache *
+nc_find(struct vnode *dir, const char *name)
+{
+	struct namecache *nc;
+
+	KASSERT(lock_do_i_hold(nc_lock));
+
+	for (nc = nc_hash[nc_hashfunc(dir, name)]; nc != NULL;
+	     nc = nc->nc_hashnext) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take NC out of the cache. Hands back the references it held, for
+ * the caller to drop once nc_lock is released.
+ */
+static
+void
+nc_evict(struct namecache *nc, struct vnode **dir, struct vnode **vn)
+{
+	struct namecache **ncp;
+
+	KASSERT(lock_do_i_hold(nc_lock));
+	KASSERT(nc->nc_dir != NULL);
+
+	ncp = &nc_hash[nc_hashfunc(nc->nc_dir, nc->nc_name)];
+	while (*ncp != nc) {
+		KASSERT(*ncp != NULL);
+		ncp = &(*ncp)->nc_hashnext;
+	}
+	*ncp = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+
+	*dir = nc->nc_dir;
+	*vn = nc->nc_vn;
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+	nc_lru_demote(nc);
+}
+
+static
+void
+nc_drop(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Look up NAME in DIR in the cache. Returns 0 and a new reference to
+ * the vnode on a hit, ENOENT on a negative hit, and EAGAIN on a miss.
+ * On a miss, hands back in GEN what to pass to nc_enter.
+ */
+static
+int
+nc_lookup(struct vnode *dir, const char *name,
+	  struct vnode **ret, unsigned *gen)
+{
+	struct namecache *nc;
+	int result;
+
+	lock_acquire(nc_lock);
+	nc = nc_find(dir, name);
+	if (nc == NULL) {
+		nc_misses++;
+		*gen = nc_gen;
+		result = EAGAIN;
+	}
+	else if (nc->nc_vn == NULL) {
+		nc_neghits++;
+		nc_lru_touch(nc);
+		result = ENOENT;
+	}
+	else {
+		nc_hits++;
+		nc_lru_touch(nc);
+		VOP_INCREF(nc->nc_vn);
+		*ret = nc->nc_vn;
+		result = 0;
+	}
+	lock_release(nc_lock);
+	return result;
+}
+
+/*
+ * Record that NAME in DIR is VN, or doesn't exist if VN is NULL,
+ * unless something has been removed from the cache since the lookup
+ * that returned GEN.
+ */
+static
+void
+nc_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	 unsigned gen)
+{
+	struct namecache *nc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	unsigned h;
+
+	lock_acquire(nc_lock);
+	if (gen != nc_gen || nc_find(dir, name) != NULL) {
+		lock_release(nc_lock);
+		return;
+	}
+
+	nc = nc_lruhead;
+	if (nc->nc_dir != NULL) {
+		nc_evict(nc, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	nc->nc_dir = dir;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	nc->nc_vn = vn;
+	strcpy(nc->nc_name, name);
+
+	h = nc_hashfunc(dir, name);
+	nc->nc_hashnext = nc_hash[h];
+	nc_hash[h] = nc;
+	nc_lru_touch(nc);
+	nc_enters++;
+	lock_release(nc_lock);
+
+	nc_drop(olddir, oldvn);
+}
+
+/*
+ * Like VOP_LOOKUP, but consult the cache first, and remember the
+ * answer if it had to ask the filesystem.
+ */
+int
+vfs_namecache_lookup(struct vnode *dir, char *name, struct vnode **ret)
+{
+	char namecopy[NC_NAMELEN+1];
+	unsigned gen;
+	int result;
+
+	if (strlen(name) > NC_NAMELEN || strchr(name, '/') != NULL) {
+		return VOP_LOOKUP(dir, name, ret);
+	}
+
+	/* VOP_LOOKUP may destroy the name */
+	strcpy(namecopy, name);
+
+	result = nc_lookup(dir, namecopy, ret, &gen);
+	if (result != EAGAIN) {
+		return result;
+	}
+
+	result = VOP_LOOKUP(dir, name, ret);
+	if (result == 0) {
+		nc_enter(dir, namecopy, *ret, gen);
+	}
+	else if (result == ENOENT) {
+		nc_enter(dir, namecopy, NULL, gen);
+	}
+	return result;
+}
+
+/*
+ * Forget about NAME in DIR, after it has been created or removed.
+ */
+void
+vfs_namecache_remove(struct vnode *dir, const char *name)
+{
+	struct namecache *nc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	lock_acquire(nc_lock);
+	nc_gen++;
+	nc = nc_find(dir, name);
+	if (nc != NULL) {
+		nc_evict(nc, &olddir, &oldvn);
+		nc_removes++;
+	}
+	lock_release(nc_lock);
+
+	nc_drop(olddir, oldvn);
+}
+
+/*
+ * Forget everything involving volume FS.
+ */
+void
+vfs_namecache_purge(struct fs *fs)
+{
+	struct namecache *nc;
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	lock_acquire(nc_lock);
+	nc_gen++;
+	for (i=0; i<NC_SIZE; i++) {
+		nc = &nc_entries[i];
+		if (nc->nc_dir == NULL) {
+			continue;
+		}
+		if (nc->nc_dir->vn_fs != fs &&
+		    (nc->nc_vn == NULL || nc->nc_vn->vn_fs != fs)) {
+			continue;
+		}
+		nc_evict(nc, &olddir, &oldvn);
+		nc_removes++;
+
+		lock_release(nc_lock);
+		nc_drop(olddir, oldvn);
+		lock_acquire(nc_lock);
+	}
+	lock_release(nc_lock);
+}
+
+void
+vfs_namecache_printstats(void)
+{
+	unsigned lookups, pct;
+
+	lock_acquire(nc_lock);
+	lookups = nc_hits + nc_neghits + nc_misses;
+	pct = lookups == 0 ? 0 : (nc_hits + nc_neghits) * 100 / lookups;
+	kprintf("vfs: name cache: %u lookups, %u hits, %u negative hits, "
+		"%u misses (%u%% hit rate)\n",
+		lookups, nc_hits, nc_neghits, nc_misses, pct);
+	kprintf("vfs: name cache: %u entries made, %u removed\n",
+		nc_enters, nc_removes);
+	lock_release(nc_lock);
+}
+
+void
+vfs_namecache_bootstrap(void)
+{
+	unsigned i;
+
+	nc_lock = lock_create("vfs namecache");
+	if (nc_lock == NULL) {
+		panic("vfs: Could not create name cache lock\n");
+	}
+
+	nc_lruhead = nc_lrutail = NULL;
+	for (i=0; i<NC_SIZE; i++) {
+		nc_entries[i].nc_dir = NULL;
+		nc_entries[i].nc_vn = NULL;
+		nc_entries[i].nc_hashnext = NULL;
+		nc_entries[i].nc_lruprev = nc_lrutail;
+		nc_entries[i].nc_lrunext = NULL;
+		if (nc_lrutail != NULL) {
+			nc_lrutail->nc_lrunext = &nc_entries[i];
+		}
+		else {
+			nc_lruhead = &nc_entries[i];
+		}
+		nc_lrutail = &nc_entries[i];
+	}
+	for (i=0; i<NC_HASHSIZE; i++) {
+		nc_hash[i] = NULL;
+	}
+}
@@ -74,6 +74,10 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		if (result==0) {
+			/* The name may have been cached as nonexistent */
+			vfs_namecache_remove(dir, name);
+		}
 
 		VOP_DECREF(dir);
 	}
@@ -146,6 +150,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	vfs_namecache_remove(dir, name);
 	VOP_DECREF(dir);
 
 	return result;
@@ -179,6 +184,8 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	vfs_namecache_remove(olddir, oldname);
+	vfs_namecache_remove(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -213,6 +220,7 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	vfs_namecache_remove(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -240,6 +248,7 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	vfs_namecache_remove(newdir, newname);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -286,6 +295,7 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	vfs_namecache_remove(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -309,6 +319,18 @@ vfs_rmdir(char *path)
 
 	result = VOP_RMDIR(parent, name);
 
+	/*
+	 * Entries for names in the removed directory would keep it
+	 * from being reclaimed; rather than hunt for them, drop
+	 * everything on this volume. Removing directories is rare.
+	 */
+	if (parent->vn_fs != NULL) {
+		vfs_namecache_purge(parent->vn_fs);
+	}
+	else {
+		vfs_namecache_remove(parent, name);
+	}
+
 	VOP_DECREF(parent);
 
 	return result;
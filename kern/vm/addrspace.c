@@ -32,6 +32,7 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
@@ -65,10 +66,17 @@ as_create(void)
 	/* no regions initially*/
 	as->as_regions = NULL;
 
+	as->as_regionlock = rwlock_create("as_regions", RWLOCK_WRITERPREF);
+	if (as->as_regionlock == NULL) {
+		kfree(as);
+		return NULL; /* ENOMEM */
+	}
+
 	/* Initialise 3 Level Page Table */ 
 	as->as_pagetable = kmalloc(sizeof(paddr_t **) * PT_LVL1_SIZE);	
 	
 	if (as->as_pagetable == NULL) {
+		rwlock_destroy(as->as_regionlock);
 		kfree(as);
 		return NULL; /* ENOMEM */
 	}
@@ -142,6 +150,7 @@ as_destroy(struct addrspace *as)
 		kfree(to_free);
 	}
 
+	rwlock_destroy(as->as_regionlock);
 	kfree(as);
 }
 
@@ -240,12 +249,15 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	
 	new_regions->o_flags = new_regions->flags;
 
+	rwlock_acquire_write(as->as_regionlock);
+
 	/* add region to end of linked list */
 	struct as_region *curr = as->as_regions;
 
 	/* head of the list */
 	if (curr == NULL) {
 		as->as_regions = new_regions;
+		rwlock_release_write(as->as_regionlock);
 		return 0;
 	}
 
@@ -256,6 +268,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 
 	curr->next = new_regions;
 
+	rwlock_release_write(as->as_regionlock);
 	return 0;
 }
 
@@ -267,6 +280,7 @@ as_prepare_load(struct addrspace *as)
 	if (as == NULL) {
 		return EFAULT;
 	}
+	rwlock_acquire_write(as->as_regionlock);
 	region *old_regions = as->as_regions;
 
 	// loop through and set all readonly regions to readwrite for prepare load
@@ -276,6 +290,7 @@ as_prepare_load(struct addrspace *as)
 		}
 		old_regions = old_regions->next;
 	}
+	rwlock_release_write(as->as_regionlock);
 
 	return 0;
 }
@@ -289,6 +304,7 @@ as_complete_load(struct addrspace *as)
 		return EFAULT;
 	}
 
+	rwlock_acquire_write(as->as_regionlock);
 	region *old_regions = as->as_regions;
 	while (old_regions != NULL) {
 		// check if flags have been modified in prepare_load
@@ -301,6 +317,7 @@ as_complete_load(struct addrspace *as)
 			old_regions = old_regions->next;
 		}
 	}
+	rwlock_release_write(as->as_regionlock);
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	int spl = splhigh();
@@ -326,6 +343,24 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_map_page(struct addrspace *as, vaddr_t vaddr, vaddr_t kpage)
+{
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	/* must be somewhere the process is allowed to see */
+	region *r = lookup_region(as, vaddr);
+	if (r == NULL) {
+		return EFAULT;
+	}
+
+	uint32_t dirty = 0;
+	if ((r->flags & PF_W) == PF_W)
+		dirty = TLBLO_DIRTY;
+
+	return vm_insertPTE(as->as_pagetable, vaddr, kpage, dirty);
+}
+
 ////////////////////////////////////////////////////////////
 // 			HELPER FUNCTIONS
 ////////////////////////////////////////////////////////////
@@ -338,18 +373,22 @@ region *lookup_region(struct addrspace *as, vaddr_t faultaddress) {
 	    return NULL;
 	}
 
+    rwlock_acquire_read(as->as_regionlock);
+
     region *curr = as->as_regions;
 
     while (curr != NULL) {
 		if (faultaddress >= curr->as_vaddr) {
 			if ((faultaddress - curr->as_vaddr) < curr->size) {
-				return curr;
+				break;
 			}
 		}
         curr = curr->next;
 	}
 
-    return NULL;
+    rwlock_release_read(as->as_regionlock);
+
+    return curr;
 }
 
 paddr_t lookupPTE(struct addrspace *as, vaddr_t faultaddress) {
@@ -383,12 +422,15 @@ paddr_t lookupPTE(struct addrspace *as, vaddr_t faultaddress) {
 
 int copy_region(struct addrspace *old, struct addrspace *newas) {
 
+	rwlock_acquire_read(old->as_regionlock);
+
 	region *current = old->as_regions;  /* used to iterate over old_region list */
 	region *new_tail = NULL;	   		/* last node of the new list */
 	region *new_region = NULL;			/* stores the head of new_region */
 	
 	/* no regions in old address space */
 	if (current == NULL) {
+		rwlock_release_read(old->as_regionlock);
 		newas->as_regions = new_region;
 		return 0;
 	}
@@ -399,6 +441,8 @@ int copy_region(struct addrspace *old, struct addrspace *newas) {
 		region *new_node = create_copy_node(current);
 
 		if (new_node == NULL) {
+			rwlock_release_read(old->as_regionlock);
+			newas->as_regions = new_region;
 			return ENOMEM;
 		}
 
@@ -417,6 +461,8 @@ int copy_region(struct addrspace *old, struct addrspace *newas) {
 		current = current->next;
 	}
 
+	rwlock_release_read(old->as_regionlock);
+
 	newas->as_regions = new_region;
 	
 	return 0;
@@ -219,6 +219,28 @@ int vm_addPTE(paddr_t ***pagetable, vaddr_t faultaddress, uint32_t dirty) {
     return 0;
 }
 
+int vm_insertPTE(paddr_t ***pagetable, vaddr_t vaddr, vaddr_t kpage, uint32_t dirty) {
+
+    paddr_t p_vaddr = KVADDR_TO_PADDR(vaddr);
+
+    uint32_t msb = get_msb(p_vaddr);
+    uint32_t ssb = get_ssb(p_vaddr);
+    uint32_t lsb = get_lsb(p_vaddr);
+
+    int ret = vm_initPT(pagetable, vaddr);
+    if (ret)
+        return ret;
+
+    /* should not already be mapped */
+    KASSERT(pagetable[msb][ssb][lsb] == 0);
+
+    /* the page becomes the frame backing vaddr, so vm_freePT frees it */
+    paddr_t frame = KVADDR_TO_PADDR(kpage);
+    pagetable[msb][ssb][lsb] = (frame & PAGE_FRAME) | TLBLO_VALID | dirty;
+
+    return 0;
+}
+
 int vm_copyPTE(paddr_t ***old_pt, paddr_t ***new_pt) {
 
     /* no page table to copy */
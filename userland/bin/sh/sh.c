@@ -355,6 +355,39 @@ static struct {
 	{ NULL, NULL }
 };
 
+/*
+ * runcmd
+ * starts a program in a new process, returning its pid, or -1 with
+ * errno set. uses spawn so the child never has to copy our address
+ * space just to throw it away in exec.
+ */
+static
+pid_t
+runcmd(char **args)
+{
+#ifdef HOST
+	pid_t pid;
+
+	pid = fork();
+	if (pid == 0) {
+		/* child */
+		execvp(args[0], args);
+		warn("%s", args[0]);
+		/*
+		 * Use _exit() instead of exit() in the child
+		 * process to avoid calling atexit() functions,
+		 * which would cause hostcompat (if present) to
+		 * reset the tty state and mess up our input
+		 * handling.
+		 */
+		_exit(1);
+	}
+	return pid;
+#else
+	return spawnvp(args[0], args);
+#endif
+}
+
 /*
  * docommand
  * tokenizes the command line using strtok.  if there aren't any commands,
@@ -421,27 +454,11 @@ docommand(char *buf, struct exitinfo *ei)
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
-	switch (pid) {
-		case -1:
-			/* error */
-			warn("fork");
-			exitinfo_exit(ei, 255);
-			return;
-		case 0:
-			/* child */
-			execvp(args[0], args);
-			warn("%s", args[0]);
-			/*
-			 * Use _exit() instead of exit() in the child
-			 * process to avoid calling atexit() functions,
-			 * which would cause hostcompat (if present) to
-			 * reset the tty state and mess up our input
-			 * handling.
-			 */
-			_exit(1);
-		default:
-			break;
+	pid = runcmd(args);
+	if (pid < 0) {
+		warn("%s", args[0]);
+		exitinfo_exit(ei, 1);
+		return;
 	}
 
 	/* parent */
@@ -148,6 +148,12 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
 ssize_t __getcwd(char *buf, size_t buflen);
+pid_t spawn(const char *prog, char *const *args);
+ssize_t pread(int filehandle, void *buf, size_t size, off_t pos);
+ssize_t pwrite(int filehandle, const void *buf, size_t size, off_t pos);
+ssize_t sendfile(int outhandle, int inhandle, off_t *pos, size_t size);
+/* readv - see sys/uio.h */
+/* writev - see sys/uio.h */
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -156,6 +162,7 @@ ssize_t __getcwd(char *buf, size_t buflen);
  */
 
 int execvp(const char *prog, char *const *args); /* calls execv */
+pid_t spawnvp(const char *prog, char *const *args); /* calls spawn */
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
 
@@ -72,6 +72,7 @@ extern const char *hostcompat_progname;
 static bool dofiles, dodirs;
 static bool doindirect;
 static bool recurse;
+static uint32_t features;
 
 ////////////////////////////////////////////////////////////
 // printouts
@@ -142,6 +143,7 @@ readsb(void)
 	if (SWAP32(sb.sb_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	features = SWAP32(sb.sb_features);
 	return SWAP32(sb.sb_nblocks);
 }
 
@@ -163,6 +165,11 @@ dumpsb(void)
 		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
 	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
 	dumplval("Volume name", sb.sb_volname);
+	dumpvalf("Features", "0x%x%s%s", SWAP32(sb.sb_features),
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_EXTENTS) ?
+		 " extents" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_DIRHASH) ?
+		 " dirhash" : "");
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -230,8 +237,11 @@ dumpfreemap(uint32_t fsblocks)
 
 static
 void
-dumpindirect(uint32_t block)
+dumpindirect(uint32_t block, unsigned levels)
 {
+	static const char *const kinds[] = {
+		NULL, "Indirect", "Double indirect", "Triple indirect",
+	};
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	char tmp[128];
 	unsigned i;
@@ -239,7 +249,8 @@ dumpindirect(uint32_t block)
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	assert(levels > 0 && levels < ARRAYCOUNT(kinds));
+	printf("%s block %u\n", kinds[levels], block);
 
 	diskread(ib, block);
 	for (i=0; i<ARRAYCOUNT(ib); i++) {
@@ -253,12 +264,23 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+
+	if (levels > 1) {
+		for (i=0; i<ARRAYCOUNT(ib); i++) {
+			dumpindirect(SWAP32(ib[i]), levels - 1);
+		}
+	}
 }
 
+/*
+ * Call DOBLOCK on each of the file blocks mapped by indirect block
+ * BLOCK, which is LEVELS levels of indirection deep, starting at
+ * file block FILEBLOCK; stop at NUMBLOCKS.
+ */
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned levels, void (*doblock)(uint32_t, uint32_t))
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	unsigned i;
@@ -270,30 +292,88 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 		diskread(ib, block);
 	}
 	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+		if (levels > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), levels - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
 
+/*
+ * On volumes with extent tables, blocks in an extent show up as holes
+ * in the direct and indirect blocks. This sits between traverse_ib
+ * and the real DOBLOCK and fills them in.
+ */
+static const struct sfs_dinode *traverse_sfi;
+static void (*traverse_doblock)(uint32_t, uint32_t);
+
+static
+void
+traverse_block(uint32_t fileblock, uint32_t diskblock)
+{
+	const struct sfs_dextent *sfe;
+	uint32_t start, len;
+	unsigned i;
+
+	for (i=0; diskblock == 0 && i<SFS_NDEXTENTS; i++) {
+		sfe = &traverse_sfi->sfi_extents[i];
+		start = SWAP32(sfe->sfe_fileblock);
+		len = SWAP32(sfe->sfe_len);
+		if (fileblock >= start && fileblock - start < len) {
+			diskblock = SWAP32(sfe->sfe_diskblock) +
+				(fileblock - start);
+		}
+	}
+	traverse_doblock(fileblock, diskblock);
+}
+
 static
 void
 traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 {
+	/* DOBLOCK can get back here (with -r), so save these */
+	const struct sfs_dinode *oldsfi = traverse_sfi;
+	void (*olddoblock)(uint32_t, uint32_t) = traverse_doblock;
+
 	uint32_t fileblock;
 	uint32_t numblocks;
 	unsigned i;
 
 	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
 
+	if (features & SFS_FEATURE_EXTENTS) {
+		traverse_sfi = sfi;
+		traverse_doblock = doblock;
+		doblock = traverse_block;
+	}
+
 	fileblock = 0;
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
 		doblock(fileblock++, SWAP32(sfi->sfi_direct[i]));
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2,
+					doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3,
+					doblock);
 	}
 	assert(fileblock == numblocks);
+
+	traverse_sfi = oldsfi;
+	traverse_doblock = olddoblock;
 }
 
 static
@@ -476,6 +556,21 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
+	for (i=0; i<SFS_NDEXTENTS; i++) {
+		if (sfi.sfi_extents[i].sfe_len == 0) {
+			continue;
+		}
+		printf("    Extent %u: blocks %u-%u at %u (0x%x)\n", i,
+		       SWAP32(sfi.sfi_extents[i].sfe_fileblock),
+		       SWAP32(sfi.sfi_extents[i].sfe_fileblock) +
+		       SWAP32(sfi.sfi_extents[i].sfe_len) - 1,
+		       SWAP32(sfi.sfi_extents[i].sfe_diskblock),
+		       SWAP32(sfi.sfi_extents[i].sfe_diskblock));
+	}
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
@@ -484,7 +579,9 @@ dumpinode(uint32_t ino, const char *name)
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
@@ -125,7 +125,7 @@ initfreemap(uint32_t fsblocks)
  */
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks, uint32_t features)
 {
 	struct sfs_superblock sb;
 
@@ -140,6 +140,7 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	sb.sb_features = SWAP32(features);
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
@@ -183,26 +184,46 @@ writerootdir(void)
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
 }
 
+static
+void
+usage(void)
+{
+	warnx("Usage: mksfs [options] device/diskfile volume-name");
+	warnx("   -e: keep extent tables in inodes");
+	errx(1, "   -d: give large directories hash indexes");
+}
+
 /*
  * Main.
  */
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, features;
 	char *volname, *s;
+	int i, j;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
-	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+	features = 0;
+	for (i=1; i<argc && argv[i][0] == '-'; i++) {
+		for (j=1; argv[i][j]; j++) {
+			switch (argv[i][j]) {
+			    case 'e': features |= SFS_FEATURE_EXTENTS; break;
+			    case 'd': features |= SFS_FEATURE_DIRHASH; break;
+			    default: usage(); break;
+			}
+		}
+	}
+	if (argc - i != 2) {
+		usage();
 	}
 
 	check();
 
-	volname = argv[2];
+	volname = argv[i+1];
 
 	/* Remove one trailing colon from volname, if present */
 	s = strchr(volname, ':');
@@ -219,7 +240,7 @@ main(int argc, char **argv)
 		errx(1, "Illegal volume name %s", volname);
 	}
 
-	opendisk(argv[1]);
+	opendisk(argv[i]);
 	blocksize = diskblocksize();
 
 	if (blocksize!=SFS_BLOCKSIZE) {
@@ -230,7 +251,7 @@ main(int argc, char **argv)
 
 	/* Write out the on-disk structures */
 	initfreemap(size);
-	writesuper(volname, size);
+	writesuper(volname, size, features);
 	writefreemap(size);
 	writerootdir();
 
@@ -56,11 +56,164 @@ struct ibstate {
 	uint32_t ino;		/* inode we're doing (constant) */
 	uint32_t curfileblock;	/* current block offset in the file */
 	uint32_t fileblocks;	/* file size in blocks (constant) */
+	uint32_t idxstart;	/* 1st block of dir index, or 0 (constant) */
 	uint32_t volblocks;	/* volume size in blocks (constant) */
 	unsigned pasteofcount;	/* number of blocks found past eof */
+	unsigned dupcount;	/* number of blocks also in an extent */
 	blockusage_t usagetype;	/* how to call freemap_blockinuse() */
+	const struct sfs_dextent *extents; /* inode's extents (constant) */
 };
 
+/*
+ * Check if a file block is past EOF, and so shouldn't be there. The
+ * blocks of a directory's hash index don't count.
+ */
+static
+int
+pasteof(struct ibstate *ibs, uint32_t fileblock)
+{
+	if (fileblock < ibs->fileblocks) {
+		return 0;
+	}
+	if (ibs->idxstart != 0 && fileblock >= ibs->idxstart) {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Check if a file block is mapped by one of the inode's extents, in
+ * which case any block pointer for it in the direct or indirect
+ * blocks is bogus.
+ */
+static
+int
+inextent(struct ibstate *ibs, uint32_t fileblock)
+{
+	const struct sfs_dextent *sfe;
+	int i;
+
+	for (i=0; i<SFS_NDEXTENTS; i++) {
+		sfe = &ibs->extents[i];
+		if (sfe->sfe_len == 0) {
+			break;
+		}
+		if (fileblock >= sfe->sfe_fileblock &&
+		    fileblock - sfe->sfe_fileblock < sfe->sfe_len) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check the extent table of inode INO, recording the blocks that are
+ * in use. Extents that are empty, point outside the volume, or are
+ * out of order or overlap an earlier one are dropped, and the rest
+ * are packed at the front of the table; anything past EOF is cut off.
+ * On volumes without SFS_FEATURE_EXTENTS the table must be zeroed.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_extents(struct ibstate *ibs, struct sfs_dinode *sfi)
+{
+	struct sfs_dextent *ext = sfi->sfi_extents;
+	struct sfs_dextent sfe;
+	uint32_t j, keep, nextfileblock;
+	int i, n, changed = 0;
+
+	if ((sb_features() & SFS_FEATURE_EXTENTS) == 0) {
+		if (checkzeroed(ext, sizeof(sfi->sfi_extents))) {
+			warnx("Inode %lu: extent table not zeroed (fixed)",
+			      (unsigned long)ibs->ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+		return changed;
+	}
+
+	nextfileblock = 0;
+	for (i=n=0; i<SFS_NDEXTENTS; i++) {
+		sfe = ext[i];
+		if (sfe.sfe_len == 0) {
+			if (sfe.sfe_fileblock != 0 || sfe.sfe_diskblock != 0) {
+				warnx("Inode %lu: unused extent %d not zeroed "
+				      "(fixed)", (unsigned long)ibs->ino, i);
+				setbadness(EXIT_RECOV);
+				changed = 1;
+			}
+			continue;
+		}
+		if (sfe.sfe_diskblock == 0 ||
+		    sfe.sfe_diskblock >= ibs->volblocks ||
+		    sfe.sfe_len > ibs->volblocks - sfe.sfe_diskblock) {
+			warnx("Inode %lu: extent for blocks %lu-%lu outside "
+			      "of volume: %lu-%lu (cleared)",
+			      (unsigned long)ibs->ino,
+			      (unsigned long)sfe.sfe_fileblock,
+			      (unsigned long)(sfe.sfe_fileblock +
+					      sfe.sfe_len - 1),
+			      (unsigned long)sfe.sfe_diskblock,
+			      (unsigned long)(sfe.sfe_diskblock +
+					      sfe.sfe_len - 1));
+			setbadness(EXIT_RECOV);
+			changed = 1;
+			continue;
+		}
+		if (sfe.sfe_fileblock < nextfileblock) {
+			warnx("Inode %lu: extent for blocks %lu-%lu out of "
+			      "order or overlapping (cleared)",
+			      (unsigned long)ibs->ino,
+			      (unsigned long)sfe.sfe_fileblock,
+			      (unsigned long)(sfe.sfe_fileblock +
+					      sfe.sfe_len - 1));
+			setbadness(EXIT_RECOV);
+			changed = 1;
+			continue;
+		}
+
+		/* Keep the part before the first block past EOF */
+		for (keep=0; keep<sfe.sfe_len; keep++) {
+			if (pasteof(ibs, sfe.sfe_fileblock + keep)) {
+				break;
+			}
+		}
+		for (j=0; j<sfe.sfe_len; j++) {
+			if (j < keep) {
+				freemap_blockinuse(sfe.sfe_diskblock + j,
+						   ibs->usagetype, ibs->ino);
+			}
+			else {
+				ibs->pasteofcount++;
+				freemap_blockfree(sfe.sfe_diskblock + j);
+			}
+		}
+		if (keep == 0) {
+			changed = 1;
+			continue;
+		}
+		if (keep < sfe.sfe_len) {
+			sfe.sfe_len = keep;
+			changed = 1;
+		}
+
+		nextfileblock = sfe.sfe_fileblock + sfe.sfe_len;
+		if (n != i) {
+			changed = 1;
+		}
+		ext[n++] = sfe;
+	}
+	for (; n<SFS_NDEXTENTS; n++) {
+		ext[n].sfe_fileblock = 0;
+		ext[n].sfe_diskblock = 0;
+		ext[n].sfe_len = 0;
+	}
+	return changed;
+}
+
 /*
  * Traverse an indirect block, recording blocks that are in use,
  * dropping any entries that are past EOF, and clearing any entries
@@ -133,7 +286,14 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 				localchanged = 1;
 			}
 			else if (entries[i] != 0) {
-				if (ibs->curfileblock < ibs->fileblocks) {
+				if (inextent(ibs, ibs->curfileblock)) {
+					setbadness(EXIT_RECOV);
+					ibs->dupcount++;
+					freemap_blockfree(entries[i]);
+					entries[i] = 0;
+					localchanged = 1;
+				}
+				else if (!pasteof(ibs, ibs->curfileblock)) {
 					freemap_blockinuse(entries[i],
 							  ibs->usagetype,
 							  ibs->ino);
@@ -194,11 +354,17 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	ibs.ino = ino;
 	/*ibs.curfileblock = 0;*/
 	ibs.fileblocks = size/SFS_BLOCKSIZE;
+	ibs.idxstart = 0;
+	if (isdir && (sb_features() & SFS_FEATURE_DIRHASH)) {
+		ibs.idxstart = SFS_DIRINDEX_BLOCK;
+	}
 	ibs.volblocks = sb_totalblocks();
 	ibs.pasteofcount = 0;
+	ibs.dupcount = 0;
 	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
+	ibs.extents = sfi->sfi_extents;
 
-	changed = 0;
+	changed = check_inode_extents(&ibs, sfi);
 
 	for (ibs.curfileblock=0; ibs.curfileblock<NUM_D; ibs.curfileblock++) {
 		datablock = GET_D(sfi, ibs.curfileblock);
@@ -214,7 +380,14 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 			changed = 1;
 		}
 		else if (datablock > 0) {
-			if (ibs.curfileblock < ibs.fileblocks) {
+			if (inextent(&ibs, ibs.curfileblock)) {
+				setbadness(EXIT_RECOV);
+				ibs.dupcount++;
+				changed = 1;
+				freemap_blockfree(datablock);
+				SET_D(sfi, ibs.curfileblock) = 0;
+			}
+			else if (!pasteof(&ibs, ibs.curfileblock)) {
 				freemap_blockinuse(datablock, ibs.usagetype,
 						   ibs.ino);
 			}
@@ -243,6 +416,11 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 		     (unsigned long) ibs.ino, ibs.pasteofcount);
 		setbadness(EXIT_RECOV);
 	}
+	if (ibs.dupcount > 0) {
+		warnx("Inode %lu: %u block pointers for blocks also in "
+		      "extents (freed)", (unsigned long) ibs.ino, ibs.dupcount);
+		setbadness(EXIT_RECOV);
+	}
 
 	return changed;
 }
@@ -350,6 +528,120 @@ pass1_direntry(const char *path, uint32_t index, struct sfs_direntry *sfd)
 	return dchanged;
 }
 
+/*
+ * Check the hash index of a directory against its entries D (of
+ * which there are ND). If anything is wrong with it, drop it; the
+ * kernel builds a new one when it next adds a name.
+ */
+static
+void
+check_dirindex(const char *path, struct sfs_dinode *sfi,
+	       const struct sfs_direntry *d, uint32_t nd)
+{
+	struct sfs_dirhdr hdr;
+	uint32_t freeslots[SFS_DIRINDEX_NFREE];
+	struct sfs_dirbucket *table;
+	unsigned char *seen;
+	const char *problem;
+	uint32_t i, b, s, mask, nused, ndeleted;
+
+	sfs_readdirhdr(sfi, &hdr, freeslots);
+	if (hdr.sdh_magic == 0) {
+		/* No index */
+		return;
+	}
+
+	table = NULL;
+	seen = NULL;
+	problem = NULL;
+
+	if (hdr.sdh_magic != SFS_DIRINDEX_MAGIC) {
+		problem = "has bad magic number";
+		goto drop;
+	}
+	if (hdr.sdh_nbuckets < SFS_DIRB_PERBLOCK ||
+	    hdr.sdh_nbuckets > 4 * SFS_DIRINDEX_MAXSLOTS ||
+	    (hdr.sdh_nbuckets & (hdr.sdh_nbuckets - 1)) != 0) {
+		problem = "has bad table size";
+		goto drop;
+	}
+	if (hdr.sdh_count + hdr.sdh_ndeleted >= hdr.sdh_nbuckets ||
+	    hdr.sdh_nfree > SFS_DIRINDEX_NFREE) {
+		problem = "has bad counts";
+		goto drop;
+	}
+
+	table = domalloc(hdr.sdh_nbuckets * sizeof(table[0]));
+	for (i=0; i<hdr.sdh_nbuckets / SFS_DIRB_PERBLOCK; i++) {
+		sfs_readdirbuckets(sfi, i, &table[i * SFS_DIRB_PERBLOCK]);
+	}
+	seen = domalloc(nd + 1);
+	memset(seen, 0, nd + 1);
+
+	mask = hdr.sdh_nbuckets - 1;
+	nused = ndeleted = 0;
+	for (b=0; b<hdr.sdh_nbuckets; b++) {
+		if (table[b].sdb_slot == SFS_DIRB_EMPTY) {
+			continue;
+		}
+		if (table[b].sdb_slot == SFS_DIRB_DELETED) {
+			ndeleted++;
+			continue;
+		}
+		s = table[b].sdb_slot - 1;
+		if (s >= nd || d[s].sfd_ino == SFS_NOINO) {
+			problem = "lists an empty slot";
+			goto drop;
+		}
+		if (seen[s]) {
+			problem = "lists a slot twice";
+			goto drop;
+		}
+		seen[s] = 1;
+		if (table[b].sdb_hash != sfsdir_hash(d[s].sfd_name)) {
+			problem = "has a wrong hash";
+			goto drop;
+		}
+		/* A search for it would stop at an empty bucket */
+		for (i = table[b].sdb_hash & mask; i != b; i = (i + 1) & mask) {
+			if (table[i].sdb_slot == SFS_DIRB_EMPTY) {
+				problem = "has a name out of place";
+				goto drop;
+			}
+		}
+		nused++;
+	}
+	if (nused != hdr.sdh_count || ndeleted != hdr.sdh_ndeleted) {
+		problem = "has wrong counts";
+		goto drop;
+	}
+	for (s=0; s<nd; s++) {
+		if (d[s].sfd_ino != SFS_NOINO && !seen[s]) {
+			problem = "is missing a name";
+			goto drop;
+		}
+	}
+	for (i=0; i<hdr.sdh_nfree; i++) {
+		s = freeslots[i];
+		if (s >= nd || d[s].sfd_ino != SFS_NOINO || seen[s]) {
+			problem = "lists a used slot as empty";
+			goto drop;
+		}
+		seen[s] = 1;
+	}
+
+	free(table);
+	free(seen);
+	return;
+
+ drop:
+	setbadness(EXIT_RECOV);
+	warnx("Directory %s: hash index %s (dropped)", path, problem);
+	sfs_dropdirindex(sfi);
+	free(table);
+	free(seen);
+}
+
 /*
  * Check a directory. INO is the inode number; PATHSOFAR is the path
  * to this directory. This traverses the volume directory tree
@@ -436,8 +728,12 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 	}
 
 	if (dchanged) {
+		/* This also drops any hash index */
 		sfs_writedir(&sfi, direntries, ndirentries);
 	}
+	else if (sb_features() & SFS_FEATURE_DIRHASH) {
+		check_dirindex(pathsofar, &sfi, direntries, ndirentries);
+	}
 
 	free(direntries);
 }
@@ -55,6 +55,11 @@ sb_load(void)
 		errx(EXIT_FATAL, "Not an sfs filesystem");
 	}
 
+	if (sb.sb_features & ~SFS_FEATURES_KNOWN) {
+		errx(EXIT_FATAL, "Unsupported features 0x%lx in superblock",
+		     (unsigned long)(sb.sb_features & ~SFS_FEATURES_KNOWN));
+	}
+
 	assert(sb.sb_nblocks > 0);
 	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks) > 0);
 }
@@ -122,3 +127,12 @@ sb_volname(void)
 {
 	return sb.sb_volname;
 }
+
+/*
+ * Return the feature flags (SFS_FEATURE_*).
+ */
+uint32_t
+sb_features(void)
+{
+	return sb.sb_features;
+}
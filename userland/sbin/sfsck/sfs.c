@@ -62,6 +62,7 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_features = SWAP32(sb->sb_features);
 }
 
 static
@@ -97,6 +98,15 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	for (i=0; i<SFS_NDEXTENTS; i++) {
+		sfi->sfi_extents[i].sfe_fileblock =
+			SWAP32(sfi->sfi_extents[i].sfe_fileblock);
+		sfi->sfi_extents[i].sfe_diskblock =
+			SWAP32(sfi->sfi_extents[i].sfe_diskblock);
+		sfi->sfi_extents[i].sfe_len =
+			SWAP32(sfi->sfi_extents[i].sfe_len);
+	}
 }
 
 static
@@ -156,12 +166,26 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
  * bmap() for SFS.
  *
  * Given an inode and a file block, returns a disk block.
+ *
+ * The extent table is only used on volumes with SFS_FEATURE_EXTENTS;
+ * pass1 clears it on other volumes before anything gets here.
  */
 static
 uint32_t
 bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 {
+	const struct sfs_dextent *sfe;
 	uint32_t iblock, offset;
+	int i;
+
+	for (i=0; i<SFS_NDEXTENTS; i++) {
+		sfe = &sfi->sfi_extents[i];
+		if (fileblock >= sfe->sfe_fileblock &&
+		    fileblock - sfe->sfe_fileblock < sfe->sfe_len) {
+			return sfe->sfe_diskblock +
+				(fileblock - sfe->sfe_fileblock);
+		}
+	}
 
 	if (fileblock < INOMAX_D) {
 		return GET_D(sfi, fileblock);
@@ -389,6 +413,88 @@ sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 		left -= thismany;
 	}
 	assert(left == 0);
+
+	/* Any hash index no longer matches */
+	sfs_dropdirindex(sfi);
+}
+
+////////////////////////////////////////////////////////////
+// directory hash index
+
+/*
+ * Read the hash index header of the directory whose inode is SFI,
+ * and the list of empty slots after it, into HDR and FREESLOTS. If
+ * the block isn't there, it reads as zeros (no index).
+ */
+void
+sfs_readdirhdr(const struct sfs_dinode *sfi, struct sfs_dirhdr *hdr,
+	       uint32_t *freeslots)
+{
+	uint32_t data[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t diskblock;
+	unsigned i;
+
+	diskblock = bmap(sfi, SFS_DIRINDEX_BLOCK);
+	if (diskblock == 0) {
+		bzero(data, sizeof(data));
+	}
+	else {
+		diskread(data, diskblock);
+	}
+	memcpy(hdr, data, sizeof(*hdr));
+	hdr->sdh_magic = SWAP32(hdr->sdh_magic);
+	hdr->sdh_nbuckets = SWAP32(hdr->sdh_nbuckets);
+	hdr->sdh_count = SWAP32(hdr->sdh_count);
+	hdr->sdh_ndeleted = SWAP32(hdr->sdh_ndeleted);
+	hdr->sdh_nfree = SWAP32(hdr->sdh_nfree);
+	for (i=0; i<SFS_DIRINDEX_NFREE; i++) {
+		freeslots[i] = SWAP32(data[sizeof(*hdr)/sizeof(uint32_t) + i]);
+	}
+}
+
+/*
+ * Read block WHICHBLOCK of the hash index's table of buckets.
+ */
+void
+sfs_readdirbuckets(const struct sfs_dinode *sfi, uint32_t whichblock,
+		   struct sfs_dirbucket *sdb)
+{
+	uint32_t diskblock;
+	unsigned i;
+
+	diskblock = bmap(sfi, SFS_DIRINDEX_BLOCK + 1 + whichblock);
+	if (diskblock == 0) {
+		bzero(sdb, SFS_BLOCKSIZE);
+		return;
+	}
+	diskread(sdb, diskblock);
+	for (i=0; i<SFS_DIRB_PERBLOCK; i++) {
+		sdb[i].sdb_hash = SWAP32(sdb[i].sdb_hash);
+		sdb[i].sdb_slot = SWAP32(sdb[i].sdb_slot);
+	}
+}
+
+/*
+ * Throw away the hash index of a directory, if it has one (or has a
+ * garbage header), by clearing the header; the kernel builds a new one when it next
+ * adds a name. The blocks stay with the directory, and get reused.
+ */
+void
+sfs_dropdirindex(const struct sfs_dinode *sfi)
+{
+	uint32_t data[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t diskblock;
+
+	diskblock = bmap(sfi, SFS_DIRINDEX_BLOCK);
+	if (diskblock == 0) {
+		return;
+	}
+	diskread(data, diskblock);
+	if (data[0] == 0) {
+		return;
+	}
+	bzero(data, sizeof(data));
+	diskwrite(data, diskblock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -442,6 +548,22 @@ sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector)
 	qsort(vector, nd, sizeof(int), dirsortfunc);
 }
 
+/*
+ * Hash a name for the directory hash index. This must be the same as
+ * sfs_dirhash_name in the kernel: 32-bit FNV-1a.
+ */
+uint32_t
+sfsdir_hash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
 /*
  * Try to add an entry NAME/INO to D (which has ND entries) by
  * finding an empty slot. Cannot allocate new space.
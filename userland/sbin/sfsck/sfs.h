@@ -41,6 +41,8 @@
 struct sfs_superblock;
 struct sfs_dinode;
 struct sfs_direntry;
+struct sfs_dirhdr;
+struct sfs_dirbucket;
 
 /* Call this before anything else in this module */
 void sfs_setup(void);
@@ -70,6 +72,16 @@ void sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
 void sfs_writedir(const struct sfs_dinode *sfi,
 		  struct sfs_direntry *d, unsigned nd);
 
+/* directory hash index; writing a directory drops its index */
+void sfs_readdirhdr(const struct sfs_dinode *sfi, struct sfs_dirhdr *hdr,
+		    uint32_t *freeslots);
+void sfs_readdirbuckets(const struct sfs_dinode *sfi, uint32_t whichblock,
+			struct sfs_dirbucket *sdb);
+void sfs_dropdirindex(const struct sfs_dinode *sfi);
+
+/* Hash a name the way the directory hash index does. */
+uint32_t sfsdir_hash(const char *name);
+
 /* Try to add an entry to a directory. */
 int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 		  const char *name, uint32_t ino);
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * aiotest.c
+ *
+ * Checks aio_setup and aio_enter: writes a file in several pieces
+ * at once, reads it back the same way, and checks that a bad
+ * submission fails in its completion rather than in aio_enter.
+ */
+
+#include <sys/types.h>
+#include <sys/aio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+
+#define TESTFILE "aiotestfile"
+#define NENTRIES 8
+#define CHUNK 512
+
+static char ringspace[AIO_RINGSIZE(NENTRIES)];
+static char wbuf[NENTRIES][CHUNK];
+static char rbuf[NENTRIES][CHUNK];
+
+static struct aio_ring *ring = (struct aio_ring *)ringspace;
+
+/*
+ * Queue an operation.
+ */
+static
+void
+submit(int fd, int op, void *buf, size_t len, off_t pos, unsigned tag)
+{
+	struct aio_sqe *sqe;
+
+	sqe = &AIO_RING_SQ(ring)[ring->ar_sqtail % NENTRIES];
+	sqe->sqe_offset = pos;
+	sqe->sqe_buf = buf;
+	sqe->sqe_len = len;
+	sqe->sqe_fd = fd;
+	sqe->sqe_op = op;
+	sqe->sqe_tag = tag;
+	sqe->sqe_reserved = 0;
+	ring->ar_sqtail++;
+}
+
+/*
+ * Start N queued operations, wait for them all, and check each one
+ * got RESULT. Tags must be 0..N-1.
+ */
+static
+void
+runall(unsigned n, int result, const char *what)
+{
+	struct aio_cqe *cqe;
+	unsigned seen, i;
+	int r;
+
+	r = aio_enter(n, n);
+	if (r < 0) {
+		err(1, "%s: aio_enter", what);
+	}
+	if ((unsigned)r != n) {
+		errx(1, "%s: submitted %d of %u", what, r, n);
+	}
+	if (ring->ar_cqtail - ring->ar_cqhead != n) {
+		errx(1, "%s: %u completions, expected %u", what,
+		     ring->ar_cqtail - ring->ar_cqhead, n);
+	}
+
+	seen = 0;
+	for (i=0; i<n; i++) {
+		cqe = &AIO_RING_CQ(ring, NENTRIES)[ring->ar_cqhead % NENTRIES];
+		if (cqe->cqe_tag >= n || (seen & (1U << cqe->cqe_tag))) {
+			errx(1, "%s: bad tag %u", what, cqe->cqe_tag);
+		}
+		seen |= 1U << cqe->cqe_tag;
+		if (cqe->cqe_result != result) {
+			errx(1, "%s: tag %u: result %d, expected %d", what,
+			     cqe->cqe_tag, cqe->cqe_result, result);
+		}
+		ring->ar_cqhead++;
+	}
+}
+
+int
+main(void)
+{
+	unsigned i;
+	int fd;
+
+	fd = open(TESTFILE, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", TESTFILE);
+	}
+
+	if (aio_setup(ring, NENTRIES) < 0) {
+		err(1, "aio_setup");
+	}
+	if (aio_setup(ring, NENTRIES) == 0 || errno != EBUSY) {
+		errx(1, "second aio_setup didn't fail with EBUSY");
+	}
+
+	for (i=0; i<NENTRIES; i++) {
+		memset(wbuf[i], 'a' + i, CHUNK);
+		submit(fd, AIO_OP_WRITE, wbuf[i], CHUNK, i * CHUNK, i);
+	}
+	runall(NENTRIES, CHUNK, "write");
+
+	submit(fd, AIO_OP_FSYNC, NULL, 0, 0, 0);
+	runall(1, 0, "fsync");
+
+	for (i=0; i<NENTRIES; i++) {
+		submit(fd, AIO_OP_READ, rbuf[i], CHUNK, i * CHUNK, i);
+	}
+	runall(NENTRIES, CHUNK, "read");
+	for (i=0; i<NENTRIES; i++) {
+		if (memcmp(rbuf[i], wbuf[i], CHUNK) != 0) {
+			errx(1, "read: chunk %u has the wrong data", i);
+		}
+	}
+
+	/* past EOF */
+	submit(fd, AIO_OP_READ, rbuf[0], CHUNK, NENTRIES * CHUNK, 0);
+	runall(1, 0, "read at EOF");
+
+	/* bad handle */
+	submit(-1, AIO_OP_READ, rbuf[0], CHUNK, 0, 0);
+	runall(1, -EBADF, "bad fd");
+
+	/* not seekable; a console read could block forever */
+	submit(STDIN_FILENO, AIO_OP_READ, rbuf[0], CHUNK, 0, 0);
+	runall(1, -ESPIPE, "console read");
+
+	close(fd);
+	remove(TESTFILE);
+	printf("aiotest: passed\n");
+	return 0;
+}
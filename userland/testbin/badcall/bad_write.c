@@ -31,11 +31,79 @@
  * Invalid calls to write()
  */
 
+#include <sys/types.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "config.h"
 #include "test.h"
 
+/* One file system block */
+#define BLOCKSIZE	512
+
+/* Enough blocks to push the first one out of the kernel's cache */
+#define EVICTBLOCKS	320
+
+/*
+ * Overwrite a whole block that isn't cached from a bad buffer, then
+ * check that the block still reads back as what was there before,
+ * and not as junk from the failed write.
+ */
+static
+void
+write_wholeblock(void)
+{
+	char buf[BLOCKSIZE], buf2[BLOCKSIZE];
+	int fd, rv, i;
+
+	report_begin("setting up whole-block write test");
+	fd = open_testfile(NULL);
+	if (fd<0) {
+		report_aborted();
+		return;
+	}
+	memset(buf, 'w', sizeof(buf));
+	for (i=0; i<EVICTBLOCKS; i++) {
+		rv = write(fd, buf, sizeof(buf));
+		if (rv != (int)sizeof(buf)) {
+			report_result(rv, errno);
+			report_aborted();
+			close(fd);
+			remove(TESTFILE);
+			return;
+		}
+	}
+	report_passed();
+
+	report_begin("write whole block with invalid buffer");
+	lseek(fd, 0, SEEK_SET);
+	rv = write(fd, INVAL_PTR, BLOCKSIZE);
+	report_check(rv, errno, EFAULT);
+
+	report_begin("read back block after failed write");
+	lseek(fd, 0, SEEK_SET);
+	rv = read(fd, buf2, sizeof(buf2));
+	if (rv != (int)sizeof(buf2)) {
+		report_result(rv, errno);
+		report_failure();
+	}
+	else if (memcmp(buf, buf2, sizeof(buf))) {
+		report_warnx("block contents changed");
+		report_failure();
+	}
+	else {
+		report_passed();
+	}
+
+	close(fd);
+	remove(TESTFILE);
+}
+
 void
 test_write(void)
 {
 	test_write_fd();
 	test_write_buf();
+	write_wholeblock();
 }
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2011
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * execbench.c
+ *
+ * Times exec against the size of the argv being passed, from nothing
+ * up to nearly ARG_MAX, with both a few long arguments and many short
+ * ones.
+ *
+ * Each run spawns a copy of this program that exits immediately, so
+ * what's measured is process creation, exec and exit.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <err.h>
+
+#define _PATH_MYSELF "/testbin/execbench"
+#define CHILDFLAG "-child"
+
+#define ITERATIONS 20
+#define MAXARGS 256
+
+static char argspace[ARG_MAX];
+static char *args[MAXARGS + 3];
+
+/*
+ * Set up args with NARGS arguments of ARGLEN characters each.
+ */
+static
+void
+setup(unsigned nargs, unsigned arglen)
+{
+	unsigned i;
+	char *s;
+
+	args[0] = (char *)_PATH_MYSELF;
+	args[1] = (char *)CHILDFLAG;
+
+	s = argspace;
+	for (i=0; i<nargs; i++) {
+		memset(s, 'a' + i % 26, arglen);
+		s[arglen] = 0;
+		args[i+2] = s;
+		s += arglen + 1;
+	}
+	args[nargs+2] = NULL;
+}
+
+/*
+ * Run the current args ITERATIONS times and print the average time.
+ */
+static
+void
+run(unsigned nargs, unsigned arglen)
+{
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long usecs;
+	unsigned i;
+	pid_t pid;
+	int status;
+
+	setup(nargs, arglen);
+
+	__time(&startsecs, &startnsecs);
+	for (i=0; i<ITERATIONS; i++) {
+		pid = spawn(_PATH_MYSELF, args);
+		if (pid < 0) {
+			err(1, "spawn");
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "child failed");
+		}
+	}
+	__time(&endsecs, &endnsecs);
+
+	if (endnsecs < startnsecs) {
+		endnsecs += 1000000000;
+		endsecs--;
+	}
+	usecs = (endsecs - startsecs) * 1000000 +
+		(endnsecs - startnsecs) / 1000;
+
+	printf("%4u args x %4u bytes (%5u total): %lu us per exec\n",
+	       nargs, arglen, nargs * (arglen + 1), usecs / ITERATIONS);
+}
+
+int
+main(int argc, char *argv[])
+{
+	/* leave room for argv[0] and argv[1] */
+	const unsigned room = ARG_MAX - sizeof(_PATH_MYSELF) -
+		sizeof(CHILDFLAG);
+
+	if (argc > 1 && !strcmp(argv[1], CHILDFLAG)) {
+		return 0;
+	}
+
+	printf("execbench: %d runs each\n", ITERATIONS);
+
+	run(0, 0);
+	run(1, 16);
+	run(1, 256);
+	run(1, room / 4 - 1);
+	run(1, room / 2 - 1);
+	run(1, room - 1);
+	run(16, 15);
+	run(64, 15);
+	run(MAXARGS, room / MAXARGS - 1);
+
+	return 0;
+}
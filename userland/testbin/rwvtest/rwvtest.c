@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * rwvtest.c
+ *
+ * Checks readv, writev, pread, and pwrite, including that the
+ * positional calls leave the seek position alone.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+
+#define TESTFILE "rwvtestfile"
+
+static
+void
+checkpos(int fd, off_t expected, const char *what)
+{
+	off_t pos;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0) {
+		err(1, "lseek");
+	}
+	if (pos != expected) {
+		errx(1, "%s: seek position %ld, expected %ld", what,
+		     (long)pos, (long)expected);
+	}
+}
+
+static
+void
+checkdata(const char *got, const char *expected, size_t len,
+	  const char *what)
+{
+	if (memcmp(got, expected, len) != 0) {
+		errx(1, "%s: got the wrong data", what);
+	}
+}
+
+int
+main(void)
+{
+	static const char expected[] = "XXllo, scattered gather";
+	char a[4], b[11], c[9], buf[16];
+	struct iovec iov[3];
+	ssize_t r;
+	int fd;
+
+	fd = open(TESTFILE, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+
+	/* writev */
+	iov[0].iov_base = (void *)"hello, ";
+	iov[0].iov_len = 7;
+	iov[1].iov_base = (void *)"scattered ";
+	iov[1].iov_len = 10;
+	iov[2].iov_base = (void *)"gather";
+	iov[2].iov_len = 6;
+	r = writev(fd, iov, 3);
+	if (r < 0) {
+		err(1, "writev");
+	}
+	if (r != 23) {
+		errx(1, "writev: short count %ld", (long)r);
+	}
+	checkpos(fd, 23, "writev");
+
+	/* pwrite shouldn't move the seek position */
+	r = pwrite(fd, "XX", 2, 0);
+	if (r != 2) {
+		err(1, "pwrite");
+	}
+	checkpos(fd, 23, "pwrite");
+
+	/* nor should pread */
+	r = pread(fd, buf, 9, 7);
+	if (r != 9) {
+		err(1, "pread");
+	}
+	checkdata(buf, expected + 7, 9, "pread");
+	checkpos(fd, 23, "pread");
+
+	/* readv the whole thing back */
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	iov[0].iov_base = a;
+	iov[0].iov_len = sizeof(a);
+	iov[1].iov_base = b;
+	iov[1].iov_len = sizeof(b);
+	iov[2].iov_base = c;
+	iov[2].iov_len = sizeof(c);
+	r = readv(fd, iov, 3);
+	if (r < 0) {
+		err(1, "readv");
+	}
+	if (r != 23) {
+		errx(1, "readv: short count %ld", (long)r);
+	}
+	checkdata(a, expected, sizeof(a), "readv");
+	checkdata(b, expected + sizeof(a), sizeof(b), "readv");
+	checkdata(c, expected + sizeof(a) + sizeof(b), 8, "readv");
+	checkpos(fd, 23, "readv");
+
+	/* bad positions */
+	r = pread(fd, buf, 1, -1);
+	if (r >= 0 || errno != EINVAL) {
+		errx(1, "pread at negative offset didn't fail with EINVAL");
+	}
+	r = pread(STDIN_FILENO, buf, 1, 0);
+	if (r >= 0 || errno != ESPIPE) {
+		errx(1, "pread on console didn't fail with ESPIPE");
+	}
+
+	close(fd);
+	remove(TESTFILE);
+
+	printf("rwvtest: Passed.\n");
+	return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * seqread.c
+ *
+ * Writes a large file and then times reading it back sequentially
+ * with a few different transfer sizes. The default size, 9M, is big
+ * enough to need SFS's double and triple indirect blocks.
+ *
+ * Usage: seqread [filename [size-in-KB]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define DEFAULT_FILE	"seqreadfile"
+#define DEFAULT_KB	9216
+#define MAXCHUNK	65536
+
+static char buf[MAXCHUNK];
+
+/*
+ * Fill BUF with the pattern for file offset POS.
+ */
+static
+void
+fill(char *p, size_t len, off_t pos)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		p[i] = (char)((pos + i) / 512 * 7 + (pos + i));
+	}
+}
+
+/*
+ * Check BUF against the pattern for file offset POS.
+ */
+static
+void
+check(const char *p, size_t len, off_t pos)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (p[i] != (char)((pos + i) / 512 * 7 + (pos + i))) {
+			errx(1, "Wrong data at offset %lld",
+			     (long long)(pos + i));
+		}
+	}
+}
+
+/*
+ * Microseconds since START.
+ */
+static
+unsigned long
+elapsed(time_t startsecs, unsigned long startnsecs)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	if (nsecs < startnsecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	return (secs - startsecs) * 1000000 + (nsecs - startnsecs) / 1000;
+}
+
+static
+void
+report(const char *what, size_t chunk, off_t size, unsigned long usecs)
+{
+	unsigned long kb = size / 1024;
+
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	printf("%-5s %5u-byte chunks: %lu KB in %lu.%03lu s, %lu KB/s\n",
+	       what, (unsigned)chunk, kb, usecs / 1000000,
+	       usecs / 1000 % 1000,
+	       (unsigned long)((unsigned long long)kb * 1000000 / usecs));
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const size_t chunks[] = { 512, 4096, MAXCHUNK };
+
+	const char *filename = DEFAULT_FILE;
+	off_t size = (off_t)DEFAULT_KB * 1024;
+	time_t startsecs;
+	unsigned long startnsecs;
+	off_t pos;
+	size_t len;
+	ssize_t r;
+	unsigned i;
+	int fd;
+
+	if (argc > 1) {
+		filename = argv[1];
+	}
+	if (argc > 2) {
+		size = (off_t)atoi(argv[2]) * 1024;
+	}
+	if (argc > 3 || size <= 0) {
+		errx(1, "Usage: seqread [filename [size-in-KB]]");
+	}
+
+	fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", filename);
+	}
+	__time(&startsecs, &startnsecs);
+	for (pos = 0; pos < size; pos += len) {
+		len = MAXCHUNK;
+		if (size - pos < (off_t)len) {
+			len = size - pos;
+		}
+		fill(buf, len, pos);
+		r = write(fd, buf, len);
+		if (r < 0) {
+			err(1, "%s: write", filename);
+		}
+		if ((size_t)r != len) {
+			errx(1, "%s: short write at %lld", filename,
+			     (long long)pos);
+		}
+	}
+	if (fsync(fd) < 0) {
+		err(1, "%s: fsync", filename);
+	}
+	report("write", MAXCHUNK, size, elapsed(startsecs, startnsecs));
+	close(fd);
+
+	for (i=0; i<sizeof(chunks)/sizeof(chunks[0]); i++) {
+		fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			err(1, "%s", filename);
+		}
+		__time(&startsecs, &startnsecs);
+		for (pos = 0; pos < size; pos += r) {
+			r = read(fd, buf, chunks[i]);
+			if (r < 0) {
+				err(1, "%s: read", filename);
+			}
+			if (r == 0) {
+				errx(1, "%s: unexpected EOF at %lld",
+				     filename, (long long)pos);
+			}
+			check(buf, r, pos);
+		}
+		report("read", chunks[i], size,
+		       elapsed(startsecs, startnsecs));
+		close(fd);
+	}
+
+	if (remove(filename) < 0) {
+		err(1, "%s: remove", filename);
+	}
+	return 0;
+}